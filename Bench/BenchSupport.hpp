@@ -0,0 +1,45 @@
+//
+// Created by chineseblack23 on 2024/6/28.
+//性能测试公共部分
+//
+
+#ifndef APOLLO_BENCHSUPPORT_HPP
+#define APOLLO_BENCHSUPPORT_HPP
+
+#include <cstdlib>
+#include <cstring>
+#include <new>
+
+/**
+ * Shared by the bench executables. Including this header replaces the global
+ * operator new and delete with versions that count calls and bytes, so it
+ * must be included by exactly one translation unit of each executable.
+ */
+
+static size_t heapAllocs = 0;
+static size_t heapBytes = 0;
+
+void *operator new(size_t size) {
+    heapAllocs++;
+    heapBytes += size;
+    if (void *p = std::malloc(size == 0 ? 1 : size)) {
+        return p;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+
+// Matches arg against --name=value and points value at the text after '='
+inline bool readOption(const char *arg, const char *name, const char *&value) {
+    size_t n = std::strlen(name);
+    if (std::strncmp(arg, name, n) != 0 || arg[n] != '=') {
+        return false;
+    }
+    value = arg + n + 1;
+    return true;
+}
+
+#endif //APOLLO_BENCHSUPPORT_HPP
@@ -0,0 +1,229 @@
+//
+// Created by chineseblack23 on 2024/6/27.
+//前端(词法/语法分析)性能测试
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+#include "BenchSupport.hpp"
+#include "Parser.hpp"
+#include "SourceBuffer.hpp"
+#include "apollo.hpp"
+
+#if !defined(_WIN32)
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#endif
+
+/**
+ * apollo_bench_frontend [--size=<MB>] [--iterations=<n>] [--corpus=<name>]
+ *
+ * Generates synthetic sources and times Parser::countTokens (lexer only)
+ * and Parser::parse (lexer + parser) on them. For each run it reports
+ * throughput, the bytes requested through operator new plus the bytes
+ * carved out of the AST arena, and the peak RSS. On POSIX every measurement
+ * runs in a forked child so the peak RSS belongs to that phase alone.
+ */
+
+namespace {
+    struct Corpus {
+        const char *name;
+
+        std::function<void(std::string &, size_t)> emit;
+    };
+
+    // x0 = ((((a0 + 1) * (b0 - 2)) / ...)), nested `depth` levels
+    void emitDeepExpression(std::string &out, size_t i) {
+        constexpr int depth = 48;
+        static const char *ops[] = {" + ", " * ", " - ", " / ", " < ", " == "};
+        std::string id = std::to_string(i);
+        out += "x" + id + " = ";
+        for (int d = 0; d < depth; d++) {
+            out += '(';
+        }
+        out += "a" + id;
+        for (int d = 0; d < depth; d++) {
+            out += ops[d % 6];
+            out += std::to_string(d + 1);
+            out += ')';
+        }
+        out += '\n';
+    }
+
+    // One function with a few hundred statements in its body
+    void emitLongFunction(std::string &out, size_t i) {
+        constexpr int statements = 256;
+        std::string id = std::to_string(i);
+        out += "func f" + id + "(a, b, c) {\n";
+        for (int s = 0; s < statements; s++) {
+            std::string n = std::to_string(s);
+            switch (s % 4) {
+                case 0:
+                    out += "    v" + n + " = a * " + n + " + b\n";
+                    break;
+                case 1:
+                    out += "    if (a < " + n + ") { b += c } else { c -= 1 }\n";
+                    break;
+                case 2:
+                    out += "    while (c > 0) { c -= 1 if (c == " + n + ") { break } }\n";
+                    break;
+                default:
+                    out += "    arr" + n + " = [a, b, c, " + n + "]\n";
+                    break;
+            }
+        }
+        out += "    return a + b + c\n}\n";
+    }
+
+    void emitStrings(std::string &out, size_t i) {
+        std::string id = std::to_string(i);
+        out += "s" + id + " = \"the quick brown fox jumps over the lazy dog " + id + "\" + "
+               "\"pack my box with five dozen liquor jugs\" + 'x' + \"" + std::string(96, 'z') + "\"\n";
+    }
+
+    void emitComments(std::string &out, size_t i) {
+        std::string id = std::to_string(i);
+        out += "# block " + id + ": a comment line that the lexer has to skip over in one go\n";
+        out += "# " + std::string(100, '-') + "\n";
+        out += "c" + id + " = " + id + "\n";
+    }
+
+    const Corpus corpora[] = {
+            {"deep-expr",   emitDeepExpression},
+            {"long-func",   emitLongFunction},
+            {"strings",     emitStrings},
+            {"comments",    emitComments},
+    };
+
+    std::string generate(const Corpus &corpus, size_t targetBytes) {
+        std::string out;
+        out.reserve(targetBytes + 64 * 1024);
+        for (size_t i = 0; out.size() < targetBytes; i++) {
+            corpus.emit(out, i);
+        }
+        return out;
+    }
+
+    long peakRssKb() {
+#if !defined(_WIN32)
+        rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_maxrss;
+#else
+        return 0;
+#endif
+    }
+
+    struct Sample {
+        double seconds = 0;
+        size_t tokens = 0;
+        size_t nodes = 0;
+        size_t heap = 0;
+        size_t arena = 0;
+    };
+
+    Sample lexOnce(const std::string &text) {
+        auto source = SourceBuffer::fromString(text, "<bench>");
+        size_t heapBefore = heapBytes;
+        auto begin = std::chrono::steady_clock::now();
+        Sample sample;
+        sample.tokens = Parser::countTokens(std::move(source));
+        sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        sample.heap = heapBytes - heapBefore;
+        return sample;
+    }
+
+    Sample parseOnce(const std::string &text, size_t tokens) {
+        auto source = SourceBuffer::fromString(text, "<bench>");
+        size_t heapBefore = heapBytes;
+        auto begin = std::chrono::steady_clock::now();
+        Sample sample;
+        {
+            Parser parser(std::move(source));
+            apollo::Runtime rt;
+            parser.parse(&rt);
+            sample.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            sample.heap = heapBytes - heapBefore;
+            sample.nodes = rt.getArena().objectCount();
+            sample.arena = rt.getArena().bytesAllocated();
+        }
+        sample.tokens = tokens;
+        return sample;
+    }
+
+    void report(const char *corpus, const char *phase, size_t sourceBytes, const Sample &best) {
+        double mb = static_cast<double>(sourceBytes) / (1 << 20);
+        std::printf("%-10s %-6s %8.2f MB %9.1f MB/s %8.2f Mtok/s %8.2f Mnode/s %10.2f MB alloc %8.1f MB rss\n",
+                    corpus, phase, mb, mb / best.seconds, best.tokens / best.seconds / 1e6,
+                    best.nodes / best.seconds / 1e6, static_cast<double>(best.heap + best.arena) / (1 << 20),
+                    peakRssKb() / 1024.0);
+        std::fflush(stdout);
+    }
+
+    // Runs one phase `iterations` times and prints the fastest run
+    bool measure(const char *corpus, const char *phase, const std::string &text, int iterations,
+                 const std::function<Sample()> &run) {
+#if !defined(_WIN32)
+        std::fflush(stdout);
+        pid_t pid = fork();
+        if (pid == 0) {
+#endif
+            Sample best;
+            for (int i = 0; i < iterations; i++) {
+                Sample sample = run();
+                if (i == 0 || sample.seconds < best.seconds) {
+                    best = sample;
+                }
+            }
+            report(corpus, phase, text.size(), best);
+#if !defined(_WIN32)
+            std::_Exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+        return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+#else
+        return true;
+#endif
+    }
+}
+
+int main(int argc, char *argv[]) {
+    double sizeMb = 8;
+    int iterations = 3;
+    std::string only;
+    for (int i = 1; i < argc; i++) {
+        const char *value;
+        if (readOption(argv[i], "--size", value)) {
+            sizeMb = std::atof(value);
+        } else if (readOption(argv[i], "--iterations", value)) {
+            iterations = std::max(1, std::atoi(value));
+        } else if (readOption(argv[i], "--corpus", value)) {
+            only = value;
+        } else {
+            std::fprintf(stderr, "usage: %s [--size=<MB>] [--iterations=<n>] [--corpus=<name>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    auto targetBytes = static_cast<size_t>(sizeMb * (1 << 20));
+    for (const auto &corpus: corpora) {
+        if (!only.empty() && only != corpus.name) {
+            continue;
+        }
+        std::string text = generate(corpus, targetBytes);
+        size_t tokens = Parser::countTokens(SourceBuffer::fromString(text, "<bench>"));
+        if (!measure(corpus.name, "lex", text, iterations, [&] { return lexOnce(text); }) ||
+            !measure(corpus.name, "parse", text, iterations, [&] { return parseOnce(text, tokens); })) {
+            return 1;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,93 @@
+//
+// Created by chineseblack23 on 2024/6/28.
+//变量读写性能测试
+//
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include "BenchSupport.hpp"
+#include "Interpreter.hpp"
+#include "SourceBuffer.hpp"
+
+/**
+ * apollo_bench_variables [--locals=<n>] [--loops=<k>]
+ *
+ * Runs a script whose hot path is a function with many locals: it binds
+ * its parameters, defines and re-assigns <n> locals, reads them back and
+ * opens a nested block with locals of its own. The function is called
+ * 10^k times from k nested loops. Reports the time per call and the
+ * operator new calls per call, which is where per-variable allocations
+ * show up. The script runs on the AST engine, whose Context slots hold
+ * the variables.
+ */
+
+namespace {
+    std::string generate(int locals, int loops) {
+        std::string out = "func work(a, b, flag) {\n";
+        for (int i = 0; i < locals; i++) {
+            std::string n = std::to_string(i);
+            out += "    v" + n + " = " + (i % 2 == 0 ? "a" : "flag") + "\n";
+        }
+        for (int i = 0; i < locals; i++) {
+            std::string n = std::to_string(i);
+            out += "    v" + n + " = " + (i % 2 == 0 ? "b" : "v" + n) + "\n";
+        }
+        out += "    if (flag) {\n";
+        for (int i = 0; i < locals / 2; i++) {
+            std::string n = std::to_string(i);
+            out += "        w" + n + " = v" + std::to_string(i * 2) + "\n";
+        }
+        out += "        b = w0\n    }\n    return [v0, v1, b]\n}\n";
+
+        // k nested loops of 10 iterations each, counted with strings
+        for (int d = 0; d < loops; d++) {
+            std::string ind(4 * d, ' ');
+            std::string c = "c" + std::to_string(d);
+            out += ind + c + " = \"\"\n";
+            out += ind + "while (" + c + " != \"xxxxxxxxxx\") {\n";
+            out += ind + "    " + c + " = " + c + " + \"x\"\n";
+        }
+        out += std::string(4 * loops, ' ') + "r = work(\"left\", \"right\", true)\n";
+        for (int d = loops; d-- > 0;) {
+            out += std::string(4 * d, ' ') + "}\n";
+        }
+        return out;
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int locals = 16;
+    int loops = 4;
+    for (int i = 1; i < argc; i++) {
+        const char *value;
+        if (readOption(argv[i], "--locals", value)) {
+            locals = std::max(2, std::atoi(value));
+        } else if (readOption(argv[i], "--loops", value)) {
+            loops = std::max(1, std::atoi(value));
+        } else {
+            std::fprintf(stderr, "usage: %s [--locals=<n>] [--loops=<k>]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    double calls = 1;
+    for (int d = 0; d < loops; d++) {
+        calls *= 10;
+    }
+    Interpreter interpreter(SourceBuffer::fromString(generate(locals, loops), "<bench>"));
+    interpreter.setAstCache(false);
+    // The Context slots are only used by the tree-walking engine
+    interpreter.setEngine(Interpreter::AstEngine);
+
+    size_t allocsBefore = heapAllocs;
+    auto begin = std::chrono::steady_clock::now();
+    interpreter.execute();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    size_t allocs = heapAllocs - allocsBefore;
+
+    std::printf("locals %d, calls %.0f: %.3f s, %.1f ns/call, %.1f allocs/call\n",
+                locals, calls, seconds, seconds / calls * 1e9, allocs / calls);
+    return 0;
+}
@@ -17,12 +17,12 @@ std::string BooleanExpression::astString() {
 std::string NullExpression::astString() { return "NullExpr()"; }
 
 std::string NumberExpression::astString() {
-    return "NumberExpression(" + std::to_string(literal) + ")";
+    return "NumberExpression(" + valueToStdString(literal) + ")";
 }
 
 
 
-std::string StringExpression::astString() { return "StringExpr(" + literal + ")"; }
+std::string StringExpression::astString() { return "StringExpr(" + std::string(literal) + ")"; }
 
 std::string ArrayExpression::astString() {
     std::string str = "ArrayExpr(elements=[";
@@ -35,7 +35,7 @@ std::string ArrayExpression::astString() {
     return str;
 }
 
-std::string IdentExpression::astString() { return "IdentExpr(" + identName + ")"; }
+std::string IdentExpression::astString() { return "IdentExpr(" + identName.str() + ")"; }
 
 std::string IndexExpression::astString() {
     std::string str = "IndexExpr(index=";
@@ -122,7 +122,7 @@ std::string BinaryExpression::astString() {
 
 std::string FunCallExpression::astString() {
     std::string str = "FunCallExpr(func=";
-    str += funName;
+    str += funName.str();
     str += ",args=[";
     for (auto& arg : args) {
         str += arg->astString();
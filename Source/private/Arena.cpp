@@ -0,0 +1,84 @@
+//
+// Created by chineseblack23 on 2024/6/24.
+//
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "Arena.hpp"
+#include "Utils.hpp"
+
+namespace apollo {
+    AstArena::AstArena(size_t blockSize) : blockSize(blockSize) {}
+
+    AstArena::~AstArena() {
+        reset();
+        std::free(blocks);
+    }
+
+    void *AstArena::allocate(size_t size, size_t align) {
+        auto aligned = [&]() {
+            auto addr = reinterpret_cast<uintptr_t>(cursor);
+            return reinterpret_cast<char *>((addr + align - 1) & ~(uintptr_t(align) - 1));
+        };
+        char *p = aligned();
+        if (cursor == nullptr || p + size > limit) {
+            grow(size + align);
+            p = aligned();
+        }
+        cursor = p + size;
+        bytesUsed += size;
+        return p;
+    }
+
+    std::string_view AstArena::internString(std::string_view text) {
+        if (text.empty()) {
+            return {};
+        }
+        if (auto it = strings.find(text); it != strings.end()) {
+            return *it;
+        }
+        auto *copy = static_cast<char *>(allocate(text.size(), 1));
+        std::memcpy(copy, text.data(), text.size());
+        return *strings.emplace(copy, text.size()).first;
+    }
+
+    void AstArena::grow(size_t minSize) {
+        size_t size = minSize + sizeof(Block) > blockSize ? minSize + sizeof(Block) : blockSize;
+        auto *block = static_cast<Block *>(std::malloc(size));
+        if (block == nullptr) {
+            panic("InternalError: out of memory while allocating AST nodes\n");
+        }
+        block->next = blocks;
+        block->size = size;
+        blocks = block;
+        cursor = reinterpret_cast<char *>(block + 1);
+        limit = reinterpret_cast<char *>(block) + size;
+    }
+
+    void AstArena::runFinalizers() {
+        // Finalizers are linked newest first, so nodes die in reverse order
+        while (finalizers != nullptr) {
+            auto *fin = finalizers;
+            finalizers = fin->next;
+            fin->destroy(fin->object);
+        }
+    }
+
+    void AstArena::reset() {
+        runFinalizers();
+        strings.clear();
+        // Keep the oldest block around, so an arena that is reset after every
+        // statement settles into reusing the same memory
+        while (blocks != nullptr && blocks->next != nullptr) {
+            auto *block = blocks;
+            blocks = block->next;
+            std::free(block);
+        }
+        if (blocks != nullptr) {
+            cursor = reinterpret_cast<char *>(blocks + 1);
+            limit = reinterpret_cast<char *>(blocks) + blocks->size;
+        }
+        bytesUsed = 0;
+        objects = 0;
+    }
+}
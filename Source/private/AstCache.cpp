@@ -0,0 +1,969 @@
+//
+// Created by chineseblack23 on 2024/6/25.
+//
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <unordered_map>
+#include "AbstractSyntaxTree.hpp"
+#include "AstCache.hpp"
+#include "SourceBuffer.hpp"
+#include "Utils.hpp"
+
+#if !defined(_WIN32)
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+namespace {
+    constexpr char cacheMagic[4] = {'A', 'P', 'C', '1'};
+
+    // Bump whenever the node layout or the encoding below changes
+    constexpr uint32_t cacheVersion = 4;
+
+    // Bounds on the cache directory, enforced each time an image is written:
+    // images unused for maxCacheAge go, then the least recently used ones
+    // until the rest fit in maxCacheBytes
+    constexpr uintmax_t maxCacheBytes = 64 << 20;
+    constexpr auto maxCacheAge = std::chrono::hours(24 * 30);
+    // A temporary file this old belongs to a write that died
+    constexpr auto maxTemporaryAge = std::chrono::hours(1);
+
+    // Deepest nesting of statements and expressions an image may hold; the
+    // reader rejects anything deeper, so the writer does not produce it
+    constexpr int maxNesting = 10000;
+
+    inline uint64_t rotl(uint64_t v, int r) { return (v << r) | (v >> (64 - r)); }
+
+    inline uint32_t rotr(uint32_t v, int r) { return (v >> r) | (v << (32 - r)); }
+
+    // Guards the payload against truncation and corruption, not against
+    // collisions: a word-at-a-time multiply/rotate hash, cheap next to
+    // decoding what it covers
+    uint64_t checksum(std::string_view data) {
+        constexpr uint64_t k1 = 0x87c37b91114253d5ULL;
+        constexpr uint64_t k2 = 0x4cf5ad432745937fULL;
+        uint64_t h = 0x9e3779b97f4a7c15ULL ^ (data.size() * k2);
+        const char *p = data.data();
+        size_t n = data.size();
+        for (; n >= 8; p += 8, n -= 8) {
+            uint64_t w;
+            std::memcpy(&w, p, 8);
+            w = rotl(w * k1, 31) * k2;
+            h = rotl(h ^ w, 27) * 5 + 0x52dce729;
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, p, n);
+        h ^= rotl(tail * k1, 31) * k2;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h *= 0xc4ceb9fe1a85ec53ULL;
+        h ^= h >> 33;
+        return h;
+    }
+
+    // SHA-256 (FIPS 180-4), which names the source an image belongs to
+    std::array<uint8_t, 32> sha256(std::string_view data) {
+        static constexpr uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t h[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        auto compress = [&h](const uint8_t *block) {
+            uint32_t w[64];
+            for (int i = 0; i < 16; i++) {
+                w[i] = static_cast<uint32_t>(block[4 * i]) << 24 | static_cast<uint32_t>(block[4 * i + 1]) << 16 |
+                       static_cast<uint32_t>(block[4 * i + 2]) << 8 | static_cast<uint32_t>(block[4 * i + 3]);
+            }
+            for (int i = 16; i < 64; i++) {
+                uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+                uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+                w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+            }
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+            for (int i = 0; i < 64; i++) {
+                uint32_t t1 = hh + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                hh = g;
+                g = f;
+                f = e;
+                e = d + t1;
+                d = c;
+                c = b;
+                b = a;
+                a = t1 + t2;
+            }
+            h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e, h[5] += f, h[6] += g, h[7] += hh;
+        };
+
+        auto *p = reinterpret_cast<const uint8_t *>(data.data());
+        size_t n = data.size();
+        for (; n >= 64; p += 64, n -= 64) {
+            compress(p);
+        }
+        // The tail, a one bit, zeros and the length in bits fill one or two
+        // more blocks
+        uint8_t tail[128] = {};
+        std::memcpy(tail, p, n);
+        tail[n] = 0x80;
+        size_t tailSize = n < 56 ? 64 : 128;
+        uint64_t bits = static_cast<uint64_t>(data.size()) * 8;
+        for (int i = 0; i < 8; i++) {
+            tail[tailSize - 1 - i] = static_cast<uint8_t>(bits >> (8 * i));
+        }
+        for (size_t i = 0; i < tailSize; i += 64) {
+            compress(tail + i);
+        }
+
+        std::array<uint8_t, 32> digest{};
+        for (int i = 0; i < 8; i++) {
+            digest[4 * i] = static_cast<uint8_t>(h[i] >> 24);
+            digest[4 * i + 1] = static_cast<uint8_t>(h[i] >> 16);
+            digest[4 * i + 2] = static_cast<uint8_t>(h[i] >> 8);
+            digest[4 * i + 3] = static_cast<uint8_t>(h[i]);
+        }
+        return digest;
+    }
+
+    class ImageWriter {
+    public:
+        void u8(uint8_t v) { out.push_back(static_cast<char>(v)); }
+
+        void varint(uint64_t v) {
+            while (v >= 0x80) {
+                u8(static_cast<uint8_t>(v) | 0x80);
+                v >>= 7;
+            }
+            u8(static_cast<uint8_t>(v));
+        }
+
+        void svarint(int64_t v) { varint((static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63)); }
+
+        void raw(const void *p, size_t n) { out.append(static_cast<const char *>(p), n); }
+
+        // Names and literals go through a string table, so each distinct
+        // identifier is stored once however often it is used
+        void str(std::string_view s) {
+            auto [it, inserted] = stringIndex.emplace(s, strings.size());
+            if (inserted) {
+                strings.push_back(s);
+            }
+            varint(it->second);
+        }
+
+        void str(apollo::Symbol s) { str(std::string_view(s.str())); }
+
+        // Lines are stored as a delta to the previous node, which keeps
+        // them to a single byte almost everywhere
+        void location(const AbstractSyntaxTreeNode *node) {
+            svarint(node->start - lastLine);
+            svarint(node->end);
+            lastLine = node->start;
+        }
+
+        void expression(Expression *e);
+
+        void statement(Statement *s);
+
+        void block(struct BlockStatement *b);
+
+        std::string out;
+        int lastLine = 0;
+        std::unordered_map<std::string_view, uint64_t> stringIndex;
+        std::vector<std::string_view> strings;
+        // Cleared when the tree nests deeper than maxNesting
+        bool ok = true;
+        int depth = 0;
+    };
+
+    class ImageReader {
+    public:
+        ImageReader(const char *p, const char *limit, apollo::AstArena &arena,
+                    const std::vector<std::string_view> &strings, std::vector<apollo::Symbol> &symbols)
+                : p(p), limit(limit), arena(arena), strings(strings), symbols(symbols) {}
+
+        uint8_t u8() {
+            if (p >= limit) {
+                ok = false;
+                return 0;
+            }
+            return static_cast<uint8_t>(*p++);
+        }
+
+        uint64_t varint() {
+            uint64_t v = 0;
+            for (int shift = 0; shift < 64 && ok; shift += 7) {
+                uint8_t b = u8();
+                v |= static_cast<uint64_t>(b & 0x7f) << shift;
+                if ((b & 0x80) == 0) {
+                    return v;
+                }
+            }
+            ok = false;
+            return 0;
+        }
+
+        int64_t svarint() {
+            uint64_t v = varint();
+            return static_cast<int64_t>(v >> 1) ^ -static_cast<int64_t>(v & 1);
+        }
+
+        bool raw(void *dst, size_t n) {
+            if (static_cast<size_t>(limit - p) < n) {
+                ok = false;
+                return false;
+            }
+            std::memcpy(dst, p, n);
+            p += n;
+            return true;
+        }
+
+        std::string_view rawStr() {
+            uint64_t n = varint();
+            if (!ok || static_cast<uint64_t>(limit - p) < n) {
+                ok = false;
+                return {};
+            }
+            std::string_view s(p, n);
+            p += n;
+            return s;
+        }
+
+        uint64_t strIndex() {
+            uint64_t idx = varint();
+            if (!ok || idx >= strings.size()) {
+                ok = false;
+                return 0;
+            }
+            return idx;
+        }
+
+        // Names are interned on first use; literals are copied into the
+        // arena, so the process wide table only ever holds identifiers
+        apollo::Symbol str() {
+            uint64_t idx = strIndex();
+            if (!ok) {
+                return {};
+            }
+            if (symbols[idx].empty()) {
+                symbols[idx] = apollo::Symbol::intern(strings[idx]);
+            }
+            return symbols[idx];
+        }
+
+        std::string_view literal() {
+            uint64_t idx = strIndex();
+            return ok ? arena.internString(strings[idx]) : std::string_view();
+        }
+
+        // Reads the count of a following list, rejecting counts that can not
+        // possibly fit in the rest of the image
+        uint64_t count() {
+            uint64_t n = varint();
+            if (n > static_cast<uint64_t>(limit - p)) {
+                ok = false;
+                return 0;
+            }
+            return n;
+        }
+
+        Expression *expression();
+
+        Statement *statement();
+
+        struct BlockStatement *block();
+
+        const char *p;
+        const char *limit;
+        apollo::AstArena &arena;
+        const std::vector<std::string_view> &strings;
+        std::vector<apollo::Symbol> &symbols;
+        bool ok = true;
+        int lastLine = 0;
+        int depth = 0;
+    };
+
+    void ImageWriter::expression(Expression *e) {
+        if (e == nullptr) {
+            u8(AST_INVALID);
+            return;
+        }
+        if (!ok || ++depth > maxNesting) {
+            ok = false;
+            return;
+        }
+        u8(e->kind);
+        location(e);
+        switch (e->kind) {
+            case AST_BOOLEAN:
+                u8(static_cast<BooleanExpression *>(e)->literal);
+                break;
+            case AST_NULL:
+                break;
+            case AST_NUMBER: {
+                auto &literal = static_cast<NumberExpression *>(e)->literal;
+                if (literal.isType<apollo::Integer>()) {
+                    u8(1);
+                    int64_t integer = literal.asInteger();
+                    raw(&integer, sizeof(integer));
+                } else {
+                    u8(0);
+                    double number = literal.asNumber();
+                    raw(&number, sizeof(number));
+                }
+                break;
+            }
+            case AST_STRING:
+                str(static_cast<StringExpression *>(e)->literal);
+                break;
+            case AST_ARRAY: {
+                auto *node = static_cast<ArrayExpression *>(e);
+                varint(node->literal.size());
+                for (auto *element: node->literal) {
+                    expression(element);
+                }
+                break;
+            }
+            case AST_IDENT:
+                str(static_cast<IdentExpression *>(e)->identName);
+                break;
+            case AST_INDEX: {
+                auto *node = static_cast<IndexExpression *>(e);
+                str(node->identName);
+                expression(node->index);
+                break;
+            }
+            case AST_BINARY: {
+                auto *node = static_cast<BinaryExpression *>(e);
+                varint(node->opt);
+                expression(node->leftExpression);
+                expression(node->rightExpression);
+                break;
+            }
+            case AST_FUNCALL: {
+                auto *node = static_cast<FunCallExpression *>(e);
+                str(node->funName);
+                varint(node->args.size());
+                for (auto *arg: node->args) {
+                    expression(arg);
+                }
+                break;
+            }
+            case AST_ASSIGN: {
+                auto *node = static_cast<AssignExpression *>(e);
+                varint(node->opt);
+                expression(node->leftExpression);
+                expression(node->rightExperssion);
+                break;
+            }
+            default:
+                break;
+        }
+        depth--;
+    }
+
+    void ImageWriter::statement(Statement *s) {
+        if (s == nullptr) {
+            u8(AST_INVALID);
+            return;
+        }
+        if (!ok || ++depth > maxNesting) {
+            ok = false;
+            return;
+        }
+        u8(s->kind);
+        location(s);
+        switch (s->kind) {
+            case AST_BREAK:
+            case AST_CONTINUE:
+                break;
+            case AST_EXPR_STMT:
+                expression(static_cast<ExpressionStmt *>(s)->expression);
+                break;
+            case AST_RETURN:
+                expression(static_cast<ReturnStmt *>(s)->expression);
+                break;
+            case AST_IF: {
+                auto *node = static_cast<IfStmt *>(s);
+                expression(node->cond);
+                block(node->blockStatement);
+                block(node->elseBlock);
+                break;
+            }
+            case AST_WHILE: {
+                auto *node = static_cast<WhileStmt *>(s);
+                expression(node->cond);
+                block(node->blockStatement);
+                break;
+            }
+            default:
+                break;
+        }
+        depth--;
+    }
+
+    void ImageWriter::block(struct BlockStatement *b) {
+        if (b == nullptr) {
+            u8(0);
+            return;
+        }
+        u8(1);
+        varint(b->stmts.size());
+        for (auto *stmt: b->stmts) {
+            statement(stmt);
+        }
+    }
+
+    Expression *ImageReader::expression() {
+        auto kind = static_cast<AstKind>(u8());
+        if (!ok || kind == AST_INVALID) {
+            return nullptr;
+        }
+        if (++depth > maxNesting) {
+            ok = false;
+            return nullptr;
+        }
+        int start = lastLine + static_cast<int>(svarint());
+        int end = static_cast<int>(svarint());
+        lastLine = start;
+        Expression *result = nullptr;
+        switch (kind) {
+            case AST_BOOLEAN: {
+                auto *node = arena.make<BooleanExpression>(start, end);
+                node->literal = u8() != 0;
+                result = node;
+                break;
+            }
+            case AST_NULL:
+                result = arena.make<NullExpression>(start, end);
+                break;
+            case AST_NUMBER: {
+                auto *node = arena.make<NumberExpression>(start, end);
+                if (u8() != 0) {
+                    int64_t integer = 0;
+                    raw(&integer, sizeof(integer));
+                    node->literal = apollo::ValueDeclaration::fromInteger(integer);
+                } else {
+                    double number = 0;
+                    raw(&number, sizeof(number));
+                    node->literal = apollo::ValueDeclaration::fromNumber(number);
+                }
+                result = node;
+                break;
+            }
+            case AST_STRING: {
+                auto *node = arena.make<StringExpression>(start, end);
+                node->literal = literal();
+                result = node;
+                break;
+            }
+            case AST_ARRAY: {
+                auto *node = arena.make<ArrayExpression>(start, end);
+                uint64_t n = count();
+                node->literal.reserve(n);
+                for (uint64_t i = 0; i < n && ok; i++) {
+                    node->literal.push_back(expression());
+                }
+                result = node;
+                break;
+            }
+            case AST_IDENT:
+                result = arena.make<IdentExpression>(str(), start, end);
+                break;
+            case AST_INDEX: {
+                auto *node = arena.make<IndexExpression>(start, end);
+                node->identName = str();
+                node->index = expression();
+                result = node;
+                break;
+            }
+            case AST_BINARY: {
+                auto *node = arena.make<BinaryExpression>(start, end);
+                node->opt = static_cast<Token>(varint());
+                node->leftExpression = expression();
+                node->rightExpression = expression();
+                result = node;
+                break;
+            }
+            case AST_FUNCALL: {
+                auto *node = arena.make<FunCallExpression>(start, end);
+                node->funName = str();
+                uint64_t n = count();
+                node->args.reserve(n);
+                for (uint64_t i = 0; i < n && ok; i++) {
+                    node->args.push_back(expression());
+                }
+                result = node;
+                break;
+            }
+            case AST_ASSIGN: {
+                auto *node = arena.make<AssignExpression>(start, end);
+                node->opt = static_cast<Token>(varint());
+                node->leftExpression = expression();
+                node->rightExperssion = expression();
+                result = node;
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+        depth--;
+        return result;
+    }
+
+    Statement *ImageReader::statement() {
+        auto kind = static_cast<AstKind>(u8());
+        if (!ok || kind == AST_INVALID) {
+            return nullptr;
+        }
+        if (++depth > maxNesting) {
+            ok = false;
+            return nullptr;
+        }
+        int start = lastLine + static_cast<int>(svarint());
+        int end = static_cast<int>(svarint());
+        lastLine = start;
+        Statement *result = nullptr;
+        switch (kind) {
+            case AST_BREAK:
+                result = arena.make<BreakStmt>(start, end);
+                break;
+            case AST_CONTINUE:
+                result = arena.make<ContinueStmt>(start, end);
+                break;
+            case AST_EXPR_STMT:
+                result = arena.make<ExpressionStmt>(expression(), start, end);
+                break;
+            case AST_RETURN: {
+                auto *node = arena.make<ReturnStmt>(start, end);
+                node->expression = expression();
+                result = node;
+                break;
+            }
+            case AST_IF: {
+                auto *node = arena.make<IfStmt>(start, end);
+                node->cond = expression();
+                node->blockStatement = block();
+                node->elseBlock = block();
+                result = node;
+                break;
+            }
+            case AST_WHILE: {
+                auto *node = arena.make<WhileStmt>(start, end);
+                node->cond = expression();
+                node->blockStatement = block();
+                result = node;
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+        depth--;
+        return result;
+    }
+
+    struct BlockStatement *ImageReader::block() {
+        if (u8() == 0 || !ok) {
+            return nullptr;
+        }
+        auto *node = arena.make<struct BlockStatement>();
+        uint64_t n = count();
+        node->stmts.reserve(n);
+        for (uint64_t i = 0; i < n && ok; i++) {
+            node->stmts.push_back(statement());
+        }
+        return node;
+    }
+}
+
+AstCache::SourceKey AstCache::keySource(std::string_view source) {
+    SourceKey key;
+    key.digest = sha256(source);
+    key.size = source.size();
+    return key;
+}
+
+std::string AstCache::cacheDirectory() {
+    if (const char *dir = std::getenv("APOLLO_CACHE_DIR"); dir != nullptr && *dir != '\0') {
+        return dir;
+    }
+    // Per user, never a shared directory such as /tmp: anyone who can write
+    // there could plant an image that passes the self hash
+    if (const char *xdg = std::getenv("XDG_CACHE_HOME"); xdg != nullptr && *xdg == '/') {
+        return (std::filesystem::path(xdg) / "apollo").string();
+    }
+#if defined(_WIN32)
+    const char *home = std::getenv("LOCALAPPDATA");
+#else
+    const char *home = std::getenv("HOME");
+#endif
+    if (home == nullptr || *home == '\0') {
+        return "";
+    }
+    return (std::filesystem::path(home) / ".cache" / "apollo").string();
+}
+
+std::string AstCache::cachePath(const SourceKey &key) {
+    auto dir = cacheDirectory();
+    if (dir.empty()) {
+        return "";
+    }
+    char name[2 * 32 + sizeof(".apc")];
+    for (size_t i = 0; i < key.digest.size(); i++) {
+        std::snprintf(name + 2 * i, 3, "%02x", key.digest[i]);
+    }
+    std::strcpy(name + 2 * key.digest.size(), ".apc");
+    return (std::filesystem::path(dir) / name).string();
+}
+
+namespace {
+    struct ImageHeader {
+        char magic[4];
+        uint32_t version;
+        uint8_t sourceDigest[32];
+        uint64_t sourceSize;
+        // The string table, function table and top-level statements, which
+        // load decodes at once; each function body has a checksum of its own
+        uint64_t tablesHash;
+        uint64_t tablesSize;
+        uint64_t bodiesSize;
+    };
+
+    // An image is only trusted when nobody but the current user can have
+    // written it: the file and its directory must be owned by the effective
+    // user and writable by nobody else
+    bool privateToUser(const std::filesystem::path &path, bool directory) {
+#if defined(_WIN32)
+        (void) path;
+        (void) directory;
+        return true;
+#else
+        struct stat st{};
+        if (lstat(path.c_str(), &st) != 0) {
+            return false;
+        }
+        if (directory ? !S_ISDIR(st.st_mode) : !S_ISREG(st.st_mode)) {
+            return false;
+        }
+        return st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+#endif
+    }
+
+    // Creates the cache directory itself with mode 0700; its parents are
+    // made with the defaults, like mkdir -p
+    bool makePrivateDirectory(const std::filesystem::path &dir) {
+        std::error_code ec;
+        if (dir.has_parent_path()) {
+            std::filesystem::create_directories(dir.parent_path(), ec);
+        }
+#if defined(_WIN32)
+        std::filesystem::create_directory(dir, ec);
+#else
+        if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+            return false;
+        }
+#endif
+        return privateToUser(dir, true);
+    }
+
+    bool writeImage(const std::filesystem::path &path, const ImageHeader &header, const std::string &payload) {
+#if defined(_WIN32)
+        std::ofstream fs(path, std::ios::out | std::ios::binary | std::ios::trunc);
+        if (!fs.is_open()) {
+            return false;
+        }
+        fs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        fs.write(payload.data(), static_cast<std::streamsize>(payload.size()));
+        return static_cast<bool>(fs);
+#else
+        // Never follow or reuse an existing file, and keep the image 0600
+        int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            return false;
+        }
+        auto writeAll = [fd](const char *p, size_t n) {
+            while (n > 0) {
+                ssize_t w = write(fd, p, n);
+                if (w < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (w <= 0) {
+                    return false;
+                }
+                p += w;
+                n -= static_cast<size_t>(w);
+            }
+            return true;
+        };
+        bool ok = writeAll(reinterpret_cast<const char *>(&header), sizeof(header)) &&
+                  writeAll(payload.data(), payload.size());
+        return close(fd) == 0 && ok;
+#endif
+    }
+
+    // Only files the cache wrote are ever removed, whatever else shares the
+    // directory
+    void pruneDirectory(const std::filesystem::path &dir) {
+        namespace fs = std::filesystem;
+        struct Entry {
+            fs::path path;
+            fs::file_time_type used;
+            uintmax_t size;
+        };
+        std::vector<Entry> images;
+        uintmax_t total = 0;
+        auto now = fs::file_time_type::clock::now();
+        std::error_code ec;
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            if (!it->is_regular_file(ec)) {
+                continue;
+            }
+            auto name = it->path().filename().string();
+            auto used = it->last_write_time(ec);
+            if (ec) {
+                continue;
+            }
+            if (name.find(".apc.tmp") != std::string::npos) {
+                if (now - used > maxTemporaryAge) {
+                    fs::remove(it->path(), ec);
+                }
+            } else if (name.size() > 4 && name.ends_with(".apc")) {
+                if (now - used > maxCacheAge) {
+                    fs::remove(it->path(), ec);
+                    continue;
+                }
+                auto size = it->file_size(ec);
+                if (!ec) {
+                    images.push_back({it->path(), used, size});
+                    total += size;
+                }
+            }
+        }
+        if (total <= maxCacheBytes) {
+            return;
+        }
+        std::sort(images.begin(), images.end(),
+                  [](const Entry &a, const Entry &b) { return a.used < b.used; });
+        for (auto &image: images) {
+            if (total <= maxCacheBytes) {
+                break;
+            }
+            if (fs::remove(image.path, ec)) {
+                total -= image.size;
+            }
+        }
+    }
+}
+
+AstImage::AstImage(SourceBuffer buffer, apollo::AstArena &arena) : buffer(std::move(buffer)), arena(arena) {}
+
+AstImage::~AstImage() = default;
+
+struct BlockStatement *AstImage::loadBody(uint32_t index) {
+    const auto &entry = bodies[index];
+    const char *first = bodyData + entry.offset;
+    ImageReader in(first, first + entry.size, arena, strings, symbols);
+    // Too late to parse the source instead; the image is removed so that
+    // the next run does
+    struct BlockStatement *body = nullptr;
+    if (checksum({first, entry.size}) != entry.hash || (body = in.block(), !in.ok)) {
+        std::error_code ec;
+        std::filesystem::remove(buffer.name(), ec);
+        panic("InternalError: corrupted function body in AST cache %s, removed it\n", buffer.name().c_str());
+    }
+    return body;
+}
+
+bool AstCache::load(const std::string &path, const SourceKey &key, apollo::Runtime *rt) {
+    if (path.empty()) {
+        return false;
+    }
+    auto file = std::filesystem::path(path);
+    if (!privateToUser(file.parent_path().empty() ? "." : file.parent_path(), true) ||
+        !privateToUser(file, false)) {
+        return false;
+    }
+    auto image = std::make_unique<AstImage>(SourceBuffer::fromFile(path), rt->getArena());
+    const auto &buffer = image->buffer;
+
+    ImageHeader header{};
+    if (buffer.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, buffer.begin(), sizeof(header));
+    const char *payload = buffer.begin() + sizeof(header);
+    if (std::memcmp(header.magic, cacheMagic, 4) != 0 || header.version != cacheVersion ||
+        std::memcmp(header.sourceDigest, key.digest.data(), key.digest.size()) != 0 ||
+        header.sourceSize != key.size || header.tablesSize > buffer.size() - sizeof(header) ||
+        header.bodiesSize != buffer.size() - sizeof(header) - header.tablesSize ||
+        checksum({payload, header.tablesSize}) != header.tablesHash) {
+        return false;
+    }
+    const char *tablesEnd = payload + header.tablesSize;
+
+    ImageReader in(payload, tablesEnd, rt->getArena(), image->strings, image->symbols);
+    uint64_t stringCount = in.count();
+    image->strings.reserve(stringCount);
+    for (uint64_t i = 0; i < stringCount && in.ok; i++) {
+        image->strings.push_back(in.rawStr());
+    }
+    image->symbols.resize(image->strings.size());
+
+    // Function bodies stay encoded in the mapped image and are only decoded
+    // when the function is first called, see FunctionDeclaration::getBody
+    std::vector<std::unique_ptr<apollo::FunctionDeclaration>> funcs;
+    uint64_t funcCount = in.count();
+    funcs.reserve(funcCount);
+    for (uint64_t i = 0; i < funcCount && in.ok; i++) {
+        auto f = std::make_unique<apollo::FunctionDeclaration>();
+        f->id.name = in.str();
+        uint64_t paramCount = in.count();
+        f->params.reserve(paramCount);
+        for (uint64_t j = 0; j < paramCount && in.ok; j++) {
+            f->params.push_back(in.str());
+        }
+        AstImage::Body body{};
+        body.offset = in.varint();
+        body.size = in.varint();
+        body.hash = in.varint();
+        if (body.offset > header.bodiesSize || body.size > header.bodiesSize - body.offset) {
+            return false;
+        }
+        f->image = image.get();
+        f->imageBody = static_cast<uint32_t>(image->bodies.size());
+        image->bodies.push_back(body);
+        funcs.push_back(std::move(f));
+    }
+    std::vector<Statement *> stmts;
+    uint64_t stmtCount = in.count();
+    stmts.reserve(stmtCount);
+    for (uint64_t i = 0; i < stmtCount && in.ok; i++) {
+        stmts.push_back(in.statement());
+    }
+    if (!in.ok || in.p != tablesEnd) {
+        // Nodes built so far stay in the arena and die with the runtime
+        return false;
+    }
+    image->bodyData = tablesEnd;
+
+    for (auto &f: funcs) {
+        auto name = f->id.name;
+        rt->addFunction(name, rt->adoptFunction(std::move(f)));
+    }
+    for (auto *stmt: stmts) {
+        rt->addStatement(stmt);
+    }
+    rt->adoptImage(std::move(image));
+    // Marks the image as used, see pruneDirectory
+    std::error_code ec;
+    std::filesystem::last_write_time(file, std::filesystem::file_time_type::clock::now(), ec);
+    return true;
+}
+
+bool AstCache::store(const std::string &path, const SourceKey &key, apollo::Runtime *rt) {
+    ImageWriter bodies;
+    ImageWriter tables;
+    std::vector<std::pair<apollo::FunctionDeclaration *, AstImage::Body>> funcs;
+    // In declaration order, so a cached unit declares its functions in the
+    // same order as a parsed one
+    for (auto &decl: rt->getDeclarations()) {
+        auto *f = decl.get();
+        AstImage::Body body{};
+        body.offset = bodies.out.size();
+        // Each body is decoded on its own, so its line deltas start afresh
+        bodies.lastLine = 0;
+        bodies.block(f->getBody());
+        body.size = bodies.out.size() - body.offset;
+        body.hash = checksum(std::string_view(bodies.out).substr(body.offset));
+        funcs.emplace_back(f, body);
+    }
+    // Top-level statements share the string table with the bodies
+    std::swap(tables.stringIndex, bodies.stringIndex);
+    std::swap(tables.strings, bodies.strings);
+    for (auto &[f, body]: funcs) {
+        tables.str(f->id.name);
+        tables.varint(f->params.size());
+        for (auto &param: f->params) {
+            tables.str(param);
+        }
+        tables.varint(body.offset);
+        tables.varint(body.size);
+        tables.varint(body.hash);
+    }
+    const auto &stmts = rt->getStatements();
+    tables.varint(stmts.size());
+    for (auto *stmt: stmts) {
+        tables.statement(stmt);
+    }
+    // Nesting the reader would refuse: writing it would only be rejected
+    // and rewritten on every run
+    if (!bodies.ok || !tables.ok) {
+        return false;
+    }
+
+    ImageWriter payload;
+    payload.varint(tables.strings.size());
+    for (auto str: tables.strings) {
+        payload.varint(str.size());
+        payload.raw(str.data(), str.size());
+    }
+    payload.varint(funcs.size());
+    payload.out += tables.out;
+    uint64_t tablesSize = payload.out.size();
+    payload.out += bodies.out;
+
+    ImageHeader header{};
+    std::memcpy(header.magic, cacheMagic, 4);
+    header.version = cacheVersion;
+    std::memcpy(header.sourceDigest, key.digest.data(), key.digest.size());
+    header.sourceSize = key.size;
+    header.tablesHash = checksum(std::string_view(payload.out).substr(0, tablesSize));
+    header.tablesSize = tablesSize;
+    header.bodiesSize = bodies.out.size();
+
+    // Write to a temporary name and rename, so a concurrent reader never
+    // sees a half written image
+    if (path.empty()) {
+        return false;
+    }
+    std::error_code ec;
+    auto target = std::filesystem::path(path);
+    if (!makePrivateDirectory(target.parent_path().empty() ? "." : target.parent_path())) {
+        return false;
+    }
+    auto tmp = target;
+    // Files parsed in parallel may share a source (and so a target), hence the thread id
+    tmp += ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + "-" +
+           std::to_string(std::hash<std::thread::id>{}(std::this_thread::get_id()));
+    if (!writeImage(tmp, header, payload.out)) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    std::filesystem::rename(tmp, target, ec);
+    if (ec) {
+        std::filesystem::remove(tmp, ec);
+        return false;
+    }
+    pruneDirectory(target.parent_path().empty() ? "." : target.parent_path());
+    return true;
+}
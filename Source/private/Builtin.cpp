@@ -0,0 +1,264 @@
+//
+// Created by chineseblack23 on 2024/6/28.
+//
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <span>
+#include <string>
+#include <vector>
+#include "Builtin.hpp"
+#include "Utils.hpp"
+
+using apollo::ValueDeclaration;
+
+namespace {
+    using Args = std::span<ValueDeclaration>;
+    using Array = std::vector<ValueDeclaration>;
+
+    void expectArgs(const char *name, Args args, size_t min, size_t max) {
+        if (args.size() >= min && args.size() <= max) {
+            return;
+        }
+        if (min == max) {
+            panic("ArgumentError: %s expects %zu arguments but got %zu\n", name, min, args.size());
+        }
+        panic("ArgumentError: %s expects %zu to %zu arguments but got %zu\n", name, min, max, args.size());
+    }
+
+    double numberArg(const char *name, ValueDeclaration &v) {
+        if (!v.isNumber()) {
+            panic("TypeError: %s expects a number\n", name);
+        }
+        return v.toDouble();
+    }
+
+    std::string_view stringArg(const char *name, ValueDeclaration &v) {
+        if (!v.isType<apollo::String>()) {
+            panic("TypeError: %s expects a string\n", name);
+        }
+        return v.asString();
+    }
+
+    const Array &arrayArg(const char *name, ValueDeclaration &v) {
+        if (!v.isType<apollo::Array>()) {
+            panic("TypeError: %s expects an array\n", name);
+        }
+        return v.asArray();
+    }
+
+    ValueDeclaration number(double d) { return ValueDeclaration::fromNumber(d); }
+
+    ValueDeclaration integer(int64_t i) { return ValueDeclaration::fromInteger(i); }
+
+    ValueDeclaration boolean(bool b) { return ValueDeclaration::fromBool(b); }
+
+    // Shared body of the one-argument math functions
+    template<typename F>
+    ValueDeclaration math(const char *name, Args args, F f) {
+        expectArgs(name, args, 1, 1);
+        return number(f(numberArg(name, args[0])));
+    }
+
+    // floor, ceil and round: an integer is already whole and stays exact
+    template<typename F>
+    ValueDeclaration rounding(const char *name, Args args, F f) {
+        expectArgs(name, args, 1, 1);
+        if (args[0].isType<apollo::Integer>()) {
+            return args[0];
+        }
+        return number(f(numberArg(name, args[0])));
+    }
+
+    ValueDeclaration builtinPrint(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        std::string line;
+        for (size_t i = 0; i < args.size(); i++) {
+            if (i != 0) {
+                line += ' ';
+            }
+            line += valueToStdString(args[i]);
+        }
+        line += '\n';
+        std::fwrite(line.data(), 1, line.size(), stdout);
+        return ValueDeclaration(apollo::Null);
+    }
+
+    ValueDeclaration builtinStr(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("str", args, 1, 1);
+        return ValueDeclaration::fromString(valueToStdString(args[0]));
+    }
+
+    ValueDeclaration builtinLen(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("len", args, 1, 1);
+        if (args[0].isType<apollo::Array>()) {
+            return integer(static_cast<int64_t>(arrayArg("len", args[0]).size()));
+        }
+        return integer(static_cast<int64_t>(stringArg("len", args[0]).size()));
+    }
+
+    ValueDeclaration builtinPush(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("push", args, 2, 2);
+        arrayArg("push", args[0]);
+        // Copy-on-write: an array still held by a variable is copied, a
+        // temporary one (push(push(a, x), y)) grows in place
+        ValueDeclaration result = std::move(args[0]);
+        result.mutableArray().push_back(std::move(args[1]));
+        return result;
+    }
+
+    ValueDeclaration builtinPop(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("pop", args, 1, 1);
+        if (arrayArg("pop", args[0]).empty()) {
+            panic("IndexError: pop from an empty array\n");
+        }
+        // Copy-on-write, as in push
+        ValueDeclaration result = std::move(args[0]);
+        result.mutableArray().pop_back();
+        return result;
+    }
+
+    ValueDeclaration builtinLast(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("last", args, 1, 1);
+        auto &elements = arrayArg("last", args[0]);
+        if (elements.empty()) {
+            panic("IndexError: last of an empty array\n");
+        }
+        return elements.back();
+    }
+
+    ValueDeclaration builtinSubstr(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("substr", args, 2, 3);
+        auto str = stringArg("substr", args[0]);
+        auto start = numberArg("substr", args[1]);
+        // Written so that NaN fails the checks too
+        if (!(start >= 0 && start <= static_cast<double>(str.size()))) {
+            panic("IndexError: substr start %g out of range\n", start);
+        }
+        auto count = args.size() == 3 ? numberArg("substr", args[2]) : static_cast<double>(str.size());
+        if (!std::isfinite(count) || count < 0) {
+            panic("IndexError: substr length %g out of range\n", count);
+        }
+        // Past the end of the string is up to its end, only then cast
+        count = std::min(count, static_cast<double>(str.size()) - std::floor(start));
+        return ValueDeclaration::fromString(str.substr(static_cast<size_t>(start), static_cast<size_t>(count)));
+    }
+
+    ValueDeclaration builtinAbs(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("abs", args, 1, 1);
+        if (args[0].isType<apollo::Integer>()) {
+            int64_t r;
+            if (checkedSub(0, args[0].asInteger(), r)) {
+                return integer(std::max(args[0].asInteger(), r));
+            }
+        }
+        return number(std::fabs(numberArg("abs", args[0])));
+    }
+
+    ValueDeclaration builtinPow(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("pow", args, 2, 2);
+        return number(std::pow(numberArg("pow", args[0]), numberArg("pow", args[1])));
+    }
+
+    ValueDeclaration builtinMin(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("min", args, 2, 2);
+        if (args[0].isType<apollo::Integer>() && args[1].isType<apollo::Integer>()) {
+            return integer(std::min(args[0].asInteger(), args[1].asInteger()));
+        }
+        return number(std::fmin(numberArg("min", args[0]), numberArg("min", args[1])));
+    }
+
+    ValueDeclaration builtinMax(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("max", args, 2, 2);
+        if (args[0].isType<apollo::Integer>() && args[1].isType<apollo::Integer>()) {
+            return integer(std::max(args[0].asInteger(), args[1].asInteger()));
+        }
+        return number(std::fmax(numberArg("max", args[0]), numberArg("max", args[1])));
+    }
+
+    ValueDeclaration builtinTypeOf(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("typeOf", args, 1, 1);
+        std::string_view name = "object";
+        switch (args[0].type) {
+            case apollo::Number:
+            case apollo::Integer:
+                name = "number";
+                break;
+            case apollo::String:
+                name = "string";
+                break;
+            case apollo::Boolean:
+                name = "bool";
+                break;
+            case apollo::Null:
+                name = "null";
+                break;
+            case apollo::Array:
+                name = "array";
+                break;
+            default:
+                break;
+        }
+        return ValueDeclaration::fromString(name);
+    }
+
+    // Shared body of isString, isBool, isArray and isNull
+    template<apollo::ValueType T>
+    ValueDeclaration isType(const char *name, Args args) {
+        expectArgs(name, args, 1, 1);
+        return boolean(args[0].type == T);
+    }
+
+    ValueDeclaration builtinClock(apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("clock", args, 0, 0);
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        return number(std::chrono::duration<double>(now).count());
+    }
+}
+
+void registerCoreLibrary(apollo::Runtime *rt) {
+    rt->registerBuiltin("print", builtinPrint);
+    rt->registerBuiltin("str", builtinStr);
+    rt->registerBuiltin("len", builtinLen);
+    rt->registerBuiltin("push", builtinPush);
+    rt->registerBuiltin("pop", builtinPop);
+    rt->registerBuiltin("last", builtinLast);
+    rt->registerBuiltin("substr", builtinSubstr);
+
+    rt->registerBuiltin("abs", builtinAbs);
+    rt->registerBuiltin("floor", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return rounding("floor", args, [](double x) { return std::floor(x); });
+    });
+    rt->registerBuiltin("ceil", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return rounding("ceil", args, [](double x) { return std::ceil(x); });
+    });
+    rt->registerBuiltin("round", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return rounding("round", args, [](double x) { return std::round(x); });
+    });
+    rt->registerBuiltin("sqrt", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return math("sqrt", args, [](double x) { return std::sqrt(x); });
+    });
+    rt->registerBuiltin("pow", builtinPow);
+    rt->registerBuiltin("min", builtinMin);
+    rt->registerBuiltin("max", builtinMax);
+
+    rt->registerBuiltin("typeOf", builtinTypeOf);
+    rt->registerBuiltin("isNumber", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        expectArgs("isNumber", args, 1, 1);
+        return boolean(args[0].isNumber());
+    });
+    rt->registerBuiltin("isString", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return isType<apollo::String>("isString", args);
+    });
+    rt->registerBuiltin("isBool", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return isType<apollo::Boolean>("isBool", args);
+    });
+    rt->registerBuiltin("isArray", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return isType<apollo::Array>("isArray", args);
+    });
+    rt->registerBuiltin("isNull", [](apollo::Runtime *, apollo::ContextChain &, Args args) {
+        return isType<apollo::Null>("isNull", args);
+    });
+
+    rt->registerBuiltin("clock", builtinClock);
+}
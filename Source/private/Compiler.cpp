@@ -0,0 +1,944 @@
+//
+// Created by chineseblack23 on 2024/6/29.
+//
+#include <algorithm>
+#include <cstring>
+#include "Compiler.hpp"
+#include "Resolver.hpp"
+#include "Utils.hpp"
+
+using apollo::Instruction;
+using apollo::OpCode;
+
+namespace {
+    // Register operands are 16 bits wide
+    constexpr uint32_t maxRegisters = UINT16_MAX;
+
+    // An expr() destination: any register, or the value is not used
+    constexpr int anyRegister = -1;
+    constexpr int noValue = -2;
+
+    uint32_t blockVariables(const std::vector<Statement *> &stmts);
+
+    uint32_t blockVariables(struct apollo::BlockStatement *block) {
+        return block == nullptr ? 0 : static_cast<uint32_t>(block->locals.size()) + blockVariables(block->stmts);
+    }
+
+    // Registers the nested blocks of stmts need. Only one of sibling blocks
+    // is live at a time, they all start at the same register
+    uint32_t blockVariables(const std::vector<Statement *> &stmts) {
+        uint32_t count = 0;
+        for (auto *stmt: stmts) {
+            if (stmt->kind == AST_IF) {
+                count = std::max(count, blockVariables(static_cast<IfStmt *>(stmt)->blockStatement));
+                count = std::max(count, blockVariables(static_cast<IfStmt *>(stmt)->elseBlock));
+            } else if (stmt->kind == AST_WHILE) {
+                count = std::max(count, blockVariables(static_cast<WhileStmt *>(stmt)->blockStatement));
+            }
+        }
+        return count;
+    }
+
+    bool hasAssignment(Expression *expr) {
+        if (expr == nullptr) {
+            return false;
+        }
+        switch (expr->kind) {
+            case AST_ASSIGN:
+                return true;
+            case AST_INDEX:
+                return hasAssignment(static_cast<IndexExpression *>(expr)->index);
+            case AST_BINARY:
+                return hasAssignment(static_cast<BinaryExpression *>(expr)->leftExpression) ||
+                       hasAssignment(static_cast<BinaryExpression *>(expr)->rightExpression);
+            case AST_ARRAY:
+                return std::any_of(static_cast<ArrayExpression *>(expr)->literal.begin(),
+                                   static_cast<ArrayExpression *>(expr)->literal.end(), hasAssignment);
+            case AST_FUNCALL:
+                return std::any_of(static_cast<FunCallExpression *>(expr)->args.begin(),
+                                   static_cast<FunCallExpression *>(expr)->args.end(), hasAssignment);
+            default:
+                return false;
+        }
+    }
+
+    void assignedNames(Expression *expr, std::unordered_set<apollo::Symbol> &names) {
+        if (expr == nullptr) {
+            return;
+        }
+        switch (expr->kind) {
+            case AST_ASSIGN: {
+                auto *assign = static_cast<AssignExpression *>(expr);
+                if (assign->leftExpression->kind == AST_IDENT) {
+                    names.insert(static_cast<IdentExpression *>(assign->leftExpression)->identName);
+                } else if (assign->leftExpression->kind == AST_INDEX) {
+                    names.insert(static_cast<IndexExpression *>(assign->leftExpression)->identName);
+                }
+                assignedNames(assign->leftExpression, names);
+                assignedNames(assign->rightExperssion, names);
+                break;
+            }
+            case AST_INDEX:
+                assignedNames(static_cast<IndexExpression *>(expr)->index, names);
+                break;
+            case AST_BINARY:
+                assignedNames(static_cast<BinaryExpression *>(expr)->leftExpression, names);
+                assignedNames(static_cast<BinaryExpression *>(expr)->rightExpression, names);
+                break;
+            case AST_ARRAY:
+                for (auto *e: static_cast<ArrayExpression *>(expr)->literal) {
+                    assignedNames(e, names);
+                }
+                break;
+            case AST_FUNCALL:
+                for (auto *e: static_cast<FunCallExpression *>(expr)->args) {
+                    assignedNames(e, names);
+                }
+                break;
+            default:
+                break;
+        }
+    }
+
+    void assignedNames(Statement *stmt, std::unordered_set<apollo::Symbol> &names) {
+        switch (stmt->kind) {
+            case AST_EXPR_STMT:
+                assignedNames(static_cast<ExpressionStmt *>(stmt)->expression, names);
+                break;
+            case AST_RETURN:
+                assignedNames(static_cast<ReturnStmt *>(stmt)->expression, names);
+                break;
+            case AST_IF: {
+                auto *ifStmt = static_cast<IfStmt *>(stmt);
+                assignedNames(ifStmt->cond, names);
+                for (auto *s: ifStmt->blockStatement->stmts) {
+                    assignedNames(s, names);
+                }
+                if (ifStmt->elseBlock != nullptr) {
+                    for (auto *s: ifStmt->elseBlock->stmts) {
+                        assignedNames(s, names);
+                    }
+                }
+                break;
+            }
+            case AST_WHILE: {
+                auto *whileStmt = static_cast<WhileStmt *>(stmt);
+                assignedNames(whileStmt->cond, names);
+                for (auto *s: whileStmt->blockStatement->stmts) {
+                    assignedNames(s, names);
+                }
+                break;
+            }
+            default:
+                break;
+        }
+    }
+
+    OpCode binaryOp(Token opt) {
+        switch (opt) {
+            case TK_PLUS:
+                return apollo::OP_ADD;
+            case TK_MINUS:
+                return apollo::OP_SUB;
+            case TK_TIMES:
+                return apollo::OP_MUL;
+            case TK_DIV:
+                return apollo::OP_DIV;
+            case TK_MOD:
+                return apollo::OP_MOD;
+            case TK_LOGAND:
+                return apollo::OP_AND;
+            case TK_LOGOR:
+                return apollo::OP_OR;
+            case TK_EQ:
+                return apollo::OP_EQ;
+            case TK_NE:
+                return apollo::OP_NE;
+            case TK_GT:
+                return apollo::OP_GT;
+            case TK_GE:
+                return apollo::OP_GE;
+            case TK_LT:
+                return apollo::OP_LT;
+            case TK_LE:
+                return apollo::OP_LE;
+            case TK_BITAND:
+                return apollo::OP_BITAND;
+            case TK_BITOR:
+                return apollo::OP_BITOR;
+            default:
+                panic("InternalError: no instruction for binary operator %d\n", opt);
+        }
+    }
+
+    // The form taking a constant right operand, or the op itself if none
+    OpCode constantOp(OpCode op) {
+        switch (op) {
+            case apollo::OP_ADD:
+                return apollo::OP_ADDK;
+            case apollo::OP_SUB:
+                return apollo::OP_SUBK;
+            case apollo::OP_MUL:
+                return apollo::OP_MULK;
+            case apollo::OP_DIV:
+                return apollo::OP_DIVK;
+            case apollo::OP_MOD:
+                return apollo::OP_MODK;
+            case apollo::OP_EQ:
+                return apollo::OP_EQK;
+            case apollo::OP_NE:
+                return apollo::OP_NEK;
+            case apollo::OP_GT:
+                return apollo::OP_GTK;
+            case apollo::OP_GE:
+                return apollo::OP_GEK;
+            case apollo::OP_LT:
+                return apollo::OP_LTK;
+            case apollo::OP_LE:
+                return apollo::OP_LEK;
+            default:
+                return op;
+        }
+    }
+
+    OpCode unaryOp(Token opt) {
+        switch (opt) {
+            case TK_MINUS:
+                return apollo::OP_NEG;
+            case TK_LOGNOT:
+                return apollo::OP_NOT;
+            case TK_BITNOT:
+                return apollo::OP_BITNOT;
+            default:
+                panic("InternalError: no instruction for unary operator %d\n", opt);
+        }
+    }
+}
+
+Compiler::Compiler(std::vector<apollo::Symbol> &globals) : globals(&globals) {}
+
+std::unique_ptr<apollo::Bytecode> Compiler::compileProgram(const std::vector<Statement *> &stmts) {
+    if (!begin(static_cast<uint32_t>(globals->size()), stmts)) {
+        return nullptr;
+    }
+    scopes.front().locals = globals;
+    for (auto *stmt: stmts) {
+        topLevelStatement(stmt);
+    }
+    out->globalCount = static_cast<uint32_t>(globals->size());
+    return finish();
+}
+
+std::unique_ptr<apollo::Bytecode> Compiler::compileStatement(Statement *stmt) {
+    return compileProgram({stmt});
+}
+
+std::unique_ptr<apollo::Bytecode> Compiler::compileFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f) {
+    if (!f->resolved) {
+        Resolver::resolveFunction(rt, f);
+    }
+    auto *body = f->getBody();
+    Compiler compiler;
+    compiler.inFunction = true;
+    if (!compiler.begin(static_cast<uint32_t>(body->locals.size()), body->stmts)) {
+        return nullptr;
+    }
+    compiler.scopes.front().locals = &body->locals;
+    // The parameters are declared first, a repeated name shares its slot
+    uint32_t paramCount = 0;
+    for (auto slot: f->paramSlots) {
+        paramCount = std::max(paramCount, slot + 1);
+    }
+    for (uint32_t i = 0; i < paramCount; i++) {
+        compiler.state[i] = Assigned;
+    }
+    for (auto *stmt: body->stmts) {
+        compiler.topLevelStatement(stmt);
+    }
+    compiler.out->paramCount = paramCount;
+    compiler.out->function = f;
+    return compiler.finish();
+}
+
+bool Compiler::begin(uint32_t frameVariables, const std::vector<Statement *> &stmts) {
+    uint64_t variables = static_cast<uint64_t>(frameVariables) + blockVariables(stmts);
+    if (variables > maxRegisters) {
+        return false;
+    }
+    out = std::make_unique<apollo::Bytecode>();
+    scopes.clear();
+    scopes.push_back(Scope{nullptr, 0});
+    targets.clear();
+    tooLarge = false;
+    variableTop = static_cast<uint32_t>(variables);
+    nextVariable = frameVariables;
+    nextTemp = variableTop;
+    out->frameSize = variableTop;
+    // What is known about the frame's own variables (the globals) stays
+    state.resize(frameVariables, Unassigned);
+    state.resize(variableTop, Unassigned);
+    std::fill(state.begin() + frameVariables, state.end(), Unassigned);
+    return true;
+}
+
+std::unique_ptr<apollo::Bytecode> Compiler::finish() {
+    auto t = temp();
+    emit(apollo::OP_LOADNULL, t, 0, 0, nullptr);
+    emit(apollo::OP_RETURN, t, 0, 0, nullptr);
+    out->variableCount = variableTop;
+    state.resize(scopes.front().locals->size());
+    if (tooLarge) {
+        return nullptr;
+    }
+    return std::move(out);
+}
+
+void Compiler::topLevelStatement(Statement *stmt) {
+    targets.push_back(Target{false, scopes.size()});
+    statement(stmt);
+    auto target = std::move(targets.back());
+    targets.pop_back();
+    for (auto jump: target.breaks) {
+        patch(jump);
+    }
+    for (auto &other: target.breakStates) {
+        join(state, other);
+    }
+}
+
+void Compiler::statement(Statement *stmt) {
+    switch (stmt->kind) {
+        case AST_EXPR_STMT:
+            expr(static_cast<ExpressionStmt *>(stmt)->expression, noValue);
+            break;
+        case AST_RETURN: {
+            auto *ret = static_cast<ReturnStmt *>(stmt);
+            if (inFunction) {
+                emit(apollo::OP_RETURN, expr(ret->expression), 0, 0, stmt);
+            } else {
+                // Ends the top-level statement it is in, as in the tree walker
+                expr(ret->expression, noValue);
+                jumpOut(targets.front(), false, stmt);
+            }
+            break;
+        }
+        case AST_BREAK:
+            jumpOut(targets.back(), false, stmt);
+            break;
+        case AST_CONTINUE:
+            jumpOut(targets.back(), true, stmt);
+            break;
+        case AST_IF:
+            ifStatement(static_cast<IfStmt *>(stmt));
+            break;
+        case AST_WHILE:
+            whileStatement(static_cast<WhileStmt *>(stmt));
+            break;
+        default:
+            panic("InternalError: can not compile statement at line %d, col %d\n", stmt->start, stmt->end);
+    }
+    nextTemp = variableTop;
+}
+
+void Compiler::ifStatement(IfStmt *stmt) {
+    auto skip = emitJump(apollo::OP_JFALSE, expr(stmt->cond), stmt);
+    nextTemp = variableTop;
+    auto afterCond = state;
+
+    enterBlock(stmt->blockStatement);
+    for (auto *s: stmt->blockStatement->stmts) {
+        statement(s);
+    }
+    leaveBlock(stmt->blockStatement, stmt);
+
+    if (stmt->elseBlock == nullptr) {
+        patch(skip);
+        join(state, afterCond);
+        return;
+    }
+    auto end = emitJump(apollo::OP_JMP, 0, stmt);
+    auto afterThen = std::move(state);
+    state = std::move(afterCond);
+    patch(skip);
+    enterBlock(stmt->elseBlock);
+    for (auto *s: stmt->elseBlock->stmts) {
+        statement(s);
+    }
+    leaveBlock(stmt->elseBlock, stmt);
+    patch(end);
+    join(state, afterThen);
+}
+
+void Compiler::whileStatement(WhileStmt *stmt) {
+    // The condition is tested once before the loop's context is entered
+    // and then at the bottom of every iteration
+    auto skip = emitJump(apollo::OP_JFALSE, expr(stmt->cond), stmt);
+    nextTemp = variableTop;
+    auto afterCond = state;
+
+    enterBlock(stmt->blockStatement);
+    loopHead(stmt);
+    auto top = out->code.size();
+    targets.push_back(Target{true, scopes.size()});
+    for (auto *s: stmt->blockStatement->stmts) {
+        statement(s);
+    }
+    auto target = std::move(targets.back());
+    targets.pop_back();
+
+    for (auto jump: target.continues) {
+        patch(jump);
+    }
+    for (auto &other: target.continueStates) {
+        join(state, other);
+    }
+    patch(emitJump(apollo::OP_JTRUE, expr(stmt->cond), stmt), top);
+    nextTemp = variableTop;
+
+    for (auto jump: target.breaks) {
+        patch(jump);
+    }
+    for (auto &other: target.breakStates) {
+        join(state, other);
+    }
+    leaveBlock(stmt->blockStatement, stmt);
+    patch(skip);
+    join(state, afterCond);
+}
+
+void Compiler::jumpOut(Target &target, bool isContinue, AbstractSyntaxTreeNode *origin) {
+    clearScopes(target.scopeCount, origin);
+    auto jump = emitJump(apollo::OP_JMP, 0, origin);
+    if (target.loop && isContinue) {
+        target.continues.push_back(jump);
+        target.continueStates.push_back(state);
+    } else {
+        target.breaks.push_back(jump);
+        target.breakStates.push_back(state);
+    }
+}
+
+void Compiler::enterBlock(struct apollo::BlockStatement *block) {
+    // Like Interpreter::enterContext, a block without variables has no scope
+    if (block->locals.empty()) {
+        return;
+    }
+    auto base = static_cast<uint16_t>(nextVariable);
+    nextVariable += static_cast<uint32_t>(block->locals.size());
+    scopes.push_back(Scope{&block->locals, base});
+    // The registers may have been a sibling block's, which cleared them on
+    // every way out
+    std::fill_n(state.begin() + base, block->locals.size(), Unassigned);
+}
+
+void Compiler::leaveBlock(struct apollo::BlockStatement *block, AbstractSyntaxTreeNode *origin) {
+    if (block->locals.empty()) {
+        return;
+    }
+    clearScopes(scopes.size() - 1, origin);
+    auto &scope = scopes.back();
+    std::fill_n(state.begin() + scope.base, scope.locals->size(), Unassigned);
+    nextVariable = scope.base;
+    scopes.pop_back();
+}
+
+void Compiler::clearScopes(size_t keep, AbstractSyntaxTreeNode *origin) {
+    // Variables of the scopes left are unassigned when they are entered
+    // again, and their values are released now as contexts release theirs
+    for (auto i = scopes.size(); i-- > keep;) {
+        auto &scope = scopes[i];
+        uint32_t first = scope.base + scope.locals->size();
+        uint32_t last = scope.base;
+        for (uint32_t r = scope.base; r < scope.base + scope.locals->size(); r++) {
+            if (state[r] != Unassigned) {
+                first = std::min(first, r);
+                last = r + 1;
+            }
+        }
+        if (first < last) {
+            emit(apollo::OP_CLEAR, first, last - first, 0, origin);
+        }
+    }
+}
+
+uint16_t Compiler::expr(Expression *expr, int dst) {
+    auto target = [&]() { return dst >= 0 ? static_cast<uint16_t>(dst) : temp(); };
+    if (expr == nullptr) {
+        auto r = target();
+        emit(apollo::OP_LOADNULL, r, 0, 0, nullptr);
+        return r;
+    }
+    switch (expr->kind) {
+        case AST_NULL: {
+            auto r = target();
+            emit(apollo::OP_LOADNULL, r, 0, 0, expr);
+            return r;
+        }
+        case AST_BOOLEAN: {
+            auto r = target();
+            emit(apollo::OP_LOADBOOL, r, static_cast<BooleanExpression *>(expr)->literal, 0, expr);
+            return r;
+        }
+        case AST_NUMBER: {
+            auto r = target();
+            auto k = constant(static_cast<NumberExpression *>(expr)->literal);
+            emit(apollo::OP_LOADK, r, k & 0xffff, k >> 16, expr);
+            return r;
+        }
+        case AST_STRING: {
+            auto r = target();
+            auto *str = static_cast<StringExpression *>(expr);
+            auto k = constant(apollo::ValueDeclaration::fromString(str->literal));
+            emit(apollo::OP_LOADK, r, k & 0xffff, k >> 16, expr);
+            return r;
+        }
+        case AST_ARRAY:
+            return array(static_cast<ArrayExpression *>(expr), dst);
+        case AST_IDENT:
+            return identifier(static_cast<IdentExpression *>(expr), dst);
+        case AST_INDEX:
+            return index(static_cast<IndexExpression *>(expr), dst);
+        case AST_BINARY:
+            return binary(static_cast<BinaryExpression *>(expr), dst);
+        case AST_FUNCALL:
+            return call(static_cast<FunCallExpression *>(expr), dst);
+        case AST_ASSIGN:
+            return assign(static_cast<AssignExpression *>(expr), dst);
+        default:
+            panic("InternalError: can not compile expression at line %d, col %d\n", expr->start, expr->end);
+    }
+}
+
+uint16_t Compiler::stable(uint16_t reg, Expression *later, AbstractSyntaxTreeNode *origin) {
+    if (reg >= variableTop || !hasAssignment(later)) {
+        return reg;
+    }
+    auto t = temp();
+    emit(apollo::OP_MOVE, t, reg, 0, origin);
+    return t;
+}
+
+uint16_t Compiler::read(const std::vector<apollo::SlotRef> &bindings, int dst, Expression *origin) {
+    auto regs = candidates(bindings);
+    if (regs.empty()) {
+        emit(apollo::OP_UNDEFINED, 0, 0, 0, origin);
+        return dst >= 0 ? static_cast<uint16_t>(dst) : temp();
+    }
+    if (regs.size() == 1) {
+        auto r = regs.front();
+        if (state[r] == MaybeAssigned) {
+            emit(apollo::OP_CHECKVAR, r, 0, 0, origin);
+            state[r] = Assigned;
+        }
+        if (dst >= 0 && dst != r) {
+            emit(apollo::OP_MOVE, dst, r, 0, origin);
+            return dst;
+        }
+        return r;
+    }
+    // Several scopes may hold the name: take the first one defined
+    auto t = dst >= 0 ? static_cast<uint16_t>(dst) : temp();
+    std::vector<size_t> found;
+    for (auto r: regs) {
+        if (state[r] != Assigned) {
+            found.push_back(emitJump(apollo::OP_JDEF, r, origin));
+        }
+    }
+    std::vector<size_t> done;
+    if (state[regs.back()] == Assigned) {
+        emit(apollo::OP_MOVE, t, regs.back(), 0, origin);
+    } else {
+        emit(apollo::OP_UNDEFINED, 0, 0, 0, origin);
+    }
+    done.push_back(emitJump(apollo::OP_JMP, 0, origin));
+    for (size_t i = 0; i < found.size(); i++) {
+        patch(found[i]);
+        emit(apollo::OP_MOVE, t, regs[i], 0, origin);
+        done.push_back(emitJump(apollo::OP_JMP, 0, origin));
+    }
+    for (auto jump: done) {
+        patch(jump);
+    }
+    return t;
+}
+
+uint16_t Compiler::identifier(IdentExpression *ident, int dst) {
+    return read(ident->bindings, dst, ident);
+}
+
+uint16_t Compiler::index(IndexExpression *index, int dst) {
+    // The variable is looked up before the index is evaluated
+    auto regs = candidates(index->bindings);
+    uint16_t var;
+    bool copied = false;
+    if (regs.size() <= 1) {
+        var = read(index->bindings, anyRegister, index);
+    } else {
+        var = read(index->bindings, temp(), index);
+        copied = true;
+    }
+    auto i = expr(index->index);
+    auto r = dst >= 0 ? static_cast<uint16_t>(dst) : temp();
+    emit(apollo::OP_GETINDEX, r, var, i, index);
+    if (copied) {
+        // Do not keep the array shared, it would be copied on the next write
+        emit(apollo::OP_CLEAR, var, 1, 0, index);
+    }
+    return r;
+}
+
+uint16_t Compiler::binary(BinaryExpression *binary, int dst) {
+    if (binary->rightExpression == nullptr) {
+        auto operand = expr(binary->leftExpression);
+        auto r = dst >= 0 ? static_cast<uint16_t>(dst) : temp();
+        emit(unaryOp(binary->opt), r, operand, 0, binary);
+        return r;
+    }
+    auto op = binaryOp(binary->opt);
+    auto lhs = stable(expr(binary->leftExpression), binary->rightExpression, binary);
+    if (binary->rightExpression->kind == AST_NUMBER && constantOp(op) != op) {
+        auto k = constant(static_cast<NumberExpression *>(binary->rightExpression)->literal);
+        if (k <= maxRegisters) {
+            auto r = dst >= 0 ? static_cast<uint16_t>(dst) : temp();
+            emit(constantOp(op), r, lhs, static_cast<uint16_t>(k), binary);
+            return r;
+        }
+    }
+    auto rhs = expr(binary->rightExpression);
+    auto r = dst >= 0 ? static_cast<uint16_t>(dst) : temp();
+    emit(op, r, lhs, rhs, binary);
+    return r;
+}
+
+uint16_t Compiler::call(FunCallExpression *call, int dst) {
+    // Arguments go to consecutive registers; a user function's frame
+    // starts at the first of them, a builtin sees them as its span
+    auto site = static_cast<uint32_t>(out->calls.size());
+    out->calls.push_back(call);
+    if (!call->args.empty()) {
+        emit(apollo::OP_BIND, 0, site & 0xffff, site >> 16, call);
+    }
+    auto base = nextTemp;
+    for (size_t i = 0; i < call->args.size(); i++) {
+        nextTemp = base + static_cast<uint32_t>(i);
+        expr(call->args[i], temp());
+    }
+    nextTemp = base;
+    temp();
+    nextTemp = base + std::max<uint32_t>(1, static_cast<uint32_t>(call->args.size()));
+    emit(apollo::OP_CALL, base, site & 0xffff, site >> 16, call);
+    if (dst >= 0 && static_cast<uint32_t>(dst) != base) {
+        emit(apollo::OP_TAKE, dst, base, 0, call);
+        return dst;
+    }
+    return base;
+}
+
+uint16_t Compiler::array(ArrayExpression *array, int dst) {
+    auto base = nextTemp;
+    for (size_t i = 0; i < array->literal.size(); i++) {
+        nextTemp = base + static_cast<uint32_t>(i);
+        expr(array->literal[i], temp());
+    }
+    nextTemp = base + static_cast<uint32_t>(array->literal.size());
+    auto r = dst >= 0 ? static_cast<uint16_t>(dst) : temp();
+    emit(apollo::OP_NEWARRAY, r, base, static_cast<uint16_t>(array->literal.size()), array);
+    return r;
+}
+
+uint16_t Compiler::assign(AssignExpression *assign, int dst) {
+    auto *left = assign->leftExpression;
+    const std::vector<apollo::SlotRef> *bindings;
+    if (left->kind == AST_IDENT) {
+        bindings = &static_cast<IdentExpression *>(left)->bindings;
+    } else if (left->kind == AST_INDEX) {
+        bindings = &static_cast<IndexExpression *>(left)->bindings;
+    } else {
+        panic("SyntaxError: can not assign to %s at line %d, col %d\n",
+              typeid(left).name(), assign->start, assign->end);
+    }
+    auto opt = assign->opt;
+    // A name not defined yet is created in the innermost scope assigning it
+    auto created = variable(bindings->front());
+
+    if (left->kind == AST_IDENT) {
+        auto settles = [&](const std::vector<uint16_t> &regs) {
+            return regs.empty() || (regs.size() == 1 && (state[regs[0]] == Assigned || regs[0] == created));
+        };
+        auto regs = candidates(*bindings);
+        auto *value = assign->rightExperssion;
+        if (settles(regs) && !hasAssignment(value)) {
+            auto var = regs.empty() ? created : regs[0];
+            if (opt == TK_ASSIGN) {
+                // Evaluated straight into the variable
+                expr(value, var);
+                assigned(regs, created);
+                if (dst >= 0 && dst != var) {
+                    emit(apollo::OP_MOVE, dst, var, 0, assign);
+                    return dst;
+                }
+                return var;
+            }
+            if (opt == TK_PLUS_AGN && dst == noValue && value->kind == AST_NUMBER) {
+                auto k = constant(static_cast<NumberExpression *>(value)->literal);
+                if (k <= maxRegisters) {
+                    emit(apollo::OP_ADDTOK, var, static_cast<uint16_t>(k), 0, assign);
+                    assigned(regs, created);
+                    return var;
+                }
+            }
+        }
+        auto rhs = expr(value);
+        // The right hand side may have defined the variable
+        regs = candidates(*bindings);
+        bool settled = settles(regs);
+        if (rhs < variableTop && dst != noValue) {
+            // The value of the assignment is the right hand side before it
+            auto t = temp();
+            emit(apollo::OP_MOVE, t, rhs, 0, assign);
+            rhs = t;
+        }
+        // Compound assignment to a variable that is not defined yet defines it
+        auto update = [&](uint16_t var) {
+            if (opt == TK_ASSIGN) {
+                emit(apollo::OP_MOVE, var, rhs, 0, assign);
+            } else if (opt == TK_PLUS_AGN) {
+                emit(apollo::OP_ADDTO, var, rhs, 0, assign);
+            } else {
+                emit(apollo::OP_ASSIGNOP, var, rhs, 0, assign, static_cast<uint8_t>(opt));
+            }
+        };
+        if (settled) {
+            update(regs.empty() ? created : regs[0]);
+        } else {
+            std::vector<size_t> found;
+            for (auto r: regs) {
+                if (state[r] != Assigned) {
+                    found.push_back(emitJump(apollo::OP_JDEF, r, assign));
+                }
+            }
+            std::vector<size_t> done;
+            if (state[regs.back()] == Assigned) {
+                update(regs.back());
+            } else {
+                emit(apollo::OP_MOVE, created, rhs, 0, assign);
+            }
+            done.push_back(emitJump(apollo::OP_JMP, 0, assign));
+            for (size_t i = 0; i < found.size(); i++) {
+                patch(found[i]);
+                update(regs[i]);
+                done.push_back(emitJump(apollo::OP_JMP, 0, assign));
+            }
+            for (auto jump: done) {
+                patch(jump);
+            }
+        }
+        assigned(regs, created);
+        if (dst >= 0 && dst != rhs) {
+            emit(apollo::OP_MOVE, dst, rhs, 0, assign);
+            return dst;
+        }
+        return rhs;
+    }
+
+    // arr[i] op= rhs: the right hand side first, then the index
+    auto *indexExpr = static_cast<IndexExpression *>(left);
+    auto rhs = stable(expr(assign->rightExperssion), indexExpr->index, assign);
+    auto i = expr(indexExpr->index);
+    auto regs = candidates(*bindings);
+    bool settled = regs.empty() || (regs.size() == 1 && (state[regs[0]] == Assigned || regs[0] == created));
+    if (settled) {
+        emit(apollo::OP_SETINDEX, regs.empty() ? created : regs[0], i, rhs, assign, static_cast<uint8_t>(opt));
+    } else {
+        std::vector<size_t> found;
+        for (auto r: regs) {
+            if (state[r] != Assigned) {
+                found.push_back(emitJump(apollo::OP_JDEF, r, assign));
+            }
+        }
+        std::vector<size_t> done;
+        emit(apollo::OP_SETINDEX, state[regs.back()] == Assigned ? regs.back() : created, i, rhs, assign,
+             static_cast<uint8_t>(opt));
+        done.push_back(emitJump(apollo::OP_JMP, 0, assign));
+        for (size_t j = 0; j < found.size(); j++) {
+            patch(found[j]);
+            emit(apollo::OP_SETINDEX, regs[j], i, rhs, assign, static_cast<uint8_t>(opt));
+            done.push_back(emitJump(apollo::OP_JMP, 0, assign));
+        }
+        for (auto jump: done) {
+            patch(jump);
+        }
+    }
+    assigned(regs, created);
+    if (dst >= 0 && dst != rhs) {
+        emit(apollo::OP_MOVE, dst, rhs, 0, assign);
+        return dst;
+    }
+    return rhs;
+}
+
+std::vector<uint16_t> Compiler::candidates(const std::vector<apollo::SlotRef> &bindings) const {
+    std::vector<uint16_t> regs;
+    for (auto &ref: bindings) {
+        auto r = variable(ref);
+        if (state[r] == Unassigned) {
+            continue;
+        }
+        regs.push_back(r);
+        if (state[r] == Assigned) {
+            break;
+        }
+    }
+    return regs;
+}
+
+uint16_t Compiler::variable(const apollo::SlotRef &ref) const {
+    return static_cast<uint16_t>(scopes[ref.depth].base + ref.slot);
+}
+
+void Compiler::assigned(const std::vector<uint16_t> &regs, uint16_t created) {
+    if (regs.empty()) {
+        state[created] = Assigned;
+        return;
+    }
+    if (regs.size() == 1 && (state[regs[0]] == Assigned || regs[0] == created)) {
+        state[regs[0]] = Assigned;
+        return;
+    }
+    // Which of them was written is only known at run time
+    for (auto r: regs) {
+        if (state[r] != Assigned) {
+            state[r] = MaybeAssigned;
+        }
+    }
+    if (state[regs.back()] != Assigned && state[created] == Unassigned) {
+        state[created] = MaybeAssigned;
+    }
+}
+
+void Compiler::loopHead(WhileStmt *loop) {
+    if (dryRuns >= maxDryRuns) {
+        markLoopAssignments(loop);
+        return;
+    }
+    // What is known when an iteration starts: the state before the loop
+    // joined with the state at the back edge, found by compiling the body
+    // until it no longer changes and throwing that code away
+    auto codeSize = out->code.size();
+    auto constantCount = out->constants.size();
+    auto callCount = out->calls.size();
+    auto savedTargets = targets;
+    auto savedNextVariable = nextVariable;
+    dryRuns++;
+    for (;;) {
+        auto head = state;
+        targets.push_back(Target{true, scopes.size()});
+        for (auto *s: loop->blockStatement->stmts) {
+            statement(s);
+        }
+        for (auto &other: targets.back().continueStates) {
+            join(state, other);
+        }
+        expr(loop->cond);
+        nextTemp = variableTop;
+
+        out->code.resize(codeSize);
+        out->origins.resize(codeSize);
+        out->constants.erase(out->constants.begin() + static_cast<std::ptrdiff_t>(constantCount), out->constants.end());
+        out->calls.resize(callCount);
+        targets = savedTargets;
+        nextVariable = savedNextVariable;
+        auto back = std::move(state);
+        state = head;
+        join(state, back);
+        if (state == head) {
+            break;
+        }
+    }
+    dryRuns--;
+}
+
+void Compiler::markLoopAssignments(WhileStmt *loop) {
+    // A variable the loop may assign is only maybe assigned when an
+    // iteration starts, unless it already was before the loop
+    std::unordered_set<apollo::Symbol> names;
+    assignedNames(loop, names);
+    if (names.empty()) {
+        return;
+    }
+    for (auto &scope: scopes) {
+        for (uint32_t slot = 0; slot < scope.locals->size(); slot++) {
+            auto r = scope.base + slot;
+            if (state[r] != Assigned && names.count((*scope.locals)[slot]) != 0) {
+                state[r] = MaybeAssigned;
+            }
+        }
+    }
+}
+
+void Compiler::join(std::vector<VarState> &into, const std::vector<VarState> &other) {
+    for (size_t i = 0; i < into.size() && i < other.size(); i++) {
+        if (into[i] != other[i]) {
+            into[i] = MaybeAssigned;
+        }
+    }
+}
+
+uint16_t Compiler::temp() {
+    if (nextTemp >= maxRegisters) {
+        // The code is compiled to the end and then dropped by finish
+        tooLarge = true;
+        return 0;
+    }
+    auto r = static_cast<uint16_t>(nextTemp++);
+    out->frameSize = std::max(out->frameSize, nextTemp);
+    return r;
+}
+
+uint32_t Compiler::constant(const apollo::ValueDeclaration &value) {
+    auto &constants = out->constants;
+    auto same = [&](const apollo::ValueDeclaration &k) {
+        if (k.type != value.type) {
+            return false;
+        }
+        switch (value.type) {
+            case apollo::Integer:
+                return k.asInteger() == value.asInteger();
+            case apollo::Number:
+                return std::memcmp(&k, &value, sizeof(value)) == 0;
+            case apollo::String:
+                return k.asString() == value.asString();
+            default:
+                return false;
+        }
+    };
+    // Programs have few distinct literals; search the most recent ones
+    auto from = constants.size() > 64 ? constants.size() - 64 : 0;
+    for (auto i = constants.size(); i-- > from;) {
+        if (same(constants[i])) {
+            return static_cast<uint32_t>(i);
+        }
+    }
+    constants.push_back(value);
+    return static_cast<uint32_t>(constants.size() - 1);
+}
+
+size_t Compiler::emit(apollo::OpCode op, uint16_t a, uint16_t b, uint16_t c, AbstractSyntaxTreeNode *origin,
+                      uint8_t k) {
+    out->code.push_back(Instruction{op, k, a, b, c});
+    out->origins.push_back(origin);
+    return out->code.size() - 1;
+}
+
+size_t Compiler::emitJump(apollo::OpCode op, uint16_t a, AbstractSyntaxTreeNode *origin) {
+    return emit(op, a, 0, 0, origin);
+}
+
+void Compiler::patch(size_t jump) {
+    patch(jump, out->code.size());
+}
+
+void Compiler::patch(size_t jump, size_t target) {
+    out->code[jump].b = static_cast<uint16_t>(target & 0xffff);
+    out->code[jump].c = static_cast<uint16_t>(target >> 16);
+}
@@ -0,0 +1,376 @@
+//
+// Created by chineseblack23 on 2024/6/30.
+//
+#include "FlatInterpreter.hpp"
+#include "Interpreter.hpp"
+#include "Resolver.hpp"
+#include "Utils.hpp"
+
+using apollo::FlatNode;
+using apollo::FlatTree;
+
+FlatInterpreter::FlatInterpreter(apollo::Runtime *rt) : rt(rt) {}
+
+FlatInterpreter::~FlatInterpreter() {
+    for (auto *f: functions) {
+        f->flatBody = FlatTree::none;
+    }
+}
+
+void FlatInterpreter::flattenFunctions() {
+    for (auto &[name, f]: rt->getFunctions()) {
+        flatten(name);
+    }
+}
+
+void FlatInterpreter::load(const std::vector<Statement *> &stmts) {
+    program.clear();
+    program.addBlock(stmts, nullptr);
+    // Only what the statements may call is flattened. A body flattened here
+    // appends its own call sites to the library, the loop reaches them too
+    for (auto &site: program.calls) {
+        flatten(site.name);
+    }
+    for (; linked < library.calls.size(); linked++) {
+        flatten(library.calls[linked].name);
+    }
+}
+
+void FlatInterpreter::flatten(apollo::Symbol name) {
+    auto *f = rt->getFunctionDeclaration(name);
+    if (f == nullptr || f->flatBody != FlatTree::none) {
+        return;
+    }
+    if (!f->resolved) {
+        Resolver::resolveFunction(rt, f);
+    }
+    f->flatBody = library.addFunction(f->getBody()->stmts, f->getBody()->locals);
+    functions.push_back(f);
+}
+
+void FlatInterpreter::run(apollo::ContextChain &ctxChain) {
+    auto root = program.nodes.front();
+    apollo::ValueDeclaration ignored;
+    for (uint32_t i = 0; i < root.b; i++) {
+        // Like the tree walker, a break, continue or return outside of a
+        // loop or function only ends its own top-level statement
+        exec(program, program.lists[root.a + i], ctxChain, ignored);
+    }
+}
+
+inline apollo::ValueDeclaration *FlatInterpreter::find(const FlatTree &tree, const FlatTree::Reference &ref,
+                                                       const apollo::ContextChain &ctxChain) {
+    for (uint32_t i = 0; i < ref.count; i++) {
+        auto &slot = tree.bindings[ref.bindings + i];
+        if (auto *var = ctxChain[slot.depth]->getVariable(slot.slot); var != nullptr) {
+            return var;
+        }
+    }
+    return nullptr;
+}
+
+bool FlatInterpreter::condition(const FlatTree &tree, uint32_t node, const apollo::ValueDeclaration &value) {
+    if (!value.isType<apollo::Boolean>()) {
+        panic("TypeError: expects bool type in while condition at line %d, col %d\n",
+              tree.positions[node].start, tree.positions[node].end);
+    }
+    return value.asBool();
+}
+
+inline FlatInterpreter::Flow FlatInterpreter::block(const FlatTree &tree, uint32_t index,
+                                                    apollo::ContextChain &ctxChain, apollo::ValueDeclaration &result) {
+    FlatNode node = tree.nodes[index];
+    if (node.c != FlatTree::none) {
+        ctxChain.enter(&tree.locals[node.c]);
+    }
+    Flow flow = FlowNormal;
+    for (uint32_t i = 0; i < node.b; i++) {
+        flow = exec(tree, tree.lists[node.a + i], ctxChain, result);
+        if (flow != FlowNormal) {
+            break;
+        }
+    }
+    if (node.c != FlatTree::none) {
+        ctxChain.leave();
+    }
+    return flow;
+}
+
+FlatInterpreter::Flow FlatInterpreter::exec(const FlatTree &tree, uint32_t index, apollo::ContextChain &ctxChain,
+                                            apollo::ValueDeclaration &result) {
+    FlatNode node = tree.nodes[index];
+    switch (node.kind) {
+        case apollo::FLAT_EXPR: {
+            // Most expression statements are assignments, run them directly
+            FlatNode expr = tree.nodes[node.a];
+            if (expr.kind == apollo::FLAT_ASSIGN || expr.kind == apollo::FLAT_SETINDEX) {
+                assign(tree, expr, node.a, ctxChain);
+            } else {
+                eval(tree, node.a, ctxChain);
+            }
+            return FlowNormal;
+        }
+        case apollo::FLAT_RETURN:
+            result = node.a != FlatTree::none ? eval(tree, node.a, ctxChain) : apollo::ValueDeclaration(apollo::Null);
+            return FlowReturn;
+        case apollo::FLAT_BREAK:
+            return FlowBreak;
+        case apollo::FLAT_CONTINUE:
+            return FlowContinue;
+        case apollo::FLAT_IF:
+            if (condition(tree, index, operand(tree, node.a, ctxChain))) {
+                return block(tree, node.b, ctxChain, result);
+            }
+            if (node.c != FlatTree::none) {
+                return block(tree, node.c, ctxChain, result);
+            }
+            return FlowNormal;
+        case apollo::FLAT_WHILE: {
+            bool running = condition(tree, index, operand(tree, node.a, ctxChain));
+            // The loop's context is entered once and kept for every iteration
+            FlatNode body = tree.nodes[node.b];
+            if (body.c != FlatTree::none) {
+                ctxChain.enter(&tree.locals[body.c]);
+            }
+            Flow flow = FlowNormal;
+            while (running) {
+                for (uint32_t i = 0; i < body.b; i++) {
+                    flow = exec(tree, tree.lists[body.a + i], ctxChain, result);
+                    if (flow != FlowNormal) {
+                        break;
+                    }
+                }
+                if (flow == FlowReturn) {
+                    break;
+                } else if (flow == FlowBreak) {
+                    flow = FlowNormal;
+                    break;
+                }
+                flow = FlowNormal;
+                running = condition(tree, index, operand(tree, node.a, ctxChain));
+            }
+            if (body.c != FlatTree::none) {
+                ctxChain.leave();
+            }
+            return flow;
+        }
+        default:
+            panic("InternalError: not a statement at line %d, col %d\n",
+                  tree.positions[index].start, tree.positions[index].end);
+    }
+}
+
+inline const apollo::ValueDeclaration *FlatInterpreter::leaf(const FlatTree &tree, uint32_t index,
+                                                             const apollo::ContextChain &ctxChain) {
+    // Literals and variables are most operands, they are read in place
+    // without a call of their own
+    if (index == FlatTree::none) {
+        return nullptr;
+    }
+    auto &node = tree.nodes[index];
+    if (node.kind == apollo::FLAT_CONST) {
+        return &tree.constants[node.a];
+    }
+    if (node.kind == apollo::FLAT_IDENT) {
+        return find(tree, tree.references[node.a], ctxChain);
+    }
+    return nullptr;
+}
+
+inline apollo::ValueDeclaration FlatInterpreter::operand(const FlatTree &tree, uint32_t index,
+                                                        apollo::ContextChain &ctxChain) {
+    if (auto *value = leaf(tree, index, ctxChain); value != nullptr) {
+        return *value;
+    }
+    if (index == FlatTree::none) {
+        return apollo::ValueDeclaration(apollo::Null);
+    }
+    // Nested operators are called directly too, each call site then
+    // predicts its own branch instead of sharing eval's jump table
+    FlatNode node = tree.nodes[index];
+    if (node.kind == apollo::FLAT_BINARY) {
+        return binary(tree, node, index, ctxChain);
+    }
+    return eval(tree, index, ctxChain);
+}
+
+apollo::ValueDeclaration FlatInterpreter::binary(const FlatTree &tree, FlatNode node, uint32_t index,
+                                                 apollo::ContextChain &ctxChain) {
+    auto opt = static_cast<Token>(node.opt);
+    auto &pos = tree.positions[index];
+    // Two leaves are passed in place; otherwise the left operand is copied
+    // before the right one runs, which may assign to it
+    auto *lhs = leaf(tree, node.a, ctxChain);
+    if (lhs != nullptr) {
+        if (auto *rhs = leaf(tree, node.b, ctxChain); rhs != nullptr) {
+            return Interpreter::evalSpecialized(tree.specializations[node.c], opt, *lhs, *rhs, pos.start, pos.end);
+        }
+    }
+    auto left = lhs != nullptr ? *lhs : operand(tree, node.a, ctxChain);
+    auto right = operand(tree, node.b, ctxChain);
+    return Interpreter::evalSpecialized(tree.specializations[node.c], opt, left, right, pos.start, pos.end);
+}
+
+apollo::ValueDeclaration FlatInterpreter::eval(const FlatTree &tree, uint32_t index, apollo::ContextChain &ctxChain) {
+    FlatNode node = tree.nodes[index];
+    switch (node.kind) {
+        case apollo::FLAT_NULL:
+            return apollo::ValueDeclaration(apollo::Null);
+        case apollo::FLAT_BOOL:
+            return apollo::ValueDeclaration::fromBool(node.a != 0);
+        case apollo::FLAT_CONST:
+            return tree.constants[node.a];
+        case apollo::FLAT_IDENT: {
+            auto &ref = tree.references[node.a];
+            if (auto *var = find(tree, ref, ctxChain); var != nullptr) {
+                return *var;
+            }
+            panic("RuntimeError: use of undefined variable \"%s\" at line %d, col %d\n",
+                  ref.name.c_str(), tree.positions[index].start, tree.positions[index].end);
+        }
+        case apollo::FLAT_BINARY:
+            return binary(tree, node, index, ctxChain);
+        case apollo::FLAT_ASSIGN:
+        case apollo::FLAT_SETINDEX:
+            return assign(tree, node, index, ctxChain);
+        case apollo::FLAT_CALL:
+            return call(tree, node, ctxChain);
+        case apollo::FLAT_INDEX:
+        case apollo::FLAT_ARRAY:
+            return aggregate(tree, node, index, ctxChain);
+        default:
+            panic("InternalError: not an expression at line %d, col %d\n",
+                  tree.positions[index].start, tree.positions[index].end);
+    }
+}
+
+apollo::ValueDeclaration FlatInterpreter::aggregate(const FlatTree &tree, FlatNode node, uint32_t index,
+                                                    apollo::ContextChain &ctxChain) {
+    if (node.kind == apollo::FLAT_ARRAY) {
+        std::vector<apollo::ValueDeclaration> elements;
+        elements.reserve(node.b);
+        for (uint32_t i = 0; i < node.b; i++) {
+            elements.push_back(eval(tree, tree.lists[node.a + i], ctxChain));
+        }
+        return apollo::ValueDeclaration::fromArray(std::move(elements));
+    }
+
+    auto &ref = tree.references[node.a];
+    auto &pos = tree.positions[index];
+    auto *var = find(tree, ref, ctxChain);
+    if (var == nullptr) {
+        panic("RuntimeError: use of undefined variable \"%s\" at line %d, col %d\n",
+              ref.name.c_str(), pos.start, pos.end);
+    }
+    auto idx = operand(tree, node.b, ctxChain);
+    if (!idx.isNumber()) {
+        panic("TypeError: expects int type within indexing expression at line %d, col %d\n",
+              pos.start, pos.end);
+    }
+    if (!var->isType<apollo::Array>()) {
+        panic("TypeError: expects array type of variable %s at line %d, col %d\n",
+              ref.name.c_str(), pos.start, pos.end);
+    }
+    auto &elements = var->asArray();
+    if (idx.toDouble() < 0 || idx.toDouble() >= static_cast<double>(elements.size())) {
+        panic("IndexError: index %d out of range at line %d, col %d\n",
+              static_cast<int>(idx.toDouble()), pos.start, pos.end);
+    }
+    return elements[static_cast<size_t>(idx.toDouble())];
+}
+
+apollo::ValueDeclaration FlatInterpreter::assign(const FlatTree &tree, FlatNode node, uint32_t index,
+                                                 apollo::ContextChain &ctxChain) {
+    auto rhs = operand(tree, node.b, ctxChain);
+    auto opt = static_cast<Token>(node.opt);
+    auto &ref = tree.references[node.a];
+    // A name that is not defined yet goes to the innermost scope assigning it
+    auto &decl = tree.bindings[ref.bindings];
+
+    if (node.kind == apollo::FLAT_ASSIGN) {
+        if (auto *var = find(tree, ref, ctxChain); var != nullptr) {
+            if (opt == TK_PLUS_AGN && var->isType<apollo::Array>() && !rhs.isType<apollo::String>()) {
+                var->mutableArray().push_back(rhs);
+                return rhs;
+            }
+            *var = Interpreter::assignSwitch(opt, std::move(*var), rhs);
+            return rhs;
+        }
+        ctxChain[decl.depth]->createVariable(decl.slot, rhs);
+        return rhs;
+    }
+
+    auto &pos = tree.positions[index];
+    auto idx = operand(tree, node.c, ctxChain);
+    if (!idx.isNumber()) {
+        panic("TypeError: expects int type when applying indexing to variable %s at line %d, col %d\n",
+              ref.name.c_str(), pos.start, pos.end);
+    }
+    if (auto *var = find(tree, ref, ctxChain); var != nullptr) {
+        if (!var->isType<apollo::Array>()) {
+            panic("TypeError: expects array type of variable %s at line %d, col %d\n",
+                  ref.name.c_str(), pos.start, pos.end);
+        }
+        if (idx.toDouble() < 0 || idx.toDouble() >= static_cast<double>(var->asArray().size())) {
+            panic("IndexError: index %d out of range at line %d, col %d\n",
+                  static_cast<int>(idx.toDouble()), pos.start, pos.end);
+        }
+        auto &elements = var->mutableArray();
+        auto i = static_cast<size_t>(idx.toDouble());
+        elements[i] = Interpreter::assignSwitch(opt, std::move(elements[i]), rhs);
+        return rhs;
+    }
+    ctxChain[decl.depth]->createVariable(decl.slot, rhs);
+    return rhs;
+}
+
+void FlatInterpreter::bind(FlatTree::CallSite &site, uint32_t argc) {
+    FunCallExpression::lookup(rt, site.name, argc, site.builtin, site.function);
+    site.body = site.function != nullptr ? site.function->flatBody : FlatTree::none;
+    if (site.function != nullptr && site.body == FlatTree::none) {
+        panic("InternalError: function %s was not flattened\n", site.name.c_str());
+    }
+    site.epoch = rt->getFunctionEpoch();
+}
+
+apollo::ValueDeclaration FlatInterpreter::call(const FlatTree &tree, FlatNode node, apollo::ContextChain &ctxChain) {
+    auto &site = tree.calls[node.a];
+    if (site.epoch != rt->getFunctionEpoch()) {
+        bind(site, node.c);
+    }
+    if (site.builtin != nullptr) {
+        // Nested calls in the arguments push above us and pop before returning
+        auto &argStack = rt->getArgumentStack();
+        size_t base = argStack.size();
+        for (uint32_t i = 0; i < node.c; i++) {
+            argStack.push_back(eval(tree, tree.lists[node.b + i], ctxChain));
+        }
+        auto result = site.builtin(rt, ctxChain, std::span(argStack.data() + base, node.c));
+        argStack.erase(argStack.begin() + static_cast<std::ptrdiff_t>(base), argStack.end());
+        return result;
+    }
+
+    // Copied out, a call in the arguments may rebind the site
+    auto *f = site.function;
+    auto root = library.nodes[site.body];
+    // Arguments are evaluated in the caller's chain before the frame is pushed
+    auto *funcCtx = ctxChain.getStack().acquire(&library.locals[root.c]);
+    for (uint32_t i = 0; i < node.c; i++) {
+        auto arg = eval(tree, tree.lists[node.b + i], ctxChain);
+        // A repeated parameter name keeps the first argument
+        if (funcCtx->getVariable(f->paramSlots[i]) == nullptr) {
+            funcCtx->createVariable(f->paramSlots[i], std::move(arg));
+        }
+    }
+    auto funcCtxChain = ctxChain.openFrame();
+    funcCtxChain.push(funcCtx);
+
+    apollo::ValueDeclaration result(apollo::Null);
+    for (uint32_t i = 0; i < root.b; i++) {
+        if (exec(library, library.lists[root.a + i], funcCtxChain, result) == FlowReturn) {
+            break;
+        }
+    }
+    funcCtxChain.leave();
+    return result;
+}
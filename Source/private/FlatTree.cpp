@@ -0,0 +1,234 @@
+//
+// Created by chineseblack23 on 2024/6/30.
+//
+#include "FlatTree.hpp"
+#include "Utils.hpp"
+
+namespace apollo {
+
+    uint32_t FlatTree::addBlock(const std::vector<Statement *> &stmts, const std::vector<Symbol> *blockLocals) {
+        auto index = node(FLAT_BLOCK, nullptr);
+        std::vector<uint32_t> children;
+        children.reserve(stmts.size());
+        for (auto *stmt: stmts) {
+            children.push_back(statement(stmt));
+        }
+        nodes[index].a = list(children);
+        nodes[index].b = static_cast<uint32_t>(children.size());
+        if (blockLocals != nullptr && !blockLocals->empty()) {
+            nodes[index].c = static_cast<uint32_t>(locals.size());
+            locals.push_back(*blockLocals);
+        }
+        return index;
+    }
+
+    uint32_t FlatTree::addFunction(const std::vector<Statement *> &stmts, const std::vector<Symbol> &frame) {
+        auto index = addBlock(stmts, nullptr);
+        nodes[index].c = static_cast<uint32_t>(locals.size());
+        locals.push_back(frame);
+        return index;
+    }
+
+    void FlatTree::clear() {
+        nodes.clear();
+        positions.clear();
+        constants.clear();
+        references.clear();
+        bindings.clear();
+        lists.clear();
+        locals.clear();
+        calls.clear();
+        specializations.clear();
+    }
+
+    size_t FlatTree::memoryUsage() const {
+        size_t bytes = nodes.capacity() * sizeof(FlatNode) + positions.capacity() * sizeof(Position) +
+                       constants.capacity() * sizeof(ValueDeclaration) + references.capacity() * sizeof(Reference) +
+                       bindings.capacity() * sizeof(SlotRef) + lists.capacity() * sizeof(uint32_t) +
+                       locals.capacity() * sizeof(std::vector<Symbol>) + calls.capacity() * sizeof(CallSite) +
+                       specializations.capacity();
+        for (auto &names: locals) {
+            bytes += names.capacity() * sizeof(Symbol);
+        }
+        return bytes;
+    }
+
+    uint32_t FlatTree::node(FlatKind kind, AbstractSyntaxTreeNode *origin) {
+        if (nodes.size() >= none) {
+            panic("RuntimeError: program too large to flatten\n");
+        }
+        nodes.push_back(FlatNode{kind, 0, none, none, none});
+        positions.push_back(origin != nullptr ? Position{origin->start, origin->end} : Position{0, 0});
+        return static_cast<uint32_t>(nodes.size() - 1);
+    }
+
+    uint32_t FlatTree::statement(Statement *stmt) {
+        switch (stmt->kind) {
+            case AST_EXPR_STMT: {
+                auto index = node(FLAT_EXPR, stmt);
+                auto expr = expression(static_cast<ExpressionStmt *>(stmt)->expression);
+                nodes[index].a = expr;
+                return index;
+            }
+            case AST_RETURN: {
+                auto index = node(FLAT_RETURN, stmt);
+                auto *expr = static_cast<ReturnStmt *>(stmt)->expression;
+                if (expr != nullptr) {
+                    auto value = expression(expr);
+                    nodes[index].a = value;
+                }
+                return index;
+            }
+            case AST_BREAK:
+                return node(FLAT_BREAK, stmt);
+            case AST_CONTINUE:
+                return node(FLAT_CONTINUE, stmt);
+            case AST_IF: {
+                auto *ifStmt = static_cast<IfStmt *>(stmt);
+                auto index = node(FLAT_IF, stmt);
+                auto cond = expression(ifStmt->cond);
+                auto then = addBlock(ifStmt->blockStatement->stmts, &ifStmt->blockStatement->locals);
+                auto otherwise = none;
+                if (ifStmt->elseBlock != nullptr) {
+                    otherwise = addBlock(ifStmt->elseBlock->stmts, &ifStmt->elseBlock->locals);
+                }
+                nodes[index].a = cond;
+                nodes[index].b = then;
+                nodes[index].c = otherwise;
+                return index;
+            }
+            case AST_WHILE: {
+                auto *whileStmt = static_cast<WhileStmt *>(stmt);
+                auto index = node(FLAT_WHILE, stmt);
+                auto cond = expression(whileStmt->cond);
+                auto body = addBlock(whileStmt->blockStatement->stmts, &whileStmt->blockStatement->locals);
+                nodes[index].a = cond;
+                nodes[index].b = body;
+                return index;
+            }
+            default:
+                panic("InternalError: can not flatten statement at line %d, col %d\n", stmt->start, stmt->end);
+        }
+    }
+
+    uint32_t FlatTree::expression(Expression *expr) {
+        switch (expr->kind) {
+            case AST_NULL:
+                return node(FLAT_NULL, expr);
+            case AST_BOOLEAN: {
+                auto index = node(FLAT_BOOL, expr);
+                nodes[index].a = static_cast<BooleanExpression *>(expr)->literal;
+                return index;
+            }
+            case AST_NUMBER: {
+                auto index = node(FLAT_CONST, expr);
+                nodes[index].a = static_cast<uint32_t>(constants.size());
+                constants.push_back(static_cast<NumberExpression *>(expr)->literal);
+                return index;
+            }
+            case AST_STRING: {
+                auto index = node(FLAT_CONST, expr);
+                nodes[index].a = static_cast<uint32_t>(constants.size());
+                constants.push_back(ValueDeclaration::fromString(static_cast<StringExpression *>(expr)->literal));
+                return index;
+            }
+            case AST_ARRAY: {
+                auto *array = static_cast<ArrayExpression *>(expr);
+                auto index = node(FLAT_ARRAY, expr);
+                std::vector<uint32_t> elements;
+                elements.reserve(array->literal.size());
+                for (auto *e: array->literal) {
+                    elements.push_back(expression(e));
+                }
+                nodes[index].a = list(elements);
+                nodes[index].b = static_cast<uint32_t>(elements.size());
+                return index;
+            }
+            case AST_IDENT: {
+                auto *ident = static_cast<IdentExpression *>(expr);
+                auto index = node(FLAT_IDENT, expr);
+                nodes[index].a = reference(ident->identName, ident->bindings);
+                return index;
+            }
+            case AST_INDEX: {
+                auto *indexExpr = static_cast<IndexExpression *>(expr);
+                auto index = node(FLAT_INDEX, expr);
+                auto ref = reference(indexExpr->identName, indexExpr->bindings);
+                auto i = expression(indexExpr->index);
+                nodes[index].a = ref;
+                nodes[index].b = i;
+                return index;
+            }
+            case AST_BINARY: {
+                auto *binary = static_cast<::BinaryExpression *>(expr);
+                auto index = node(FLAT_BINARY, expr);
+                auto lhs = binary->leftExpression != nullptr ? expression(binary->leftExpression) : none;
+                auto rhs = binary->rightExpression != nullptr ? expression(binary->rightExpression) : none;
+                nodes[index].opt = static_cast<uint8_t>(binary->opt);
+                nodes[index].a = lhs;
+                nodes[index].b = rhs;
+                nodes[index].c = static_cast<uint32_t>(specializations.size());
+                specializations.push_back(binary->specialization);
+                return index;
+            }
+            case AST_FUNCALL: {
+                auto *call = static_cast<FunCallExpression *>(expr);
+                auto index = node(FLAT_CALL, expr);
+                std::vector<uint32_t> args;
+                args.reserve(call->args.size());
+                for (auto *e: call->args) {
+                    args.push_back(expression(e));
+                }
+                nodes[index].a = static_cast<uint32_t>(calls.size());
+                calls.push_back(CallSite{call->funName, nullptr, nullptr, none, 0});
+                nodes[index].b = list(args);
+                nodes[index].c = static_cast<uint32_t>(args.size());
+                return index;
+            }
+            case AST_ASSIGN: {
+                auto *assign = static_cast<AssignExpression *>(expr);
+                auto *left = assign->leftExpression;
+                if (left->kind == AST_IDENT) {
+                    auto index = node(FLAT_ASSIGN, expr);
+                    auto ref = reference(static_cast<IdentExpression *>(left)->identName,
+                                         static_cast<IdentExpression *>(left)->bindings);
+                    auto rhs = expression(assign->rightExperssion);
+                    nodes[index].opt = static_cast<uint8_t>(assign->opt);
+                    nodes[index].a = ref;
+                    nodes[index].b = rhs;
+                    return index;
+                }
+                if (left->kind == AST_INDEX) {
+                    auto *indexExpr = static_cast<IndexExpression *>(left);
+                    auto index = node(FLAT_SETINDEX, expr);
+                    auto ref = reference(indexExpr->identName, indexExpr->bindings);
+                    auto rhs = expression(assign->rightExperssion);
+                    auto i = expression(indexExpr->index);
+                    nodes[index].opt = static_cast<uint8_t>(assign->opt);
+                    nodes[index].a = ref;
+                    nodes[index].b = rhs;
+                    nodes[index].c = i;
+                    return index;
+                }
+                panic("SyntaxError: can not assign to %s at line %d, col %d\n",
+                      typeid(left).name(), assign->start, assign->end);
+            }
+            default:
+                panic("InternalError: can not flatten expression at line %d, col %d\n", expr->start, expr->end);
+        }
+    }
+
+    uint32_t FlatTree::reference(Symbol name, const std::vector<SlotRef> &refs) {
+        references.push_back(
+                Reference{static_cast<uint32_t>(bindings.size()), static_cast<uint32_t>(refs.size()), name});
+        bindings.insert(bindings.end(), refs.begin(), refs.end());
+        return static_cast<uint32_t>(references.size() - 1);
+    }
+
+    uint32_t FlatTree::list(const std::vector<uint32_t> &children) {
+        auto offset = static_cast<uint32_t>(lists.size());
+        lists.insert(lists.end(), children.begin(), children.end());
+        return offset;
+    }
+
+}
@@ -1,24 +1,46 @@
 //
 // Created by chineseblack23 on 2024/6/22.
 //
-#include <deque>
+#include <optional>
+#include <string>
 #include <vector>
 #include "Interpreter.hpp"
 #include "AbstractSyntaxTree.hpp"
+#include "AstCache.hpp"
+#include "Builtin.hpp"
+#include "Compiler.hpp"
+#include "FlatInterpreter.hpp"
+#include "Optimizer.hpp"
+#include "Resolver.hpp"
 #include "Utils.hpp"
+#include "VirtualMachine.hpp"
 #include "apollo.hpp"
 
 
 Interpreter::Interpreter(const std::string &fileName)
-        : p(new Parser(fileName)), rt(new apollo::Runtime) {}
+        : rt(new apollo::Runtime), p(new Parser(fileName)) {
+    registerCoreLibrary(rt);
+}
+
+Interpreter::Interpreter(SourceBuffer source)
+        : rt(new apollo::Runtime), p(new Parser(std::move(source))) {
+    registerCoreLibrary(rt);
+}
+
+Interpreter::Interpreter(const std::vector<std::string> &fileNames)
+        : rt(new apollo::Runtime), p(fileNames.size() == 1 ? new Parser(fileNames.front()) : nullptr),
+          fileNames(fileNames) {
+    registerCoreLibrary(rt);
+}
 
 Interpreter::~Interpreter() {
     delete p;
+    // Releases the AST arena, and with it every node of the program
     delete rt;
 }
 
 apollo::ValueDeclaration Expression::eval(apollo::Runtime *rt,
-                                          std::deque<apollo::Context *> ctxChain) {
+                                          apollo::ContextChain &ctxChain) {
     panic(
             "RuntimeError: can not evaluate abstract expression at line %d, column "
             "%d\n",
@@ -26,7 +48,7 @@ apollo::ValueDeclaration Expression::eval(apollo::Runtime *rt,
 }
 
 apollo::ExecResult Statement::interpret(apollo::Runtime *rt,
-                                        std::deque<apollo::Context *> ctxChain) {
+                                        apollo::ContextChain &ctxChain) {
     panic(
             "RuntimeError: can not interpret abstract statement at line %d, column "
             "%d\n",
@@ -34,48 +56,236 @@ apollo::ExecResult Statement::interpret(apollo::Runtime *rt,
 }
 
 
+void Interpreter::loadUnit(Parser &parser, apollo::Runtime *unit, bool useAstCache) {
+    if (!useAstCache) {
+        parser.parse(unit);
+        return;
+    }
+    auto key = AstCache::keySource(parser.getSource().view());
+    auto path = AstCache::cachePath(key);
+    if (AstCache::load(path, key, unit)) {
+        return;
+    }
+    parser.parse(unit);
+    AstCache::store(path, key, unit);
+}
+
+void Interpreter::load() {
+    if (this->p == nullptr) {
+        loadParallel();
+        return;
+    }
+    loadUnit(*this->p, this->rt, useAstCache);
+}
+
+void Interpreter::loadParallel() {
+    // Every worker parses into a runtime of its own, so arenas, token
+    // buffers and function tables are never shared between threads
+    std::vector<std::unique_ptr<apollo::Runtime>> units(fileNames.size());
+    // A worker must not exit the process under the others, so errors are
+    // kept per unit and the first one, in file order, is reported once all
+    // threads are joined
+    std::vector<std::optional<std::string>> errors(fileNames.size());
+    parallelFor(fileNames.size(), [&](size_t i) {
+        PanicCapture capture;
+        try {
+            Parser parser(fileNames[i]);
+            units[i] = std::make_unique<apollo::Runtime>();
+            loadUnit(parser, units[i].get(), useAstCache);
+        } catch (PanicError &e) {
+            errors[i] = std::move(e.message);
+        }
+    });
+    for (auto &error: errors) {
+        if (error) {
+            panic("%s", error->c_str());
+        }
+    }
+    for (auto &unit: units) {
+        rt->absorb(*unit);
+    }
+}
+
+void Interpreter::parseCommandOption(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option.rfind("--", 0) != 0) {
+            // Source file names are taken by the constructor
+            continue;
+        }
+        if (option == "--stream") {
+            setStreaming(true);
+        } else if (option == "--no-cache") {
+            setAstCache(false);
+        } else if (option == "--no-optimize") {
+            setOptimize(false);
+        } else if (option == "--no-jit") {
+            setJit(false);
+        } else if (option == "--engine=ast") {
+            setEngine(AstEngine);
+        } else if (option == "--engine=vm") {
+            setEngine(BytecodeEngine);
+        } else if (option == "--engine=flat") {
+            setEngine(FlatEngine);
+        } else {
+            panic("ArgumentError: unknown option %s\n", option.c_str());
+        }
+    }
+}
+
 void Interpreter::execute() {
-    this->p->parse(this->rt);
-    this->ctxChain.push_back(new apollo::Context);
+    if (streaming && this->p == nullptr) {
+        panic("ArgumentError: --stream expects exactly one source file\n");
+    }
+    if (streaming) {
+        executeStreaming();
+        return;
+    }
+    load();
+    if (rt->shouldOptimize()) {
+        Optimizer(rt->getArena()).optimizeProgram(rt->getStatements());
+    }
+    Resolver resolver(rt->getGlobals());
+    for (auto stmt: rt->getStatements()) {
+        resolver.resolveStatement(stmt);
+    }
+    apollo::ContextChain ctxChain(ctxStack);
+    ctxChain.push(new apollo::Context(&rt->getGlobals()));
 
-    auto stmts = rt->getStatements();
-    for (auto stmt: stmts) {
+    // A program too large for the bytecode engine's registers is run by the
+    // tree walker instead, which needs no second copy of the tree
+    if (engine == BytecodeEngine && executeBytecode(ctxChain)) {
+        return;
+    }
+    if (engine == FlatEngine) {
+        // The flat trees keep a copy of all the program may run, so the
+        // syntax trees are freed before it starts
+        FlatInterpreter walker(rt);
+        walker.load(rt->getStatements());
+        rt->releaseSyntaxTrees();
+        walker.run(ctxChain);
+        return;
+    }
+    for (auto stmt: rt->getStatements()) {
         stmt->interpret(rt, ctxChain);
     }
 }
 
-void Interpreter::enterContext(std::deque<apollo::Context *> &ctxChain) {
-    auto *tempContext = new Context;
-    ctxChain.push_back(tempContext);
+bool Interpreter::executeBytecode(apollo::ContextChain &ctxChain) {
+    Compiler compiler(rt->getGlobals());
+    auto program = compiler.compileProgram(rt->getStatements());
+    if (program == nullptr) {
+        return false;
+    }
+    VirtualMachine vm(rt, ctxChain);
+    vm.setJit(useJit);
+    vm.run(*program);
+    vm.storeGlobals(ctxChain.front());
+    return true;
 }
 
-void Interpreter::leaveContext(std::deque<apollo::Context *> &ctxChain) {
-    auto *tempContext = ctxChain.back();
-    ctxChain.pop_back();
-    delete tempContext;
+void Interpreter::executeStreaming() {
+    // Functions live in the runtime's arena for the whole run (the flat
+    // engine copies them out first and frees it), top-level statements only
+    // until they have been executed
+    this->p->hoistFunctions(this->rt);
+    Resolver resolver(rt->getGlobals());
+    apollo::ContextChain ctxChain(ctxStack);
+    ctxChain.push(new apollo::Context(&rt->getGlobals()));
+
+    // The bytecode engine keeps the globals in registers until the end, or
+    // until a statement does not fit in them; the tree walker runs the rest
+    Compiler compiler(rt->getGlobals());
+    VirtualMachine vm(rt, ctxChain);
+    vm.setJit(useJit);
+    FlatInterpreter walker(rt);
+    if (engine == FlatEngine) {
+        walker.flattenFunctions();
+        rt->releaseSyntaxTrees();
+    }
+    bool bytecode = engine == BytecodeEngine;
+    apollo::AstArena scratch;
+    Optimizer optimizer(scratch);
+    std::vector<Statement *> stmts;
+    while (auto *parsed = this->p->parseNextStatement(scratch)) {
+        // Optimizing may drop the statement
+        stmts.assign(1, parsed);
+        if (rt->shouldOptimize()) {
+            optimizer.optimizeProgram(stmts);
+        }
+        for (auto *stmt: stmts) {
+            resolver.resolveStatement(stmt);
+            if (bytecode) {
+                if (auto code = compiler.compileStatement(stmt); code != nullptr) {
+                    vm.run(*code);
+                    continue;
+                }
+                vm.storeGlobals(ctxChain.front());
+                bytecode = false;
+            }
+            if (engine == FlatEngine) {
+                ctxChain.front()->growSlots();
+                walker.load({stmt});
+                walker.run(ctxChain);
+            } else {
+                ctxChain.front()->growSlots();
+                stmt->interpret(rt, ctxChain);
+            }
+        }
+        scratch.reset();
+    }
+    if (bytecode) {
+        vm.storeGlobals(ctxChain.front());
+    }
 }
 
 apollo::ValueDeclaration Interpreter::callFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f,
-                                                   std::deque<apollo::Context *> previousCtxChain,
-                                                   std::vector<Expression *> args) {
-    std::deque<apollo::Context *> funcCtxChain;
-    Interpreter::enterContext(funcCtxChain);
-
-    auto *funcCtx = funcCtxChain.back();
-    for (int i = 0; i < f->params.size(); i++) {
-        std::string paramName = f->params[i];
+                                                   apollo::ContextChain &previousCtxChain,
+                                                   const std::vector<Expression *> &args) {
+    if (!f->resolved) {
+        Resolver::resolveFunction(rt, f);
+    }
+    // Arguments are evaluated in the caller's chain before the frame is
+    // pushed, the new chain then starts right above the caller's contexts
+    auto *funcCtx = previousCtxChain.getStack().acquire(&f->getBody()->locals);
+    for (size_t i = 0; i < f->params.size(); i++) {
         apollo::ValueDeclaration argValueDeclaration = args[i]->eval(rt, previousCtxChain);
-        funcCtx->createVariable(f->params[i], argValueDeclaration);
+        // A repeated parameter name keeps the first argument
+        if (funcCtx->getVariable(f->paramSlots[i]) == nullptr) {
+            funcCtx->createVariable(f->paramSlots[i], argValueDeclaration);
+        }
     }
+    return runFunction(rt, f, previousCtxChain, funcCtx);
+}
+
+apollo::ValueDeclaration Interpreter::callFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f,
+                                                   apollo::ContextChain &previousCtxChain,
+                                                   std::span<apollo::ValueDeclaration> args) {
+    if (!f->resolved) {
+        Resolver::resolveFunction(rt, f);
+    }
+    auto *funcCtx = previousCtxChain.getStack().acquire(&f->getBody()->locals);
+    for (size_t i = 0; i < args.size(); i++) {
+        if (funcCtx->getVariable(f->paramSlots[i]) == nullptr) {
+            funcCtx->createVariable(f->paramSlots[i], std::move(args[i]));
+        }
+    }
+    return runFunction(rt, f, previousCtxChain, funcCtx);
+}
+
+apollo::ValueDeclaration Interpreter::runFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f,
+                                                  apollo::ContextChain &previousCtxChain, apollo::Context *funcCtx) {
+    auto funcCtxChain = previousCtxChain.openFrame();
+    funcCtxChain.push(funcCtx);
 
     apollo::ExecResult ret(apollo::ExecNormal);
-    for (auto &stmt: f->body->stmts) {
+    for (auto &stmt: f->getBody()->stmts) {
         ret = stmt->interpret(rt, funcCtxChain);
         if (ret.execType == apollo::ExecReturn) {
             break;
         }
     }
-    Interpreter::leaveContext(funcCtxChain);
+    funcCtxChain.leave();
 
     return ret.retValue;
 }
@@ -85,8 +295,14 @@ apollo::ValueDeclaration Interpreter::calcUnaryExpr(apollo::ValueDeclaration &lh
     switch (opt) {
         case TK_MINUS:
             switch (lhs.type) {
+                case apollo::Integer:
+                    // -INT64_MIN does not fit, it becomes a double
+                    if (lhs.asInteger() != INT64_MIN) {
+                        return apollo::ValueDeclaration::fromInteger(-lhs.asInteger());
+                    }
+                    return apollo::ValueDeclaration::fromNumber(-lhs.toDouble());
                 case apollo::Number:
-                    return apollo::ValueDeclaration(apollo::Number, -std::any_cast<int>(lhs.data));
+                    return apollo::ValueDeclaration::fromNumber(-lhs.asNumber());
                 default:
                     panic(
                             "TypeError: invalid operand type for operator "
@@ -96,7 +312,7 @@ apollo::ValueDeclaration Interpreter::calcUnaryExpr(apollo::ValueDeclaration &lh
             break;
         case TK_LOGNOT:
             if (lhs.type == apollo::Boolean) {
-                return apollo::ValueDeclaration(apollo::Boolean, !std::any_cast<bool>(lhs.data));
+                return apollo::ValueDeclaration::fromBool(!lhs.asBool());
             } else {
                 panic(
                         "TypeError: invalid operand type for operator "
@@ -105,8 +321,8 @@ apollo::ValueDeclaration Interpreter::calcUnaryExpr(apollo::ValueDeclaration &lh
             }
             break;
         case TK_BITNOT:
-            if (lhs.type == apollo::Number) {
-                return apollo::ValueDeclaration(apollo::Number, ~std::any_cast<int>(lhs.data));
+            if (lhs.type == apollo::Integer) {
+                return apollo::ValueDeclaration::fromInteger(~lhs.asInteger());
             } else {
                 panic(
                         "TypeError: invalid operand type for operator "
@@ -119,8 +335,7 @@ apollo::ValueDeclaration Interpreter::calcUnaryExpr(apollo::ValueDeclaration &lh
     return lhs;
 }
 
-apollo::ValueDeclaration Interpreter::calcBinaryExpr(apollo::ValueDeclaration lhs, Token opt, ValueDeclaration rhs,
-                                                     int line, int column) {
+apollo::ValueDeclaration Interpreter::calcBinaryExpr(apollo::ValueDeclaration lhs, Token opt, ValueDeclaration rhs) {
     apollo::ValueDeclaration result{apollo::Null};
 
     switch (opt) {
@@ -180,6 +395,15 @@ apollo::ValueDeclaration Interpreter::assignSwitch(Token opt, apollo::ValueDecla
         case TK_ASSIGN:
             return rhs;
         case TK_PLUS_AGN:
+            // A string the variable alone holds is extended in place
+            if (lhs.isType<apollo::String>()) {
+                if (rhs.isType<apollo::String>()) {
+                    lhs.appendString(rhs.asString());
+                } else {
+                    lhs.appendString(valueToStdString(rhs));
+                }
+                return lhs;
+            }
             return lhs + rhs;
         case TK_MINUS_AGN:
             return lhs - rhs;
@@ -195,7 +419,7 @@ apollo::ValueDeclaration Interpreter::assignSwitch(Token opt, apollo::ValueDecla
 }
 
 apollo::ExecResult IfStmt::interpret(apollo::Runtime *rt,
-                                     std::deque<apollo::Context *> ctxChain) {
+                                     apollo::ContextChain &ctxChain) {
     apollo::ExecResult ret(apollo::ExecNormal);
     ValueDeclaration cond = this->cond->eval(rt, ctxChain);
     if (!cond.isType<apollo::Boolean>()) {
@@ -204,8 +428,8 @@ apollo::ExecResult IfStmt::interpret(apollo::Runtime *rt,
                 "col %d\n",
                 start, end);
     }
-    if (cond.castingType<bool>()) {
-        Interpreter::enterContext(ctxChain);
+    if (cond.asBool()) {
+        Interpreter::enterContext(ctxChain, blockStatement);
         for (auto &stmt: blockStatement->stmts) {
             ret = stmt->interpret(rt, ctxChain);
             if (ret.execType == apollo::ExecReturn) {
@@ -216,10 +440,10 @@ apollo::ExecResult IfStmt::interpret(apollo::Runtime *rt,
                 break;
             }
         }
-        Interpreter::leaveContext(ctxChain);
+        Interpreter::leaveContext(ctxChain, blockStatement);
     } else {
         if (elseBlock != nullptr) {
-            Interpreter::enterContext(ctxChain);
+            Interpreter::enterContext(ctxChain, elseBlock);
             for (auto &elseStmt: elseBlock->stmts) {
                 ret = elseStmt->interpret(rt, ctxChain);
                 if (ret.execType == apollo::ExecReturn) {
@@ -230,19 +454,25 @@ apollo::ExecResult IfStmt::interpret(apollo::Runtime *rt,
                     break;
                 }
             }
-            Interpreter::leaveContext(ctxChain);
+            Interpreter::leaveContext(ctxChain, elseBlock);
         }
     }
     return ret;
 }
 
 apollo::ExecResult WhileStmt::interpret(apollo::Runtime *rt,
-                                        std::deque<apollo::Context *> ctxChain) {
+                                        apollo::ContextChain &ctxChain) {
     apollo::ExecResult ret;
     ValueDeclaration cond = this->cond->eval(rt, ctxChain);
+    if (!cond.isType<apollo::Boolean>()) {
+        panic(
+                "TypeError: expects bool type in while condition at line %d, "
+                "col %d\n",
+                start, end);
+    }
 
-    Interpreter::enterContext(ctxChain);
-    while (cond.castingType<bool>()) {
+    Interpreter::enterContext(ctxChain, blockStatement);
+    while (cond.asBool()) {
         for (auto &stmt: blockStatement->stmts) {
 
             ret = stmt->interpret(rt, ctxChain);
@@ -268,146 +498,154 @@ apollo::ExecResult WhileStmt::interpret(apollo::Runtime *rt,
     }
 
     outside:
-    Interpreter::leaveContext(ctxChain);
+    Interpreter::leaveContext(ctxChain, blockStatement);
     return ret;
 }
 
 apollo::ExecResult ExpressionStmt::interpret(apollo::Runtime *rt,
-                                             std::deque<apollo::Context *> ctxChain) {
+                                             apollo::ContextChain &ctxChain) {
 
     this->expression->eval(rt, ctxChain);
     return apollo::ExecResult(apollo::ExecNormal);
 }
 
 apollo::ExecResult ReturnStmt::interpret(apollo::Runtime *rt,
-                                         std::deque<apollo::Context *> ctxChain) {
-    ValueDeclaration retVal = this->expression->eval(rt, ctxChain);
+                                         apollo::ContextChain &ctxChain) {
+    // A bare return yields null, as in the compiled engines
+    ValueDeclaration retVal =
+            this->expression ? this->expression->eval(rt, ctxChain) : apollo::ValueDeclaration(apollo::Null);
     return apollo::ExecResult(apollo::ExecReturn, retVal);
 }
 
 apollo::ExecResult BreakStmt::interpret(apollo::Runtime *rt,
-                                        std::deque<apollo::Context *> ctxChain) {
+                                        apollo::ContextChain &ctxChain) {
     return apollo::ExecResult(apollo::ExecBreak);
 }
 
 apollo::ExecResult ContinueStmt::interpret(apollo::Runtime *rt,
-                                           std::deque<apollo::Context *> ctxChain) {
+                                           apollo::ContextChain &ctxChain) {
     return apollo::ExecResult(apollo::ExecContinue);
 }
 
 apollo::ValueDeclaration NullExpression::eval(apollo::Runtime *rt,
-                                              std::deque<apollo::Context *> ctxChain) {
+                                              apollo::ContextChain &ctxChain) {
     return apollo::ValueDeclaration(apollo::Null);
 }
 
 apollo::ValueDeclaration BooleanExpression::eval(apollo::Runtime *rt,
-                                                 std::deque<apollo::Context *> ctxChain) {
-    return apollo::ValueDeclaration(apollo::Boolean, this->literal);
+                                                 apollo::ContextChain &ctxChain) {
+    return apollo::ValueDeclaration::fromBool(this->literal);
 }
 
 
-apollo::ValueDeclaration NumberExpression::eval(apollo::Runtime *rt, std::deque<apollo::Context *> ctxChain) {
-    return apollo::ValueDeclaration(apollo::Number, this->literal);
+apollo::ValueDeclaration NumberExpression::eval(apollo::Runtime *rt, apollo::ContextChain &ctxChain) {
+    return this->literal;
 }
 
 
 apollo::ValueDeclaration StringExpression::eval(apollo::Runtime *rt,
-                                                std::deque<apollo::Context *> ctxChain) {
-    return apollo::ValueDeclaration(apollo::String, this->literal);
+                                                apollo::ContextChain &ctxChain) {
+    if (!this->value.isType<apollo::String>()) {
+        this->value = apollo::ValueDeclaration::fromString(this->literal);
+    }
+    return this->value;
 }
 
 apollo::ValueDeclaration ArrayExpression::eval(apollo::Runtime *rt,
-                                               std::deque<apollo::Context *> ctxChain) {
+                                               apollo::ContextChain &ctxChain) {
     std::vector<apollo::ValueDeclaration> elements;
+    elements.reserve(this->literal.size());
     for (auto &e: this->literal) {
         elements.push_back(e->eval(rt, ctxChain));
     }
 
-    return apollo::ValueDeclaration(apollo::Array, elements);
+    return apollo::ValueDeclaration::fromArray(std::move(elements));
 }
 
 apollo::ValueDeclaration IdentExpression::eval(apollo::Runtime *rt,
-                                               std::deque<apollo::Context *> ctxChain) {
-    for (auto p = ctxChain.crbegin(); p != ctxChain.crend(); ++p) {
-        auto *ctx = *p;
-        if (auto *var = ctx->getVariable(this->identName); var != nullptr) {
-            return *var;
-        }
+                                               apollo::ContextChain &ctxChain) {
+    if (auto *var = Interpreter::findVariable(ctxChain, bindings); var != nullptr) {
+        return *var;
     }
     panic("RuntimeError: use of undefined variable \"%s\" at line %d, col %d\n",
           identName.c_str(), this->start, this->end);
 }
 
 apollo::ValueDeclaration IndexExpression::eval(apollo::Runtime *rt,
-                                               std::deque<apollo::Context *> ctxChain) {
-    for (auto p = ctxChain.crbegin(); p != ctxChain.crend(); ++p) {
-        auto *ctx = *p;
-        if (auto *var = ctx->getVariable(this->identName); var != nullptr) {
-            auto idx = this->index->eval(rt, ctxChain);
-            if (!idx.isType<apollo::Number>()) {
-                panic(
-                        "TypeError: expects int type within indexing expression at "
-                        "line %d, col %d\n",
-                        start, end);
-            }
-            if (idx.castingType<int>() >=
-                var->castingType<std::vector<apollo::ValueDeclaration>>().size()) {
-                panic("IndexError: index %d out of range at line %d, col %d\n",
-                      idx.castingType<int>(), start, end);
-            }
-            return var->castingType<std::vector<apollo::ValueDeclaration>>()[idx.castingType<int>()];
+                                               apollo::ContextChain &ctxChain) {
+    if (auto *var = Interpreter::findVariable(ctxChain, bindings); var != nullptr) {
+        auto idx = this->index->eval(rt, ctxChain);
+        if (!idx.isNumber()) {
+            panic(
+                    "TypeError: expects int type within indexing expression at "
+                    "line %d, col %d\n",
+                    start, end);
         }
+        if (!var->isType<apollo::Array>()) {
+            panic(
+                    "TypeError: expects array type of variable %s "
+                    "at line %d, col %d\n",
+                    identName.c_str(), start, end);
+        }
+        auto &elements = var->asArray();
+        if (idx.toDouble() < 0 || idx.toDouble() >= static_cast<double>(elements.size())) {
+            panic("IndexError: index %d out of range at line %d, col %d\n",
+                  static_cast<int>(idx.toDouble()), start, end);
+        }
+        return elements[static_cast<size_t>(idx.toDouble())];
     }
     panic("RuntimeError: use of undefined variable \"%s\" at line %d, col %d\n",
           identName.c_str(), this->start, this->end);
 }
 
 apollo::ValueDeclaration AssignExpression::eval(apollo::Runtime *rt,
-                                                std::deque<apollo::Context *> ctxChain) {
+                                                apollo::ContextChain &ctxChain) {
     apollo::ValueDeclaration rhs = this->rightExperssion->eval(rt, ctxChain);
 
-    if (typeid(*leftExpression) == typeid(IdentExpression)) {
-        std::string identName = dynamic_cast<IdentExpression *>(leftExpression)->identName;
-
-        for (auto p = ctxChain.crbegin(); p != ctxChain.crend(); ++p) {
-            if (auto *var = (*p)->getVariable(identName); var != nullptr) {
-
-                apollo::ValueDeclaration _var = *var;
-//                var =
-//                        Interpreter::assignSwitch(this->opt,_var, rhs);
-                _var = Interpreter::assignSwitch(this->opt, _var, rhs);
+    // A name that is not defined yet goes to the innermost scope assigning
+    // it, which the Resolver always lists first
+    if (leftExpression->kind == AST_IDENT) {
+        auto *ident = static_cast<IdentExpression *>(leftExpression);
+        if (auto *var = Interpreter::findVariable(ctxChain, ident->bindings); var != nullptr) {
+            // arr += x appends in place instead of building arr + x; a string
+            // on the right keeps the meaning of arr + x, so it takes the switch
+            if (this->opt == TK_PLUS_AGN && var->isType<apollo::Array>() && !rhs.isType<apollo::String>()) {
+                var->mutableArray().push_back(rhs);
                 return rhs;
             }
+            *var = Interpreter::assignSwitch(this->opt, std::move(*var), rhs);
+            return rhs;
         }
-
-        (ctxChain.back())->createVariable(identName, rhs);
-    } else if (typeid(*leftExpression) == typeid(IndexExpression)) {
-        std::string identName = dynamic_cast<IndexExpression *>(leftExpression)->identName;
-        apollo::ValueDeclaration index =
-                dynamic_cast<IndexExpression *>(leftExpression)->index->eval(rt, ctxChain);
-        if (!index.isType<apollo::Number>()) {
+        auto &decl = ident->bindings.front();
+        ctxChain[decl.depth]->createVariable(decl.slot, rhs);
+    } else if (leftExpression->kind == AST_INDEX) {
+        auto *indexExpr = static_cast<IndexExpression *>(leftExpression);
+        apollo::ValueDeclaration index = indexExpr->index->eval(rt, ctxChain);
+        if (!index.isNumber()) {
             panic(
                     "TypeError: expects int type when applying indexing "
                     "to variable %s at line %d, col %d\n",
-                    identName.c_str(), start, end);
+                    indexExpr->identName.c_str(), start, end);
         }
-        for (auto p = ctxChain.crbegin(); p != ctxChain.crend(); ++p) {
-            if (auto *var = (*p)->getVariable(identName); var != nullptr) {
-                if (!var->isType<apollo::Array>()) {
-                    panic(
-                            "TypeError: expects array type of variable %s "
-                            "at line %d, col %d\n",
-                            identName.c_str(), start, end);
-                }
-                auto &&temp = var->castingType<std::vector<apollo::ValueDeclaration>>();
-                temp[index.castingType<int>()] = Interpreter::assignSwitch(
-                        this->opt, temp[index.castingType<int>()], rhs);
-                var->data = std::move(temp);
-                return rhs;
+        if (auto *var = Interpreter::findVariable(ctxChain, indexExpr->bindings); var != nullptr) {
+            if (!var->isType<apollo::Array>()) {
+                panic(
+                        "TypeError: expects array type of variable %s "
+                        "at line %d, col %d\n",
+                        indexExpr->identName.c_str(), start, end);
             }
+            if (index.toDouble() < 0 || index.toDouble() >= static_cast<double>(var->asArray().size())) {
+                panic("IndexError: index %d out of range at line %d, col %d\n",
+                      static_cast<int>(index.toDouble()), start, end);
+            }
+            // Written in place unless another value shares the elements
+            auto &elements = var->mutableArray();
+            auto i = static_cast<size_t>(index.toDouble());
+            elements[i] = Interpreter::assignSwitch(this->opt, std::move(elements[i]), rhs);
+            return rhs;
         }
-
-        (ctxChain.back())->createVariable(identName, rhs);
+        auto &decl = indexExpr->bindings.front();
+        ctxChain[decl.depth]->createVariable(decl.slot, rhs);
     } else {
         panic("SyntaxError: can not assign to %s at line %d, col %d\n",
               typeid(leftExpression).name(), start, end);
@@ -415,44 +653,117 @@ apollo::ValueDeclaration AssignExpression::eval(apollo::Runtime *rt,
     return rhs;
 }
 
+void FunCallExpression::bindTarget(apollo::Runtime *rt) {
+    lookup(rt, this->funName, this->args.size(), cachedBuiltin, cachedFunction);
+    cachedEpoch = rt->getFunctionEpoch();
+}
+
+void FunCallExpression::lookup(apollo::Runtime *rt, apollo::Symbol name, size_t argc,
+                               apollo::Runtime::BuiltinFuncType &builtin, apollo::FunctionDeclaration *&function) {
+    // User defined functions come first, so a script that defines a function
+    // later added to the library keeps calling its own
+    function = rt->getFunctionDeclaration(name);
+    builtin = function == nullptr ? rt->getBuiltinFunctionDeclaration(name) : nullptr;
+    if (builtin == nullptr && function == nullptr) {
+        panic(
+                "RuntimeError: can not find function definition of %s in both "
+                "built-in "
+                "functions and user defined functions",
+                name.c_str());
+    }
+    if (function != nullptr && function->params.size() != argc) {
+        panic("ArgumentError: expects %d arguments but got %d",
+              function->params.size(), argc);
+    }
+}
+
 apollo::ValueDeclaration FunCallExpression::eval(apollo::Runtime *rt,
-                                                 std::deque<apollo::Context *> ctxChain) {
-    if (auto *builtinFunc = rt->getBuiltinFunctionDeclaration(this->funName);
-            builtinFunc != nullptr) {
-        std::vector<ValueDeclaration> arguments;
-        for (auto e: this->args) {
-            arguments.push_back(e->eval(rt, ctxChain));
-        }
-        return builtinFunc(rt, ctxChain, arguments);
+                                                 apollo::ContextChain &ctxChain) {
+    if (cachedEpoch != rt->getFunctionEpoch()) {
+        bindTarget(rt);
     }
-    if (auto *func = rt->getFunctionDeclaration(this->funName); func != nullptr) {
-        if (func->params.size() != this->args.size()) {
-            panic("ArgumentError: expects %d arguments but got %d",
-                  func->params.size(), this->args.size());
+    if (cachedBuiltin != nullptr) {
+        // Nested calls in the arguments push above us and pop before returning
+        auto &argStack = rt->getArgumentStack();
+        size_t base = argStack.size();
+        for (auto e: this->args) {
+            argStack.push_back(e->eval(rt, ctxChain));
         }
-        return Interpreter::callFunction(rt, func, ctxChain, this->args);
+        auto result = cachedBuiltin(rt, ctxChain, std::span(argStack.data() + base, this->args.size()));
+        argStack.erase(argStack.begin() + static_cast<std::ptrdiff_t>(base), argStack.end());
+        return result;
     }
-
-    panic(
-            "RuntimeError: can not find function definition of %s in both "
-            "built-in "
-            "functions and user defined functions",
-            this->funName.c_str());
+    return Interpreter::callFunction(rt, cachedFunction, ctxChain, this->args);
 }
 
 apollo::ValueDeclaration BinaryExpression::eval(apollo::Runtime *rt,
-                                                std::deque<apollo::Context *> ctxChain) {
+                                                apollo::ContextChain &ctxChain) {
     apollo::ValueDeclaration lhs =
             this->leftExpression ? this->leftExpression->eval(rt, ctxChain) : apollo::ValueDeclaration(apollo::Null);
     apollo::ValueDeclaration rhs =
             this->rightExpression ? this->rightExpression->eval(rt, ctxChain) : apollo::ValueDeclaration(apollo::Null);
-    Token opt = this->opt;
+    return Interpreter::evalSpecialized(specialization, opt, lhs, rhs, start, end);
+}
 
-    if (!lhs.isType<apollo::Null>() && rhs.isType<apollo::Null>()) {
-        return Interpreter::calcUnaryExpr(lhs, opt, start, end);
+BinaryExpression::Specialization BinaryExpression::specialize(Token opt, const apollo::ValueDeclaration &lhs,
+                                                              const apollo::ValueDeclaration &rhs) {
+    if (lhs.type == apollo::Integer && rhs.type == apollo::Integer) {
+        switch (opt) {
+            case TK_PLUS: return IntAdd;
+            case TK_MINUS: return IntSub;
+            case TK_TIMES: return IntMul;
+            case TK_DIV: return IntDiv;
+            case TK_MOD: return IntMod;
+            case TK_EQ: return IntEq;
+            case TK_NE: return IntNe;
+            case TK_LT: return IntLt;
+            case TK_LE: return IntLe;
+            case TK_GT: return IntGt;
+            case TK_GE: return IntGe;
+            case TK_BITAND: return IntBitAnd;
+            case TK_BITOR: return IntBitOr;
+            default: return Generic;
+        }
     }
-
-    return Interpreter::calcBinaryExpr(lhs, opt, rhs, start, end);
+    // A double on either side; two integers are not covered, their
+    // arithmetic stays exact
+    if (lhs.isNumber() && rhs.isNumber()) {
+        switch (opt) {
+            case TK_PLUS: return NumAdd;
+            case TK_MINUS: return NumSub;
+            case TK_TIMES: return NumMul;
+            case TK_DIV: return NumDiv;
+            case TK_EQ: return NumEq;
+            case TK_NE: return NumNe;
+            case TK_LT: return NumLt;
+            case TK_LE: return NumLe;
+            case TK_GT: return NumGt;
+            case TK_GE: return NumGe;
+            default: return Generic;
+        }
+    }
+    if (lhs.type == apollo::String && rhs.type == apollo::String) {
+        switch (opt) {
+            case TK_PLUS: return StrAdd;
+            case TK_EQ: return StrEq;
+            case TK_NE: return StrNe;
+            case TK_LT: return StrLt;
+            case TK_LE: return StrLe;
+            case TK_GT: return StrGt;
+            case TK_GE: return StrGe;
+            default: return Generic;
+        }
+    }
+    if (lhs.type == apollo::Boolean && rhs.type == apollo::Boolean) {
+        switch (opt) {
+            case TK_LOGAND: return BoolAnd;
+            case TK_LOGOR: return BoolOr;
+            case TK_EQ: return BoolEq;
+            case TK_NE: return BoolNe;
+            default: return Generic;
+        }
+    }
+    return Generic;
 }
 
 
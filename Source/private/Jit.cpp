@@ -0,0 +1,829 @@
+//
+// Created by chineseblack23 on 2024/7/2.
+//
+#include <optional>
+#include "Jit.hpp"
+#include "Bytecode.hpp"
+#include "Interpreter.hpp"
+#include "VirtualMachine.hpp"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+using apollo::Instruction;
+using apollo::ValueDeclaration;
+
+namespace {
+    // Slow paths, called from machine code with plain arguments
+
+    void copyValue(ValueDeclaration *dst, const ValueDeclaration *src) {
+        *dst = *src;
+    }
+
+    void takeValue(ValueDeclaration *dst, ValueDeclaration *src) {
+        *dst = std::move(*src);
+    }
+
+    void loadNull(ValueDeclaration *dst) {
+        *dst = ValueDeclaration(apollo::Null);
+    }
+
+    void loadBool(ValueDeclaration *dst, uint64_t value) {
+        *dst = ValueDeclaration::fromBool(value != 0);
+    }
+
+    void clear(ValueDeclaration *dst, uint64_t count) {
+        for (uint64_t i = 0; i < count; i++) {
+            dst[i] = ValueDeclaration(apollo::Undefined);
+        }
+    }
+
+    void binary(ValueDeclaration *dst, const ValueDeclaration *lhs, const ValueDeclaration *rhs, uint64_t opt,
+                AbstractSyntaxTreeNode *origin) {
+        *dst = Interpreter::evalBinary(*lhs, static_cast<Token>(opt), *rhs, origin->start, origin->end);
+    }
+
+    void unary(ValueDeclaration *dst, const ValueDeclaration *operand, uint64_t opt, AbstractSyntaxTreeNode *origin) {
+        *dst = Interpreter::evalBinary(*operand, static_cast<Token>(opt), ValueDeclaration(apollo::Null),
+                                       origin->start, origin->end);
+    }
+
+    void assignTo(ValueDeclaration *var, const ValueDeclaration *rhs, uint64_t opt) {
+        // Copied first, it may be the variable itself
+        VirtualMachine::assignTo(*var, *rhs, static_cast<Token>(opt));
+    }
+
+    void getIndex(ValueDeclaration *dst, const ValueDeclaration *var, const ValueDeclaration *idx,
+                  AbstractSyntaxTreeNode *origin) {
+        *dst = VirtualMachine::getIndex(*var, *idx, static_cast<IndexExpression *>(origin));
+    }
+
+    void setIndex(ValueDeclaration *var, const ValueDeclaration *idx, const ValueDeclaration *rhs, uint64_t opt,
+                  AbstractSyntaxTreeNode *origin) {
+        VirtualMachine::setIndex(*var, *idx, *rhs, static_cast<Token>(opt), static_cast<AssignExpression *>(origin));
+    }
+
+    void newArray(ValueDeclaration *dst, ValueDeclaration *first, uint64_t count) {
+        std::vector<ValueDeclaration> elements;
+        elements.reserve(count);
+        for (uint64_t i = 0; i < count; i++) {
+            elements.push_back(std::move(first[i]));
+        }
+        *dst = ValueDeclaration::fromArray(std::move(elements));
+    }
+
+    void bindCall(FunCallExpression *site, apollo::Runtime *rt) {
+        if (site->cachedEpoch != rt->getFunctionEpoch()) {
+            site->bindTarget(rt);
+        }
+    }
+
+    enum Reg : uint8_t {
+        RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RSI = 6, RDI = 7, R8 = 8, R12 = 12
+    };
+
+    enum Cond : uint8_t {
+        CC_O = 0x0, CC_B = 0x2, CC_AE = 0x3, CC_E = 0x4, CC_NE = 0x5, CC_A = 0x7,
+        CC_P = 0xa, CC_NP = 0xb, CC_L = 0xc, CC_GE = 0xd, CC_LE = 0xe, CC_G = 0xf
+    };
+
+    // base + disp, always encoded with a 32-bit displacement
+    struct Mem {
+        Reg base;
+        int32_t disp;
+
+        inline Mem at(int32_t offset) const { return Mem{base, disp + offset}; }
+    };
+
+    // The few x86-64 instructions the templates are made of
+    class Assembler {
+    public:
+        std::vector<uint8_t> bytes;
+
+        inline size_t size() const { return bytes.size(); }
+
+        void byte(uint8_t b) { bytes.push_back(b); }
+
+        void dword(uint32_t d) {
+            for (int i = 0; i < 4; i++) {
+                byte(static_cast<uint8_t>(d >> (8 * i)));
+            }
+        }
+
+        void qword(uint64_t q) {
+            dword(static_cast<uint32_t>(q));
+            dword(static_cast<uint32_t>(q >> 32));
+        }
+
+        void rex(bool w, unsigned reg, unsigned base) {
+            uint8_t prefix = 0x40 | (w ? 8 : 0) | ((reg >> 3) & 1) << 2 | ((base >> 3) & 1);
+            if (prefix != 0x40) {
+                byte(prefix);
+            }
+        }
+
+        void modrm(unsigned reg, Mem m) {
+            byte(0x80 | (reg & 7) << 3 | (m.base & 7));
+            if ((m.base & 7) == RSP) {
+                byte(0x24);
+            }
+            dword(static_cast<uint32_t>(m.disp));
+        }
+
+        // <op> reg, [m] (or [m], reg) on 64-bit operands
+        void op64(uint8_t op, unsigned reg, Mem m) {
+            rex(true, reg, m.base);
+            byte(op);
+            modrm(reg, m);
+        }
+
+        void load(Reg r, Mem m) { op64(0x8b, r, m); }
+
+        void store(Mem m, Reg r) { op64(0x89, r, m); }
+
+        void lea(Reg r, Mem m) { op64(0x8d, r, m); }
+
+        void imul(Reg r, Mem m) {
+            rex(true, r, m.base);
+            byte(0x0f);
+            byte(0xaf);
+            modrm(r, m);
+        }
+
+        // mov qword [m], imm32 sign-extended
+        void storeImm(Mem m, int32_t imm) {
+            rex(true, 0, m.base);
+            byte(0xc7);
+            modrm(0, m);
+            dword(static_cast<uint32_t>(imm));
+        }
+
+        void cmpByte(Mem m, uint8_t imm) {
+            rex(false, 0, m.base);
+            byte(0x80);
+            modrm(7, m);
+            byte(imm);
+        }
+
+        void movImm(Reg r, uint64_t imm) {
+            rex(true, 0, r);
+            byte(0xb8 + (r & 7));
+            qword(imm);
+        }
+
+        // SSE2 <op> xmm, [m] with a mandatory prefix
+        void sse(uint8_t prefix, uint8_t op, unsigned xmm, Mem m) {
+            if (prefix != 0) {
+                byte(prefix);
+            }
+            rex(false, xmm, m.base);
+            byte(0x0f);
+            byte(op);
+            modrm(xmm, m);
+        }
+
+        void setcc(Cond cc, Reg r) {
+            byte(0x0f);
+            byte(0x90 + cc);
+            byte(0xc0 + r);
+        }
+
+        // A jump whose target is patched later; returns where
+        size_t jcc(Cond cc) {
+            byte(0x0f);
+            byte(0x80 + cc);
+            dword(0);
+            return size() - 4;
+        }
+
+        size_t jmp() {
+            byte(0xe9);
+            dword(0);
+            return size() - 4;
+        }
+
+        void patch(size_t at, size_t target) {
+            auto rel = static_cast<int32_t>(target - (at + 4));
+            for (int i = 0; i < 4; i++) {
+                bytes[at + i] = static_cast<uint8_t>(static_cast<uint32_t>(rel) >> (8 * i));
+            }
+        }
+
+        void call(const void *fn) {
+            movImm(RAX, reinterpret_cast<uint64_t>(fn));
+            byte(0xff);
+            byte(0xd0);
+        }
+    };
+}
+
+/**
+ * Emits the machine code of one Bytecode. R is kept in rbx and K in r12;
+ * the entry stub saves them, and the exit stub returns the index of the
+ * instruction the interpreter goes on with.
+ */
+class Jit::Emitter {
+public:
+    Emitter(const apollo::Bytecode &code, apollo::Runtime *rt) : code(code), rt(rt) {}
+
+    void emit() {
+        // push rbx; push r12; sub rsp, 8, keeping calls aligned
+        for (uint8_t b: {0x53, 0x41, 0x54, 0x48, 0x83, 0xec, 0x08}) {
+            as.byte(b);
+        }
+        // mov rbx, rdi; mov r12, rsi; jmp rdx
+        for (uint8_t b: {0x48, 0x89, 0xfb, 0x49, 0x89, 0xf4, 0xff, 0xe2}) {
+            as.byte(b);
+        }
+        exitStub = as.size();
+        // add rsp, 8; pop r12; pop rbx; ret
+        for (uint8_t b: {0x48, 0x83, 0xc4, 0x08, 0x41, 0x5c, 0x5b, 0xc3}) {
+            as.byte(b);
+        }
+
+        for (uint32_t i = 0; i < code.code.size(); i++) {
+            offsets.push_back(static_cast<uint32_t>(as.size()));
+            instruction(i, code.code[i]);
+        }
+        for (auto &[at, target]: jumps) {
+            as.patch(at, offsets[target]);
+        }
+    }
+
+    Assembler as;
+    std::vector<uint32_t> offsets;
+
+private:
+    // A register or a constant operand; a constant's type is known here
+    struct Operand {
+        Mem m;
+        int known;
+    };
+
+    static inline Mem reg(uint32_t x) { return Mem{RBX, static_cast<int32_t>(x * sizeof(ValueDeclaration))}; }
+
+    inline Operand r(uint32_t x) const { return Operand{reg(x), -1}; }
+
+    inline Operand k(uint32_t x) const {
+        return Operand{Mem{R12, static_cast<int32_t>(x * sizeof(ValueDeclaration))}, code.constants[x].type};
+    }
+
+    static inline Mem payload(Mem m) { return m.at(8); }
+
+    void bindAll(std::vector<size_t> &at) {
+        for (auto pos: at) {
+            as.patch(pos, as.size());
+        }
+        at.clear();
+    }
+
+    // Jumps to fail unless the operand has the type
+    void guard(const Operand &x, apollo::ValueType type, std::vector<size_t> &fail) {
+        if (x.known == -1) {
+            as.cmpByte(x.m, type);
+            fail.push_back(as.jcc(CC_NE));
+        }
+    }
+
+    // A destination that owns a heap object has to release it, which
+    // the slow path does
+    void writable(uint32_t dst, std::vector<size_t> &fail) {
+        as.cmpByte(reg(dst).at(1), ValueDeclaration::onHeap);
+        fail.push_back(as.jcc(CC_E));
+    }
+
+    void exitTo(uint32_t index) {
+        // mov eax, index; jmp exit
+        as.byte(0xb8);
+        as.dword(index);
+        as.patch(as.jmp(), exitStub);
+    }
+
+    void jumpTo(uint32_t target, std::optional<Cond> cc = std::nullopt) {
+        jumps.emplace_back(cc ? as.jcc(*cc) : as.jmp(), target);
+    }
+
+    // Loads argument registers with the addresses of values
+    void args(std::initializer_list<std::pair<Reg, Mem>> addresses) {
+        for (auto &[arg, m]: addresses) {
+            as.lea(arg, m);
+        }
+    }
+
+    void binarySlow(uint32_t dst, const Operand &lhs, const Operand &rhs, Token opt, AbstractSyntaxTreeNode *origin) {
+        args({{RDI, reg(dst)}, {RSI, lhs.m}, {RDX, rhs.m}});
+        as.movImm(RCX, opt);
+        as.movImm(R8, reinterpret_cast<uint64_t>(origin));
+        as.call(reinterpret_cast<const void *>(&binary));
+    }
+
+    // Stores rax as an integer, or eax as a bool
+    void storeInteger(uint32_t dst) {
+        as.storeImm(reg(dst), apollo::Integer);
+        as.store(payload(reg(dst)), RAX);
+    }
+
+    void storeBool(uint32_t dst) {
+        as.storeImm(reg(dst), apollo::Boolean);
+        as.store(payload(reg(dst)), RAX);
+    }
+
+    void arithmetic(uint32_t dst, const Operand &lhs, const Operand &rhs, Token opt,
+                    AbstractSyntaxTreeNode *origin) {
+        std::vector<size_t> slow, done;
+        bool ints = rhs.known == -1 || rhs.known == apollo::Integer;
+        bool doubles = rhs.known == -1 || rhs.known == apollo::Number;
+        if (ints && opt != TK_DIV) {
+            std::vector<size_t> notInts;
+            guard(lhs, apollo::Integer, notInts);
+            guard(rhs, apollo::Integer, notInts);
+            writable(dst, slow);
+            as.load(RAX, payload(lhs.m));
+            if (opt == TK_PLUS) {
+                as.op64(0x03, RAX, payload(rhs.m));
+            } else if (opt == TK_MINUS) {
+                as.op64(0x2b, RAX, payload(rhs.m));
+            } else {
+                as.imul(RAX, payload(rhs.m));
+            }
+            // Overflow goes to doubles
+            slow.push_back(as.jcc(CC_O));
+            storeInteger(dst);
+            done.push_back(as.jmp());
+            if (doubles) {
+                bindAll(notInts);
+            } else {
+                slow.insert(slow.end(), notInts.begin(), notInts.end());
+            }
+        }
+        if (doubles) {
+            guard(lhs, apollo::Number, slow);
+            guard(rhs, apollo::Number, slow);
+            writable(dst, slow);
+            as.sse(0xf2, 0x10, 0, payload(lhs.m));
+            uint8_t op = opt == TK_PLUS ? 0x58 : opt == TK_MINUS ? 0x5c : opt == TK_TIMES ? 0x59 : 0x5e;
+            as.sse(0xf2, op, 0, payload(rhs.m));
+            as.storeImm(reg(dst), apollo::Number);
+            as.sse(0xf2, 0x11, 0, payload(reg(dst)));
+            done.push_back(as.jmp());
+        }
+        bindAll(slow);
+        binarySlow(dst, lhs, rhs, opt, origin);
+        bindAll(done);
+    }
+
+    // Integer / and %: an exact quotient or a remainder, anything else
+    // (a zero or -1 divisor, a fraction) takes the slow path
+    void division(uint32_t dst, const Operand &lhs, const Operand &rhs, Token opt,
+                  AbstractSyntaxTreeNode *origin) {
+        std::vector<size_t> slow;
+        if (rhs.known == -1 || rhs.known == apollo::Integer) {
+            guard(lhs, apollo::Integer, slow);
+            guard(rhs, apollo::Integer, slow);
+            writable(dst, slow);
+            as.load(RAX, payload(lhs.m));
+            as.load(RCX, payload(rhs.m));
+            // test rcx, rcx; jz slow; cmp rcx, -1; je slow
+            for (uint8_t b: {0x48, 0x85, 0xc9}) {
+                as.byte(b);
+            }
+            slow.push_back(as.jcc(CC_E));
+            for (uint8_t b: {0x48, 0x83, 0xf9, 0xff}) {
+                as.byte(b);
+            }
+            slow.push_back(as.jcc(CC_E));
+            // cqo; idiv rcx
+            for (uint8_t b: {0x48, 0x99, 0x48, 0xf7, 0xf9}) {
+                as.byte(b);
+            }
+            if (opt == TK_DIV) {
+                // test rdx, rdx
+                for (uint8_t b: {0x48, 0x85, 0xd2}) {
+                    as.byte(b);
+                }
+                slow.push_back(as.jcc(CC_NE));
+            } else {
+                // mov rax, rdx
+                for (uint8_t b: {0x48, 0x89, 0xd0}) {
+                    as.byte(b);
+                }
+            }
+            storeInteger(dst);
+            auto done = as.jmp();
+            bindAll(slow);
+            binarySlow(dst, lhs, rhs, opt, origin);
+            as.patch(done, as.size());
+            return;
+        }
+        binarySlow(dst, lhs, rhs, opt, origin);
+    }
+
+    void comparison(uint32_t dst, const Operand &lhs, const Operand &rhs, Token opt,
+                    AbstractSyntaxTreeNode *origin) {
+        std::vector<size_t> slow, done;
+        bool ints = rhs.known == -1 || rhs.known == apollo::Integer;
+        bool doubles = rhs.known == -1 || rhs.known == apollo::Number;
+        if (ints) {
+            std::vector<size_t> notInts;
+            guard(lhs, apollo::Integer, notInts);
+            guard(rhs, apollo::Integer, notInts);
+            writable(dst, slow);
+            as.load(RAX, payload(lhs.m));
+            as.op64(0x3b, RAX, payload(rhs.m));
+            Cond cc = opt == TK_EQ ? CC_E : opt == TK_NE ? CC_NE : opt == TK_LT ? CC_L :
+                      opt == TK_LE ? CC_LE : opt == TK_GT ? CC_G : CC_GE;
+            as.setcc(cc, RAX);
+            movzxAl();
+            storeBool(dst);
+            done.push_back(as.jmp());
+            if (doubles) {
+                bindAll(notInts);
+            } else {
+                slow.insert(slow.end(), notInts.begin(), notInts.end());
+            }
+        }
+        if (doubles) {
+            guard(lhs, apollo::Number, slow);
+            guard(rhs, apollo::Number, slow);
+            writable(dst, slow);
+            // ucomisd leaves an unordered (NaN) pair below and equal with
+            // parity set; < and <= are > and >= swapped so NaN is false
+            bool swap = opt == TK_LT || opt == TK_LE;
+            as.sse(0xf2, 0x10, 0, payload(swap ? rhs.m : lhs.m));
+            as.sse(0x66, 0x2e, 0, payload(swap ? lhs.m : rhs.m));
+            if (opt == TK_EQ || opt == TK_NE) {
+                as.setcc(opt == TK_EQ ? CC_E : CC_NE, RAX);
+                as.setcc(opt == TK_EQ ? CC_NP : CC_P, RCX);
+                // and al, cl / or al, cl
+                as.byte(opt == TK_EQ ? 0x20 : 0x08);
+                as.byte(0xc8);
+            } else {
+                as.setcc(opt == TK_GT || opt == TK_LT ? CC_A : CC_AE, RAX);
+            }
+            movzxAl();
+            storeBool(dst);
+            done.push_back(as.jmp());
+        }
+        bindAll(slow);
+        binarySlow(dst, lhs, rhs, opt, origin);
+        bindAll(done);
+    }
+
+    void movzxAl() {
+        for (uint8_t b: {0x0f, 0xb6, 0xc0}) {
+            as.byte(b);
+        }
+    }
+
+    void bitwise(uint32_t dst, const Operand &lhs, const Operand &rhs, Token opt, AbstractSyntaxTreeNode *origin) {
+        std::vector<size_t> slow;
+        guard(lhs, apollo::Integer, slow);
+        guard(rhs, apollo::Integer, slow);
+        writable(dst, slow);
+        as.load(RAX, payload(lhs.m));
+        as.op64(opt == TK_BITAND ? 0x23 : 0x0b, RAX, payload(rhs.m));
+        storeInteger(dst);
+        auto done = as.jmp();
+        bindAll(slow);
+        binarySlow(dst, lhs, rhs, opt, origin);
+        as.patch(done, as.size());
+    }
+
+    void unarySlow(uint32_t dst, uint32_t operand, Token opt, AbstractSyntaxTreeNode *origin) {
+        args({{RDI, reg(dst)}, {RSI, reg(operand)}});
+        as.movImm(RDX, opt);
+        as.movImm(RCX, reinterpret_cast<uint64_t>(origin));
+        as.call(reinterpret_cast<const void *>(&unary));
+    }
+
+    // var += rhs on integers in place, which keeps the variable's type
+    void addTo(uint32_t var, const Operand &rhs) {
+        std::vector<size_t> slow;
+        if (rhs.known == -1 || rhs.known == apollo::Integer) {
+            guard(r(var), apollo::Integer, slow);
+            guard(rhs, apollo::Integer, slow);
+            as.load(RAX, payload(reg(var)));
+            as.op64(0x03, RAX, payload(rhs.m));
+            slow.push_back(as.jcc(CC_O));
+            as.store(payload(reg(var)), RAX);
+            auto done = as.jmp();
+            bindAll(slow);
+            assignSlow(var, rhs.m, TK_PLUS_AGN);
+            as.patch(done, as.size());
+            return;
+        }
+        assignSlow(var, rhs.m, TK_PLUS_AGN);
+    }
+
+    void assignSlow(uint32_t var, Mem rhs, Token opt) {
+        args({{RDI, reg(var)}, {RSI, rhs}});
+        as.movImm(RDX, opt);
+        as.call(reinterpret_cast<const void *>(&assignTo));
+    }
+
+    // A bit copy of a value that owns no heap object
+    void copyBits(uint32_t dst, Mem src) {
+        // movups xmm0, [src]; movups [dst], xmm0
+        as.sse(0, 0x10, 0, src);
+        as.sse(0, 0x11, 0, reg(dst));
+    }
+
+    void condition(uint32_t index, const Instruction &ins, Cond taken) {
+        as.cmpByte(reg(ins.a), apollo::Boolean);
+        auto ok = as.jcc(CC_E);
+        as.movImm(RDI, reinterpret_cast<uint64_t>(code.origins[index]));
+        as.call(reinterpret_cast<const void *>(&VirtualMachine::notBool));
+        as.patch(ok, as.size());
+        as.cmpByte(payload(reg(ins.a)), 0);
+        jumpTo(ins.bx(), taken);
+    }
+
+    void instruction(uint32_t index, const Instruction &ins) {
+        auto *origin = code.origins[index];
+        switch (ins.op) {
+            case apollo::OP_LOADK: {
+                auto &constant = code.constants[ins.bx()];
+                if (!constant.isHeap()) {
+                    std::vector<size_t> slow;
+                    writable(ins.a, slow);
+                    copyBits(ins.a, k(ins.bx()).m);
+                    auto done = as.jmp();
+                    bindAll(slow);
+                    args({{RDI, reg(ins.a)}, {RSI, k(ins.bx()).m}});
+                    as.call(reinterpret_cast<const void *>(&copyValue));
+                    as.patch(done, as.size());
+                } else {
+                    args({{RDI, reg(ins.a)}, {RSI, k(ins.bx()).m}});
+                    as.call(reinterpret_cast<const void *>(&copyValue));
+                }
+                return;
+            }
+            case apollo::OP_LOADNULL:
+            case apollo::OP_LOADBOOL: {
+                std::vector<size_t> slow;
+                writable(ins.a, slow);
+                bool null = ins.op == apollo::OP_LOADNULL;
+                as.storeImm(reg(ins.a), null ? apollo::Null : apollo::Boolean);
+                as.storeImm(payload(reg(ins.a)), null ? 0 : ins.b != 0);
+                auto done = as.jmp();
+                bindAll(slow);
+                as.lea(RDI, reg(ins.a));
+                if (null) {
+                    as.call(reinterpret_cast<const void *>(&loadNull));
+                } else {
+                    as.movImm(RSI, ins.b != 0);
+                    as.call(reinterpret_cast<const void *>(&loadBool));
+                }
+                as.patch(done, as.size());
+                return;
+            }
+            case apollo::OP_MOVE: {
+                std::vector<size_t> slow;
+                as.cmpByte(reg(ins.b).at(1), ValueDeclaration::onHeap);
+                slow.push_back(as.jcc(CC_E));
+                writable(ins.a, slow);
+                copyBits(ins.a, reg(ins.b));
+                auto done = as.jmp();
+                bindAll(slow);
+                args({{RDI, reg(ins.a)}, {RSI, reg(ins.b)}});
+                as.call(reinterpret_cast<const void *>(&copyValue));
+                as.patch(done, as.size());
+                return;
+            }
+            case apollo::OP_TAKE:
+                args({{RDI, reg(ins.a)}, {RSI, reg(ins.b)}});
+                as.call(reinterpret_cast<const void *>(&takeValue));
+                return;
+            case apollo::OP_CHECKVAR: {
+                as.cmpByte(reg(ins.a), apollo::Undefined);
+                auto defined = as.jcc(CC_NE);
+                as.movImm(RDI, reinterpret_cast<uint64_t>(origin));
+                as.call(reinterpret_cast<const void *>(&VirtualMachine::undefinedVariable));
+                as.patch(defined, as.size());
+                return;
+            }
+            case apollo::OP_UNDEFINED:
+                as.movImm(RDI, reinterpret_cast<uint64_t>(origin));
+                as.call(reinterpret_cast<const void *>(&VirtualMachine::undefinedVariable));
+                return;
+            case apollo::OP_CLEAR:
+                as.lea(RDI, reg(ins.a));
+                as.movImm(RSI, ins.b);
+                as.call(reinterpret_cast<const void *>(&clear));
+                return;
+
+            case apollo::OP_JMP:
+                jumpTo(ins.bx());
+                return;
+            case apollo::OP_JDEF:
+                as.cmpByte(reg(ins.a), apollo::Undefined);
+                jumpTo(ins.bx(), CC_NE);
+                return;
+            case apollo::OP_JFALSE:
+                condition(index, ins, CC_E);
+                return;
+            case apollo::OP_JTRUE:
+                condition(index, ins, CC_NE);
+                return;
+
+            case apollo::OP_ADD:
+                arithmetic(ins.a, r(ins.b), r(ins.c), TK_PLUS, origin);
+                return;
+            case apollo::OP_SUB:
+                arithmetic(ins.a, r(ins.b), r(ins.c), TK_MINUS, origin);
+                return;
+            case apollo::OP_MUL:
+                arithmetic(ins.a, r(ins.b), r(ins.c), TK_TIMES, origin);
+                return;
+            case apollo::OP_DIV:
+                division(ins.a, r(ins.b), r(ins.c), TK_DIV, origin);
+                return;
+            case apollo::OP_MOD:
+                division(ins.a, r(ins.b), r(ins.c), TK_MOD, origin);
+                return;
+            case apollo::OP_AND:
+                binarySlow(ins.a, r(ins.b), r(ins.c), TK_LOGAND, origin);
+                return;
+            case apollo::OP_OR:
+                binarySlow(ins.a, r(ins.b), r(ins.c), TK_LOGOR, origin);
+                return;
+            case apollo::OP_EQ:
+                comparison(ins.a, r(ins.b), r(ins.c), TK_EQ, origin);
+                return;
+            case apollo::OP_NE:
+                comparison(ins.a, r(ins.b), r(ins.c), TK_NE, origin);
+                return;
+            case apollo::OP_GT:
+                comparison(ins.a, r(ins.b), r(ins.c), TK_GT, origin);
+                return;
+            case apollo::OP_GE:
+                comparison(ins.a, r(ins.b), r(ins.c), TK_GE, origin);
+                return;
+            case apollo::OP_LT:
+                comparison(ins.a, r(ins.b), r(ins.c), TK_LT, origin);
+                return;
+            case apollo::OP_LE:
+                comparison(ins.a, r(ins.b), r(ins.c), TK_LE, origin);
+                return;
+            case apollo::OP_BITAND:
+                bitwise(ins.a, r(ins.b), r(ins.c), TK_BITAND, origin);
+                return;
+            case apollo::OP_BITOR:
+                bitwise(ins.a, r(ins.b), r(ins.c), TK_BITOR, origin);
+                return;
+
+            case apollo::OP_ADDK:
+                arithmetic(ins.a, r(ins.b), k(ins.c), TK_PLUS, origin);
+                return;
+            case apollo::OP_SUBK:
+                arithmetic(ins.a, r(ins.b), k(ins.c), TK_MINUS, origin);
+                return;
+            case apollo::OP_MULK:
+                arithmetic(ins.a, r(ins.b), k(ins.c), TK_TIMES, origin);
+                return;
+            case apollo::OP_DIVK:
+                if (code.constants[ins.c].type == apollo::Number) {
+                    arithmetic(ins.a, r(ins.b), k(ins.c), TK_DIV, origin);
+                } else {
+                    division(ins.a, r(ins.b), k(ins.c), TK_DIV, origin);
+                }
+                return;
+            case apollo::OP_MODK:
+                division(ins.a, r(ins.b), k(ins.c), TK_MOD, origin);
+                return;
+            case apollo::OP_EQK:
+                comparison(ins.a, r(ins.b), k(ins.c), TK_EQ, origin);
+                return;
+            case apollo::OP_NEK:
+                comparison(ins.a, r(ins.b), k(ins.c), TK_NE, origin);
+                return;
+            case apollo::OP_GTK:
+                comparison(ins.a, r(ins.b), k(ins.c), TK_GT, origin);
+                return;
+            case apollo::OP_GEK:
+                comparison(ins.a, r(ins.b), k(ins.c), TK_GE, origin);
+                return;
+            case apollo::OP_LTK:
+                comparison(ins.a, r(ins.b), k(ins.c), TK_LT, origin);
+                return;
+            case apollo::OP_LEK:
+                comparison(ins.a, r(ins.b), k(ins.c), TK_LE, origin);
+                return;
+
+            case apollo::OP_NEG: {
+                std::vector<size_t> slow;
+                guard(r(ins.b), apollo::Integer, slow);
+                writable(ins.a, slow);
+                as.load(RAX, payload(reg(ins.b)));
+                // neg rax, which overflows on INT64_MIN
+                for (uint8_t b: {0x48, 0xf7, 0xd8}) {
+                    as.byte(b);
+                }
+                slow.push_back(as.jcc(CC_O));
+                storeInteger(ins.a);
+                auto done = as.jmp();
+                bindAll(slow);
+                unarySlow(ins.a, ins.b, TK_MINUS, origin);
+                as.patch(done, as.size());
+                return;
+            }
+            case apollo::OP_NOT: {
+                std::vector<size_t> slow;
+                guard(r(ins.b), apollo::Boolean, slow);
+                writable(ins.a, slow);
+                // movzx eax, byte [b]; xor eax, 1
+                as.rex(false, RAX, RBX);
+                as.byte(0x0f);
+                as.byte(0xb6);
+                as.modrm(RAX, payload(reg(ins.b)));
+                for (uint8_t b: {0x83, 0xf0, 0x01}) {
+                    as.byte(b);
+                }
+                storeBool(ins.a);
+                auto done = as.jmp();
+                bindAll(slow);
+                unarySlow(ins.a, ins.b, TK_LOGNOT, origin);
+                as.patch(done, as.size());
+                return;
+            }
+            case apollo::OP_BITNOT:
+                unarySlow(ins.a, ins.b, TK_BITNOT, origin);
+                return;
+
+            case apollo::OP_ADDTO:
+                addTo(ins.a, r(ins.b));
+                return;
+            case apollo::OP_ADDTOK:
+                addTo(ins.a, k(ins.b));
+                return;
+            case apollo::OP_ASSIGNOP:
+                assignSlow(ins.a, reg(ins.b), static_cast<Token>(ins.k));
+                return;
+            case apollo::OP_GETINDEX:
+                args({{RDI, reg(ins.a)}, {RSI, reg(ins.b)}, {RDX, reg(ins.c)}});
+                as.movImm(RCX, reinterpret_cast<uint64_t>(origin));
+                as.call(reinterpret_cast<const void *>(&getIndex));
+                return;
+            case apollo::OP_SETINDEX:
+                args({{RDI, reg(ins.a)}, {RSI, reg(ins.b)}, {RDX, reg(ins.c)}});
+                as.movImm(RCX, ins.k);
+                as.movImm(R8, reinterpret_cast<uint64_t>(origin));
+                as.call(reinterpret_cast<const void *>(&setIndex));
+                return;
+            case apollo::OP_NEWARRAY:
+                args({{RDI, reg(ins.a)}, {RSI, reg(ins.b)}});
+                as.movImm(RDX, ins.c);
+                as.call(reinterpret_cast<const void *>(&newArray));
+                return;
+
+            case apollo::OP_BIND:
+                as.movImm(RDI, reinterpret_cast<uint64_t>(code.calls[ins.bx()]));
+                as.movImm(RSI, reinterpret_cast<uint64_t>(rt));
+                as.call(reinterpret_cast<const void *>(&bindCall));
+                return;
+            default:
+                // Calls and returns switch frames, which the interpreter does
+                exitTo(index);
+                return;
+        }
+    }
+
+private:
+    const apollo::Bytecode &code;
+    apollo::Runtime *rt;
+    size_t exitStub = 0;
+    std::vector<std::pair<size_t, uint32_t>> jumps;
+};
+
+apollo::NativeCode::~NativeCode() {
+    munmap(memory, size);
+}
+
+std::unique_ptr<apollo::NativeCode> Jit::compile(const apollo::Bytecode &code, apollo::Runtime *rt) {
+    Jit::Emitter emitter(code, rt);
+    emitter.emit();
+    auto &bytes = emitter.as.bytes;
+    size_t size = (bytes.size() + 4095) & ~static_cast<size_t>(4095);
+    void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    std::memcpy(memory, bytes.data(), bytes.size());
+    // Never writable and executable at once
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+    }
+    return std::make_unique<apollo::NativeCode>(static_cast<uint8_t *>(memory), size, std::move(emitter.offsets));
+}
+
+#else
+
+apollo::NativeCode::~NativeCode() = default;
+
+std::unique_ptr<apollo::NativeCode> Jit::compile(const apollo::Bytecode &, apollo::Runtime *) {
+    return nullptr;
+}
+
+#endif
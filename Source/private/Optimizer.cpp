@@ -0,0 +1,293 @@
+//
+// Created by chineseblack23 on 2024/7/1.
+//
+#include <algorithm>
+#include "Optimizer.hpp"
+#include "Interpreter.hpp"
+
+void Optimizer::optimizeProgram(std::vector<Statement *> &stmts) {
+    optimizeStatements(stmts, ProgramScope);
+}
+
+void Optimizer::optimizeFunction(apollo::FunctionDeclaration *f) {
+    optimizeStatements(f->getBody()->stmts, FunctionScope);
+}
+
+void Optimizer::optimizeStatements(std::vector<Statement *> &stmts, Scope scope) {
+    std::vector<Statement *> out;
+    out.reserve(stmts.size());
+    for (auto *stmt: stmts) {
+        auto first = out.size();
+        optimize(stmt, scope, out);
+        for (auto i = first; i < out.size(); i++) {
+            if (ends(out[i], scope)) {
+                out.resize(i + 1);
+                stmts = std::move(out);
+                return;
+            }
+        }
+    }
+    stmts = std::move(out);
+}
+
+void Optimizer::optimize(Statement *stmt, Scope scope, std::vector<Statement *> &out) {
+    switch (stmt->kind) {
+        case AST_EXPR_STMT: {
+            auto *exprStmt = static_cast<ExpressionStmt *>(stmt);
+            exprStmt->expression = fold(exprStmt->expression);
+            // A literal on its own has nothing to do
+            apollo::ValueDeclaration ignored;
+            if (!constant(exprStmt->expression, ignored)) {
+                out.push_back(stmt);
+            }
+            return;
+        }
+        case AST_RETURN: {
+            auto *returnStmt = static_cast<ReturnStmt *>(stmt);
+            if (returnStmt->expression != nullptr) {
+                returnStmt->expression = fold(returnStmt->expression);
+            }
+            out.push_back(stmt);
+            return;
+        }
+        case AST_IF: {
+            auto *ifStmt = static_cast<IfStmt *>(stmt);
+            ifStmt->cond = fold(ifStmt->cond);
+            optimizeStatements(ifStmt->blockStatement->stmts, BlockScope);
+            if (ifStmt->elseBlock != nullptr) {
+                optimizeStatements(ifStmt->elseBlock->stmts, BlockScope);
+            }
+            apollo::ValueDeclaration cond;
+            if (!constant(ifStmt->cond, cond) || !cond.isType<apollo::Boolean>()) {
+                out.push_back(stmt);
+                return;
+            }
+            auto *taken = cond.asBool() ? ifStmt->blockStatement : ifStmt->elseBlock;
+            if (taken == nullptr) {
+                return;
+            }
+            // A block that assigns nothing gets no context, running its
+            // statements in place is the same. Only inside a block, though:
+            // elsewhere a jump ends just its own statement, which would
+            // then be the enclosing list
+            if (scope == BlockScope && std::none_of(taken->stmts.begin(), taken->stmts.end(),
+                             [](Statement *s) { return assigns(s); })) {
+                out.insert(out.end(), taken->stmts.begin(), taken->stmts.end());
+                return;
+            }
+            if (!cond.asBool()) {
+                ifStmt->cond = literal(apollo::ValueDeclaration::fromBool(true), ifStmt->cond->start,
+                                       ifStmt->cond->end);
+                ifStmt->blockStatement = taken;
+            }
+            ifStmt->elseBlock = nullptr;
+            out.push_back(stmt);
+            return;
+        }
+        case AST_WHILE: {
+            auto *whileStmt = static_cast<WhileStmt *>(stmt);
+            whileStmt->cond = fold(whileStmt->cond);
+            apollo::ValueDeclaration cond;
+            if (constant(whileStmt->cond, cond) && cond.isType<apollo::Boolean>() && !cond.asBool()) {
+                return;
+            }
+            optimizeStatements(whileStmt->blockStatement->stmts, BlockScope);
+            out.push_back(stmt);
+            return;
+        }
+        default:
+            out.push_back(stmt);
+            return;
+    }
+}
+
+Expression *Optimizer::fold(Expression *expr) {
+    switch (expr->kind) {
+        case AST_BINARY: {
+            auto *binary = static_cast<BinaryExpression *>(expr);
+            binary->leftExpression = fold(binary->leftExpression);
+            if (binary->rightExpression != nullptr) {
+                binary->rightExpression = fold(binary->rightExpression);
+            }
+            // A missing right operand is a null one, which makes it unary
+            apollo::ValueDeclaration lhs(apollo::Null), rhs(apollo::Null);
+            if (!constant(binary->leftExpression, lhs) ||
+                (binary->rightExpression != nullptr && !constant(binary->rightExpression, rhs)) ||
+                !foldable(lhs, binary->opt, rhs)) {
+                return expr;
+            }
+            return literal(Interpreter::evalBinary(lhs, binary->opt, rhs, binary->start, binary->end),
+                           binary->start, binary->end);
+        }
+        case AST_ARRAY:
+            for (auto &e: static_cast<ArrayExpression *>(expr)->literal) {
+                e = fold(e);
+            }
+            return expr;
+        case AST_INDEX: {
+            auto *index = static_cast<IndexExpression *>(expr);
+            index->index = fold(index->index);
+            return expr;
+        }
+        case AST_FUNCALL:
+            for (auto &e: static_cast<FunCallExpression *>(expr)->args) {
+                e = fold(e);
+            }
+            return expr;
+        case AST_ASSIGN: {
+            auto *assign = static_cast<AssignExpression *>(expr);
+            if (assign->leftExpression->kind == AST_INDEX) {
+                fold(assign->leftExpression);
+            }
+            assign->rightExperssion = fold(assign->rightExperssion);
+            return expr;
+        }
+        default:
+            return expr;
+    }
+}
+
+Expression *Optimizer::literal(const apollo::ValueDeclaration &value, int start, int end) {
+    switch (value.type) {
+        case apollo::Integer:
+        case apollo::Number: {
+            auto *number = arena->make<NumberExpression>(start, end);
+            number->literal = value;
+            return number;
+        }
+        case apollo::String: {
+            auto *string = arena->make<StringExpression>(start, end);
+            string->literal = arena->internString(value.asString());
+            return string;
+        }
+        case apollo::Boolean: {
+            auto *boolean = arena->make<BooleanExpression>(start, end);
+            boolean->literal = value.asBool();
+            return boolean;
+        }
+        default:
+            return arena->make<NullExpression>(start, end);
+    }
+}
+
+bool Optimizer::constant(Expression *expr, apollo::ValueDeclaration &value) {
+    switch (expr->kind) {
+        case AST_NUMBER:
+            value = static_cast<NumberExpression *>(expr)->literal;
+            return true;
+        case AST_STRING:
+            value = apollo::ValueDeclaration::fromString(static_cast<StringExpression *>(expr)->literal);
+            return true;
+        case AST_BOOLEAN:
+            value = apollo::ValueDeclaration::fromBool(static_cast<BooleanExpression *>(expr)->literal);
+            return true;
+        case AST_NULL:
+            value = apollo::ValueDeclaration(apollo::Null);
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool Optimizer::foldable(const apollo::ValueDeclaration &lhs, Token opt, const apollo::ValueDeclaration &rhs) {
+    // Only what evalBinary computes without raising an error
+    bool numbers = lhs.isNumber() && rhs.isNumber();
+    bool strings = lhs.isType<apollo::String>() && rhs.isType<apollo::String>();
+    bool bools = lhs.isType<apollo::Boolean>() && rhs.isType<apollo::Boolean>();
+    if (!lhs.isType<apollo::Null>() && rhs.isType<apollo::Null>()) {
+        switch (opt) {
+            case TK_MINUS:
+                return lhs.isNumber();
+            case TK_LOGNOT:
+                return lhs.isType<apollo::Boolean>();
+            case TK_BITNOT:
+                return lhs.isType<apollo::Integer>();
+            default:
+                // Any other operator gives its operand back
+                return true;
+        }
+    }
+    switch (opt) {
+        case TK_PLUS:
+            return numbers || lhs.isType<apollo::String>() || rhs.isType<apollo::String>();
+        case TK_MINUS:
+            // A string on either side gives null
+            return (lhs.isNumber() || lhs.isType<apollo::String>()) &&
+                   (rhs.isNumber() || rhs.isType<apollo::String>());
+        case TK_TIMES:
+        case TK_DIV:
+        case TK_MOD:
+            // A repeated string is left for run time, it may be large
+            return numbers;
+        case TK_LOGAND:
+        case TK_LOGOR:
+            return bools;
+        case TK_EQ:
+        case TK_NE:
+            return numbers || strings || bools || (lhs.isType<apollo::Null>() && rhs.isType<apollo::Null>());
+        case TK_GT:
+        case TK_GE:
+        case TK_LT:
+        case TK_LE:
+            return numbers || strings;
+        case TK_BITAND:
+        case TK_BITOR:
+            return lhs.isType<apollo::Integer>() && rhs.isType<apollo::Integer>();
+        default:
+            return false;
+    }
+}
+
+bool Optimizer::assigns(Statement *stmt) {
+    // The names a statement declares in its own scope (see Resolver)
+    switch (stmt->kind) {
+        case AST_EXPR_STMT:
+            return assigns(static_cast<ExpressionStmt *>(stmt)->expression);
+        case AST_RETURN:
+            return assigns(static_cast<ReturnStmt *>(stmt)->expression);
+        case AST_IF:
+            return assigns(static_cast<IfStmt *>(stmt)->cond);
+        case AST_WHILE:
+            return assigns(static_cast<WhileStmt *>(stmt)->cond);
+        default:
+            return false;
+    }
+}
+
+bool Optimizer::assigns(Expression *expr) {
+    if (expr == nullptr) {
+        return false;
+    }
+    switch (expr->kind) {
+        case AST_ASSIGN:
+            return true;
+        case AST_INDEX:
+            return assigns(static_cast<IndexExpression *>(expr)->index);
+        case AST_BINARY:
+            return assigns(static_cast<BinaryExpression *>(expr)->leftExpression) ||
+                   assigns(static_cast<BinaryExpression *>(expr)->rightExpression);
+        case AST_ARRAY: {
+            auto &elements = static_cast<ArrayExpression *>(expr)->literal;
+            return std::any_of(elements.begin(), elements.end(), [](Expression *e) { return assigns(e); });
+        }
+        case AST_FUNCALL: {
+            auto &args = static_cast<FunCallExpression *>(expr)->args;
+            return std::any_of(args.begin(), args.end(), [](Expression *e) { return assigns(e); });
+        }
+        default:
+            return false;
+    }
+}
+
+bool Optimizer::ends(Statement *stmt, Scope scope) {
+    // A top-level jump only ends its own statement, and only a return
+    // leaves a function body early
+    switch (scope) {
+        case ProgramScope:
+            return false;
+        case FunctionScope:
+            return stmt->kind == AST_RETURN;
+        default:
+            return stmt->kind == AST_RETURN || stmt->kind == AST_BREAK || stmt->kind == AST_CONTINUE;
+    }
+}
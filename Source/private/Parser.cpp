@@ -1,53 +1,127 @@
 //
 // Created by chineseblack23 on 2024/6/22.
 //
+#include <array>
+#include <charconv>
+#include <memory>
 #include <typeinfo>
 #include "apollo.hpp"
 
 #include "Parser.hpp"
+#include "Scanner.hpp"
 #include "Utils.hpp"
 
+namespace {
+    struct Keyword {
+        std::string_view word;
+        Token kind;
+    };
+
+    constexpr Keyword keywordList[] = {
+            {"if",       KW_IF},
+            {"else",     KW_ELSE},
+            {"while",    KW_WHILE},
+            {"null",     KW_NULL},
+            {"true",     KW_TRUE},
+            {"false",    KW_FALSE},
+            {"for",      KW_FOR},
+            {"of",       KW_FOROF},
+            {"func",     KW_FUNC},
+            {"return",   KW_RETURN},
+            {"break",    KW_BREAK},
+            {"continue", KW_CONTINUE},
+    };
+
+    constexpr size_t keywordTableSize = 16;
+
+    // Perfect hash over the keyword list: first character and length are
+    // enough to tell every keyword apart, checked by the static_assert below.
+    constexpr size_t keywordHash(std::string_view word) {
+        return (static_cast<unsigned char>(word[0]) * 3 + word.size()) & (keywordTableSize - 1);
+    }
+
+    constexpr std::array<Keyword, keywordTableSize> makeKeywordTable() {
+        std::array<Keyword, keywordTableSize> table{};
+        for (auto &kw: keywordList) {
+            table[keywordHash(kw.word)] = kw;
+        }
+        return table;
+    }
+
+    constexpr bool keywordTableIsPerfect() {
+        auto table = makeKeywordTable();
+        for (auto &kw: keywordList) {
+            if (table[keywordHash(kw.word)].word != kw.word) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    static_assert(keywordTableIsPerfect(), "keyword hash has collisions, adjust keywordHash()");
+
+    constexpr auto keywordTable = makeKeywordTable();
+
+    constexpr Token keywordKind(std::string_view word) {
+        const auto &kw = keywordTable[keywordHash(word)];
+        return kw.word == word ? kw.kind : TK_IDENT;
+    }
+
+    static_assert(keywordKind("for") == KW_FOR);
+    static_assert(keywordKind("of") == KW_FOROF);
+    static_assert(keywordKind("continue") == KW_CONTINUE);
+    static_assert(keywordKind("fun") == TK_IDENT);
+}
+
 void Parser::printLex(const std::string &fileName) {
-    Parser parser(fileName);
-    std::tuple<Token, std::string> tk;
+    printLex(SourceBuffer::fromFile(fileName));
+}
+
+void Parser::printLex(SourceBuffer source) {
+    Parser parser(std::move(source));
+    SourceToken tk;
     do {
         tk = parser.next();
-        std::cout << "[" << std::get<0>(tk) << "," << std::get<1>(tk) << "]\n";
-    } while (std::get<0>(tk) != TK_EOF);
+        std::cout << "[" << tk.kind << "," << tk.lexeme << "]\n";
+    } while (tk.kind != TK_EOF);
 }
 
-Parser::Parser(const std::string &fileName) : keywords({
-                                                               {"if",       KW_IF},
-                                                               {"else",     KW_ELSE},
-                                                               {"while",    KW_WHILE},
-                                                               {"null",     KW_NULL},
-                                                               {"true",     KW_TRUE},
-                                                               {"false",    KW_FALSE},
-                                                               {"for",      KW_FALSE},
-                                                               {"func",     KW_FUNC},
-                                                               {"return",   KW_RETURN},
-                                                               {"break",    KW_BREAK},
-                                                               {"continue", KW_CONTINUE}
-                                                       }) {
-    fs.open(fileName);
-    if (!fs.is_open()) {
-        panic("ParserError: can not open source file");
-    }
+size_t Parser::countTokens(SourceBuffer source) {
+    Parser parser(std::move(source));
+    size_t count = 0;
+    SourceToken tk;
+    do {
+        tk = parser.next();
+        count++;
+    } while (tk.kind != TK_EOF);
+    return count;
+}
+
+Parser::Parser(const std::string &fileName) : Parser(SourceBuffer::fromFile(fileName)) {}
+
+Parser::Parser(SourceBuffer source) : source(std::move(source)) {
+    cursor = this->source.begin();
+    limit = this->source.end();
+    lineStart = cursor;
 }
 
-Parser::~Parser() { fs.close(); }
+Parser::~Parser() = default;
 
 Expression *Parser::parsePrimaryExpr() {
     if (getCurrentToken() == TK_IDENT) {
-        auto ident = getCurrentLexeme();
+        auto ident = apollo::Symbol::intern(getCurrentLexeme());
         currentToken = next();
         switch (getCurrentToken()) {
             case TK_LPAREN: {
                 currentToken = next();
-                auto *val = new FunCallExpression(start, end);
+                auto *val = make<FunCallExpression>(start, end);
                 val->funName = ident;
                 while (getCurrentToken() != TK_RPAREN) {
-                    val->args.push_back(parseExpression());
+                    auto *arg = parseExpression();
+                    if (arg == nullptr) {
+                        unexpectedToken();
+                    }
+                    val->args.push_back(arg);
                     if (getCurrentToken() == TK_COMMA) {
                         currentToken = next();
                     }
@@ -58,7 +132,7 @@ Expression *Parser::parsePrimaryExpr() {
             }
             case TK_LBRACKET: {
                 currentToken = next();
-                auto *val = new IndexExpression(start, end);
+                auto *val = make<IndexExpression>(start, end);
                 val->identName = ident;
                 val->index = parseExpression();
                 assert(val->index != nullptr);
@@ -67,30 +141,38 @@ Expression *Parser::parsePrimaryExpr() {
                 return val;
             }
             default: {
-                return new IdentExpression(ident, start, end);
+                return make<IdentExpression>(ident, start, end);
             }
         }
     } else if (getCurrentToken() == LIT_NUMBER) {
-        auto val = atoi(getCurrentLexeme().c_str());
+        auto lexeme = getCurrentLexeme();
+        auto *ret = make<NumberExpression>(start, end);
+        int64_t integer = 0;
+        auto res = std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), integer);
+        if (res.ec == std::errc() && res.ptr == lexeme.data() + lexeme.size()) {
+            ret->literal = apollo::ValueDeclaration::fromInteger(integer);
+        } else {
+            double number = 0;
+            std::from_chars(lexeme.data(), lexeme.data() + lexeme.size(), number);
+            ret->literal = apollo::ValueDeclaration::fromNumber(number);
+        }
         currentToken = next();
-        auto *ret = new NumberExpression(start, end);
-        ret->literal = val;
         return ret;
     } else if (getCurrentToken() == LIT_STRING) {
         auto val = getCurrentLexeme();
         currentToken = next();
-        auto *ret = new StringExpression(start, end);
-        ret->literal = val;
+        auto *ret = make<StringExpression>(start, end);
+        ret->literal = arena->internString(val);
         return ret;
     } else if (getCurrentToken() == KW_TRUE || getCurrentToken() == KW_FALSE) {
         auto val = (KW_TRUE == getCurrentToken());
         currentToken = next();
-        auto *ret = new BooleanExpression(start, end);
+        auto *ret = make<BooleanExpression>(start, end);
         ret->literal = val;
         return ret;
     } else if (getCurrentToken() == KW_NULL) {
         currentToken = next();
-        return new NullExpression(start, end);
+        return make<NullExpression>(start, end);
     } else if (getCurrentToken() == TK_LPAREN) {
         currentToken = next();
         auto val = parseExpression();
@@ -99,10 +181,14 @@ Expression *Parser::parsePrimaryExpr() {
         return val;
     } else if (getCurrentToken() == TK_LBRACKET) {
         currentToken = next();
-        auto *ret = new ArrayExpression(start, end);
+        auto *ret = make<ArrayExpression>(start, end);
         if (getCurrentToken() != TK_RBRACKET) {
             while (getCurrentToken() != TK_RBRACKET) {
-                ret->literal.push_back(parseExpression());
+                auto *element = parseExpression();
+                if (element == nullptr) {
+                    unexpectedToken();
+                }
+                ret->literal.push_back(element);
                 if (getCurrentToken() == TK_COMMA) {
                     currentToken = next();
                 }
@@ -121,7 +207,7 @@ Expression *Parser::parsePrimaryExpr() {
 
 Expression *Parser::parseUnaryExpr() {
     if (anyone(getCurrentToken(), TK_MINUS, TK_LOGNOT, TK_BITNOT)) {
-        auto val = new BinaryExpression(start, end);
+        auto val = make<BinaryExpression>(start, end);
         val->opt = getCurrentToken();
         currentToken = next();
         val->leftExpression = parseUnaryExpr();
@@ -139,15 +225,18 @@ Expression *Parser::parseExpression(short oldPrecedence) {
 
     if (anyone(getCurrentToken(), TK_ASSIGN, TK_PLUS_AGN, TK_MINUS_AGN,
                TK_TIMES_AGN, TK_DIV_AGN, TK_MOD_AGN)) {
-        if (typeid(*p) != typeid(IndexExpression) &&
+        if (typeid(*p) != typeid(IdentExpression) &&
             typeid(*p) != typeid(IndexExpression)) {
             panic("SyntaxError: can not assign to %s", typeid(*p).name());
         }
-        auto *assignExpr = new AssignExpression(start, end);
+        auto *assignExpr = make<AssignExpression>(start, end);
         assignExpr->opt = getCurrentToken();
         assignExpr->leftExpression = p;
         currentToken = next();
         assignExpr->rightExperssion = parseExpression();
+        if (assignExpr->rightExperssion == nullptr) {
+            unexpectedToken();
+        }
         return assignExpr;
     }
 
@@ -158,11 +247,14 @@ Expression *Parser::parseExpression(short oldPrecedence) {
         if (oldPrecedence > currentPrecedence) {
             return p;
         }
-        auto tmp = new BinaryExpression(start, end);
+        auto tmp = make<BinaryExpression>(start, end);
         tmp->leftExpression = p;
         tmp->opt = getCurrentToken();
         currentToken = next();
         tmp->rightExpression = parseExpression(currentPrecedence + 1);
+        if (tmp->rightExpression == nullptr) {
+            unexpectedToken();
+        }
         p = tmp;
     }
     return p;
@@ -171,13 +263,13 @@ Expression *Parser::parseExpression(short oldPrecedence) {
 ExpressionStmt *Parser::parseExpressionStmt() {
     ExpressionStmt *node = nullptr;
     if (auto p = parseExpression(); p != nullptr) {
-        node = new ExpressionStmt(p, start, end);
+        node = make<ExpressionStmt>(p, start, end);
     }
     return node;
 }
 
 IfStmt *Parser::parseIfStmt() {
-    auto *node = new IfStmt(start, end);
+    auto *node = make<IfStmt>(start, end);
     currentToken = next();
     node->cond = parseExpression();
     assert(getCurrentToken() == TK_RPAREN);
@@ -191,7 +283,7 @@ IfStmt *Parser::parseIfStmt() {
 }
 
 WhileStmt *Parser::parseWhileStmt() {
-    auto *node = new WhileStmt(start, end);
+    auto *node = make<WhileStmt>(start, end);
     currentToken = next();
     node->cond = parseExpression();
     assert(getCurrentToken() == TK_RPAREN);
@@ -201,7 +293,7 @@ WhileStmt *Parser::parseWhileStmt() {
 }
 
 ReturnStmt *Parser::parseReturnStmt() {
-    auto *node = new ReturnStmt(start, end);
+    auto *node = make<ReturnStmt>(start, end);
     node->expression = parseExpression();
     return node;
 }
@@ -223,11 +315,11 @@ Statement *Parser::parseStatement() {
             break;
         case KW_BREAK:
             currentToken = next();
-            node = new BreakStmt(start, end);
+            node = make<BreakStmt>(start, end);
             break;
         case KW_CONTINUE:
             currentToken = next();
-            node = new ContinueStmt(start, end);
+            node = make<ContinueStmt>(start, end);
             break;
         default:
             node = parseExpressionStmt();
@@ -246,7 +338,7 @@ std::vector<Statement *> Parser::parseStatementList() {
 }
 
 struct BlockStatement *Parser::parseBlock() {
-    struct BlockStatement *node{new struct BlockStatement};
+    auto *node = make<struct BlockStatement>();
     currentToken = next();
     node->stmts = parseStatementList();
     assert(getCurrentToken() == TK_RBRACE);
@@ -254,8 +346,8 @@ struct BlockStatement *Parser::parseBlock() {
     return node;
 }
 
-std::vector<std::string> Parser::parseParameterList() {
-    std::vector<std::string> node;
+std::vector<apollo::Symbol> Parser::parseParameterList() {
+    std::vector<apollo::Symbol> node;
     currentToken = next();
     if (getCurrentToken() == TK_RPAREN) {
         currentToken = next();
@@ -264,9 +356,9 @@ std::vector<std::string> Parser::parseParameterList() {
 
     while (getCurrentToken() != TK_RPAREN) {
         if (getCurrentToken() == TK_IDENT) {
-            node.push_back(getCurrentLexeme());
-        } else {
-            assert(getCurrentToken() == TK_COMMA);
+            node.push_back(apollo::Symbol::intern(getCurrentLexeme()));
+        } else if (getCurrentToken() != TK_COMMA) {
+            unexpectedToken();
         }
         currentToken = next();
     }
@@ -275,18 +367,19 @@ std::vector<std::string> Parser::parseParameterList() {
     return move(node);
 }
 
-apollo::FunctionDeclaration *Parser::parseFuncDef(apollo::Context *context) {
+apollo::FunctionDeclaration *Parser::parseFuncDef(apollo::Runtime *rt) {
     assert(getCurrentToken() == KW_FUNC);
     currentToken = next();
 
     // Check if function was already be defined
-    if (context->hasFunction(getCurrentLexeme())) {
+    auto name = apollo::Symbol::intern(getCurrentLexeme());
+    if (rt->hasFunction(name)) {
         panic("SyntaxError: multiply function definitions of %s found",
-              getCurrentLexeme().c_str());
+              name.c_str());
     }
 
-    auto *node = new apollo::FunctionDeclaration;
-    node->id.name = getCurrentLexeme();
+    auto *node = rt->adoptFunction(std::make_unique<apollo::FunctionDeclaration>());
+    node->id.name = name;
     currentToken = next();
     assert(getCurrentToken() == TK_LPAREN);
     node->params = parseParameterList();
@@ -295,6 +388,7 @@ apollo::FunctionDeclaration *Parser::parseFuncDef(apollo::Context *context) {
 }
 
 void Parser::parse(apollo::Runtime *rt) {
+    arena = &rt->getArena();
     currentToken = next();
     if (getCurrentToken() == TK_EOF) {
         return;
@@ -303,218 +397,252 @@ void Parser::parse(apollo::Runtime *rt) {
         if (getCurrentToken() == KW_FUNC) {
             auto *f = parseFuncDef(rt);
             rt->addFunction(f->id.name, f);
+        } else if (auto *stmt = parseStatement(); stmt != nullptr) {
+            rt->addStatement(stmt);
         } else {
-            rt->addStatement(parseStatement());
+            unexpectedToken();
         }
     } while (getCurrentToken() != TK_EOF);
 }
 
-std::tuple<Token, std::string> Parser::next() {
-    char c = getNextChar();
-
-    if (c == EOF) {
-        return std::make_tuple(TK_EOF, "");
-    }
-    if (anyone(c, ' ', '\n', '\r', '\t')) {
-        while (anyone(c, ' ', '\n', '\r', '\t')) {
-            if (c == '\n') {
-                start++;
-                end = 0;
-            }
-            c = getNextChar();
+void Parser::hoistFunctions(apollo::Runtime *rt) {
+    arena = &rt->getArena();
+    int depth = 0;
+    currentToken = next();
+    while (getCurrentToken() != TK_EOF) {
+        if (depth == 0 && getCurrentToken() == KW_FUNC) {
+            auto *f = parseFuncDef(rt);
+            rt->addFunction(f->id.name, f);
+            continue;
         }
-        if (c == EOF) {
-            return std::make_tuple(TK_EOF, "");
+        if (anyone(getCurrentToken(), TK_LBRACE, TK_LPAREN, TK_LBRACKET)) {
+            depth++;
+        } else if (anyone(getCurrentToken(), TK_RBRACE, TK_RPAREN, TK_RBRACKET)) {
+            depth--;
         }
+        currentToken = next();
+        source.discardBefore(currentToken.lexeme.data());
     }
+    rewind();
+}
 
-    if (c == '#') {
-        another_comment:
-        while (c != '\n' && c != EOF) {
-            c = getNextChar();
-        }
-        // consume newlines
-        while (c == '\n') {
-            start++;
-            end = 0;
-            c = getNextChar();
-        }
-        if (c == '#') {
-            goto another_comment;
+Statement *Parser::parseNextStatement(apollo::AstArena &scratch) {
+    arena = &scratch;
+    if (getCurrentToken() == INVALID) {
+        currentToken = next();
+    }
+    // Function definitions were registered by hoistFunctions already
+    while (getCurrentToken() == KW_FUNC) {
+        skipFuncDef();
+    }
+    if (getCurrentToken() == TK_EOF) {
+        return nullptr;
+    }
+    auto *stmt = parseStatement();
+    if (stmt == nullptr) {
+        unexpectedToken();
+    }
+    source.discardBefore(currentToken.lexeme.data());
+    return stmt;
+}
+
+void Parser::skipFuncDef() {
+    assert(getCurrentToken() == KW_FUNC);
+    int depth = 0;
+    do {
+        currentToken = next();
+        if (getCurrentToken() == TK_LBRACE) {
+            depth++;
+        } else if (getCurrentToken() == TK_RBRACE) {
+            depth--;
         }
-        if (c == EOF) {
-            return std::make_tuple(TK_EOF, "");
+    } while (getCurrentToken() != TK_EOF && (depth > 0 || getCurrentToken() != TK_RBRACE));
+    currentToken = next();
+}
+
+void Parser::rewind() {
+    cursor = source.begin();
+    source.resetDiscard();
+    lineStart = cursor;
+    start = 1;
+    end = 0;
+    currentToken = SourceToken{};
+}
+
+void Parser::unexpectedToken() {
+    if (getCurrentToken() == TK_EOF) {
+        panic("SyntaxError: unexpected end of file\n");
+    }
+    panic("SyntaxError: unexpected token %.*s at line %d, col %d\n",
+          static_cast<int>(getCurrentLexeme().size()), getCurrentLexeme().data(),
+          currentToken.line, currentToken.column);
+}
+
+SourceToken Parser::next() {
+    // Whitespace and comment runs are skipped in bulk, see Scanner.hpp
+    for (;;) {
+        cursor = scanner::skipWhitespace(cursor, limit, start, lineStart);
+        if (cursor == limit || *cursor != '#') {
+            break;
         }
+        cursor = scanner::findLineEnd(cursor, limit);
     }
 
-    if (c >= '0' && c <= '9') {
-        std::string lexeme{c};
-        bool isDouble = false;
-        char cn = peekNextChar();
-        while ((cn >= '0' && cn <= '9') || (!isDouble && cn == '.')) {
-            if (c == '.') {
-                isDouble = true;
+    tokenLine = start;
+    tokenColumn = static_cast<int>(cursor - lineStart) + 1;
+    if (cursor == limit) {
+        return makeToken(TK_EOF, cursor);
+    }
+    const char *first = cursor;
+    char c = getNextChar();
+
+    if (scanner::isDigit(c)) {
+        cursor = scanner::scanDigits(cursor, limit);
+        if (cursor != limit && *cursor == '.') {
+            cursor = scanner::scanDigits(cursor + 1, limit);
+        }
+        // An exponent only counts when digits follow, so "2else" still
+        // lexes as a number and a keyword
+        if (cursor != limit && (*cursor == 'e' || *cursor == 'E')) {
+            const char *p = cursor + 1;
+            if (p != limit && (*p == '+' || *p == '-')) {
+                p++;
+            }
+            if (p != limit && scanner::isDigit(*p)) {
+                cursor = scanner::scanDigits(p, limit);
             }
-            c = getNextChar();
-            cn = peekNextChar();
-            lexeme += c;
         }
-        return !isDouble ? make_tuple(LIT_NUMBER, lexeme)
-                         : make_tuple(LIT_NUMBER, lexeme);
+        return makeToken(LIT_NUMBER, first);
     }
     if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') {
-        std::string lexeme{c};
-        char cn = peekNextChar();
-        while ((cn >= 'a' && cn <= 'z') || (cn >= 'A' && cn <= 'Z') ||
-               (cn >= '0' && cn <= '9') || cn == '_') {
-            c = getNextChar();
-            lexeme += c;
-            cn = peekNextChar();
-        }
-        auto result = keywords.find(lexeme);
-        return result != keywords.end()
-               ? std::make_tuple(result->second, lexeme)
-               : std::make_tuple(TK_IDENT, lexeme);
+        cursor = scanner::scanIdentifier(cursor, limit);
+        auto token = makeToken(TK_IDENT, first);
+        token.kind = keywordKind(token.lexeme);
+        return token;
     }
 
     if (c == '\'') {
-        std::string lexeme;
-        lexeme += getNextChar();
+        getNextChar();
         if (peekNextChar() != '\'') {
             panic(
-                    "SynxaxError: a character literal should surround with "
+                    "SyntaxError: a character literal should surround with "
                     "single-quote");
         }
-        c = getNextChar();
-        return std::make_tuple(LIT_STRING, lexeme);
+        getNextChar();
+        return makeToken(LIT_STRING, first + 1, cursor - 1);
     }
     if (c == '"') {
-        std::string lexeme;
-        char cn = peekNextChar();
-        while (cn != '"') {
-            c = getNextChar();
-            lexeme += c;
-            cn = peekNextChar();
-        }
-        c = getNextChar();
-        return std::make_tuple(LIT_STRING, lexeme);
-    }
-
-    if (c == '\'') {
-        std::string lexeme;
-        char cn = peekNextChar();
-        while (cn != '\'') {
-            c = getNextChar();
-            lexeme += c;
-            cn = peekNextChar();
+        const char *last = scanner::findQuote(cursor, limit, '"', start, lineStart);
+        if (last == limit) {
+            panic("SyntaxError: unterminated string literal at line %d\n", tokenLine);
         }
-        c = getNextChar();
-        return std::make_tuple(LIT_STRING, lexeme);
+        cursor = last + 1;
+        return makeToken(LIT_STRING, first + 1, last);
     }
 
     if (c == '[') {
-        return std::make_tuple(TK_LBRACKET, "[");
+        return makeToken(TK_LBRACKET, first);
     }
     if (c == ']') {
-        return std::make_tuple(TK_RBRACKET, "]");
+        return makeToken(TK_RBRACKET, first);
     }
     if (c == '{') {
-        return std::make_tuple(TK_LBRACE, "{");
+        return makeToken(TK_LBRACE, first);
     }
     if (c == '}') {
-        return std::make_tuple(TK_RBRACE, "}");
+        return makeToken(TK_RBRACE, first);
     }
     if (c == '(') {
-        return std::make_tuple(TK_LPAREN, "(");
+        return makeToken(TK_LPAREN, first);
     }
     if (c == ')') {
-        return std::make_tuple(TK_RPAREN, ")");
+        return makeToken(TK_RPAREN, first);
     }
     if (c == ',') {
-        return std::make_tuple(TK_COMMA, ",");
+        return makeToken(TK_COMMA, first);
     }
     if (c == '+') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_PLUS_AGN, "+=");
+            return makeToken(TK_PLUS_AGN, first);
         }
-        return std::make_tuple(TK_PLUS, "+");
+        return makeToken(TK_PLUS, first);
     }
     if (c == '-') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_MINUS_AGN, "-=");
+            return makeToken(TK_MINUS_AGN, first);
         }
-        return std::make_tuple(TK_MINUS, "-");
+        return makeToken(TK_MINUS, first);
     }
     if (c == '*') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_TIMES_AGN, "*=");
+            return makeToken(TK_TIMES_AGN, first);
         }
-        return std::make_tuple(TK_TIMES, "*");
+        return makeToken(TK_TIMES, first);
     }
     if (c == '/') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_DIV_AGN, "/=");
+            return makeToken(TK_DIV_AGN, first);
         }
-        return std::make_tuple(TK_DIV, "/");
+        return makeToken(TK_DIV, first);
     }
     if (c == '%') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_MOD_AGN, "%=");
+            return makeToken(TK_MOD_AGN, first);
         }
-        return std::make_tuple(TK_MOD, "%");
+        return makeToken(TK_MOD, first);
     }
     if (c == '~') {
-        return std::make_tuple(TK_BITNOT, "~");
+        return makeToken(TK_BITNOT, first);
     }
     if (c == '=') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_EQ, "==");
+            return makeToken(TK_EQ, first);
         }
-        return std::make_tuple(TK_ASSIGN, "=");
+        return makeToken(TK_ASSIGN, first);
     }
     if (c == '!') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_NE, "!=");
+            return makeToken(TK_NE, first);
         }
-        return std::make_tuple(TK_LOGNOT, "!");
+        return makeToken(TK_LOGNOT, first);
     }
     if (c == '|') {
         if (peekNextChar() == '|') {
             c = getNextChar();
-            return std::make_tuple(TK_LOGOR, "||");
+            return makeToken(TK_LOGOR, first);
         }
-        return std::make_tuple(TK_BITOR, "|");
+        return makeToken(TK_BITOR, first);
     }
     if (c == '&') {
         if (peekNextChar() == '&') {
             c = getNextChar();
-            return std::make_tuple(TK_LOGAND, "&&");
+            return makeToken(TK_LOGAND, first);
         }
-        return std::make_tuple(TK_BITAND, "&");
+        return makeToken(TK_BITAND, first);
     }
     if (c == '>') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_GE, ">=");
+            return makeToken(TK_GE, first);
         }
-        return std::make_tuple(TK_GT, ">");
+        return makeToken(TK_GT, first);
     }
     if (c == '<') {
         if (peekNextChar() == '=') {
             c = getNextChar();
-            return std::make_tuple(TK_LE, "<=");
+            return makeToken(TK_LE, first);
         }
-        return std::make_tuple(TK_LT, "<");
+        return makeToken(TK_LT, first);
     }
-    panic("SynxaxError: unknown token %c", c);
-    return std::make_tuple(INVALID, "invalid");
+    panic("SyntaxError: unknown token %c", c);
+    return makeToken(INVALID, first);
 }
 
 short Parser::precedence(Token op) {
@@ -0,0 +1,209 @@
+//
+// Created by chineseblack23 on 2024/6/27.
+//
+#include "Resolver.hpp"
+#include "Optimizer.hpp"
+#include "Utils.hpp"
+
+Resolver::Resolver(std::vector<apollo::Symbol> &globals) {
+    pushScope(globals);
+}
+
+void Resolver::resolveStatement(Statement *stmt) {
+    declare(stmt);
+    resolve(stmt);
+}
+
+void Resolver::resolveFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f) {
+    if (rt->shouldOptimize()) {
+        Optimizer(rt->getArena()).optimizeFunction(f);
+    }
+    auto *body = f->getBody();
+    Resolver resolver;
+    resolver.pushScope(body->locals);
+    f->paramSlots.clear();
+    for (auto &param: f->params) {
+        f->paramSlots.push_back(resolver.declare(param));
+    }
+    for (auto *stmt: body->stmts) {
+        resolver.declare(stmt);
+    }
+    for (auto *stmt: body->stmts) {
+        resolver.resolve(stmt);
+    }
+    f->resolved = true;
+}
+
+void Resolver::pushScope(std::vector<apollo::Symbol> &locals) {
+    // The scopes below are fully declared by now; the global scope and a
+    // function frame always have a context, even when empty
+    uint32_t depth = 0;
+    if (!scopes.empty()) {
+        auto &outer = scopes.back();
+        depth = outer.depth + (scopes.size() == 1 || !outer.locals->empty() ? 1 : 0);
+    }
+    Scope scope{&locals, {}, depth};
+    for (uint32_t i = 0; i < locals.size(); i++) {
+        scope.slots.emplace(locals[i], i);
+    }
+    scopes.push_back(std::move(scope));
+}
+
+uint32_t Resolver::declare(apollo::Symbol name) {
+    auto &scope = scopes.back();
+    auto [it, inserted] = scope.slots.emplace(name, static_cast<uint32_t>(scope.locals->size()));
+    if (inserted) {
+        scope.locals->push_back(name);
+    }
+    return it->second;
+}
+
+void Resolver::declare(Statement *stmt) {
+    // Nested blocks get contexts of their own, only conditions and
+    // expressions are evaluated in this one
+    switch (stmt->kind) {
+        case AST_EXPR_STMT:
+            declare(static_cast<ExpressionStmt *>(stmt)->expression);
+            break;
+        case AST_RETURN:
+            declare(static_cast<ReturnStmt *>(stmt)->expression);
+            break;
+        case AST_IF:
+            declare(static_cast<IfStmt *>(stmt)->cond);
+            break;
+        case AST_WHILE:
+            declare(static_cast<WhileStmt *>(stmt)->cond);
+            break;
+        default:
+            break;
+    }
+}
+
+void Resolver::declare(Expression *expr) {
+    if (expr == nullptr) {
+        return;
+    }
+    switch (expr->kind) {
+        case AST_ASSIGN: {
+            auto *assign = static_cast<AssignExpression *>(expr);
+            if (assign->leftExpression->kind == AST_IDENT) {
+                declare(static_cast<IdentExpression *>(assign->leftExpression)->identName);
+            } else if (assign->leftExpression->kind == AST_INDEX) {
+                auto *index = static_cast<IndexExpression *>(assign->leftExpression);
+                declare(index->identName);
+                declare(index->index);
+            }
+            declare(assign->rightExperssion);
+            break;
+        }
+        case AST_INDEX:
+            declare(static_cast<IndexExpression *>(expr)->index);
+            break;
+        case AST_BINARY:
+            declare(static_cast<BinaryExpression *>(expr)->leftExpression);
+            declare(static_cast<BinaryExpression *>(expr)->rightExpression);
+            break;
+        case AST_ARRAY:
+            for (auto *e: static_cast<ArrayExpression *>(expr)->literal) {
+                declare(e);
+            }
+            break;
+        case AST_FUNCALL:
+            for (auto *e: static_cast<FunCallExpression *>(expr)->args) {
+                declare(e);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void Resolver::resolve(Statement *stmt) {
+    switch (stmt->kind) {
+        case AST_EXPR_STMT:
+            resolve(static_cast<ExpressionStmt *>(stmt)->expression);
+            break;
+        case AST_RETURN:
+            resolve(static_cast<ReturnStmt *>(stmt)->expression);
+            break;
+        case AST_IF: {
+            auto *ifStmt = static_cast<IfStmt *>(stmt);
+            resolve(ifStmt->cond);
+            resolveBlock(ifStmt->blockStatement);
+            if (ifStmt->elseBlock != nullptr) {
+                resolveBlock(ifStmt->elseBlock);
+            }
+            break;
+        }
+        case AST_WHILE: {
+            // The condition is re-evaluated inside the loop's context, but a
+            // name it reads is always found further out (see WhileStmt)
+            auto *whileStmt = static_cast<WhileStmt *>(stmt);
+            resolve(whileStmt->cond);
+            resolveBlock(whileStmt->blockStatement);
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+void Resolver::resolve(Expression *expr) {
+    if (expr == nullptr) {
+        return;
+    }
+    switch (expr->kind) {
+        case AST_IDENT: {
+            auto *ident = static_cast<IdentExpression *>(expr);
+            ident->bindings = bind(ident->identName);
+            break;
+        }
+        case AST_INDEX: {
+            auto *index = static_cast<IndexExpression *>(expr);
+            index->bindings = bind(index->identName);
+            resolve(index->index);
+            break;
+        }
+        case AST_ASSIGN:
+            resolve(static_cast<AssignExpression *>(expr)->leftExpression);
+            resolve(static_cast<AssignExpression *>(expr)->rightExperssion);
+            break;
+        case AST_BINARY:
+            resolve(static_cast<BinaryExpression *>(expr)->leftExpression);
+            resolve(static_cast<BinaryExpression *>(expr)->rightExpression);
+            break;
+        case AST_ARRAY:
+            for (auto *e: static_cast<ArrayExpression *>(expr)->literal) {
+                resolve(e);
+            }
+            break;
+        case AST_FUNCALL:
+            for (auto *e: static_cast<FunCallExpression *>(expr)->args) {
+                resolve(e);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void Resolver::resolveBlock(struct apollo::BlockStatement *block) {
+    pushScope(block->locals);
+    for (auto *stmt: block->stmts) {
+        declare(stmt);
+    }
+    for (auto *stmt: block->stmts) {
+        resolve(stmt);
+    }
+    scopes.pop_back();
+}
+
+std::vector<apollo::SlotRef> Resolver::bind(apollo::Symbol name) const {
+    std::vector<apollo::SlotRef> bindings;
+    for (auto i = scopes.size(); i-- > 0;) {
+        if (auto it = scopes[i].slots.find(name); it != scopes[i].slots.end()) {
+            bindings.push_back(apollo::SlotRef{scopes[i].depth, it->second});
+        }
+    }
+    return bindings;
+}
@@ -0,0 +1,120 @@
+//
+// Created by chineseblack23 on 2024/6/23.
+//
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <utility>
+#include "SourceBuffer.hpp"
+#include "Utils.hpp"
+
+#if !defined(_WIN32)
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#endif
+
+SourceBuffer SourceBuffer::fromFile(const std::string &fileName) {
+    SourceBuffer source;
+    source.fileName = fileName;
+#if !defined(_WIN32)
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        panic("ParserError: can not open source file %s\n", fileName.c_str());
+    }
+    struct stat st{};
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (addr != MAP_FAILED) {
+            madvise(addr, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            source.buffer = static_cast<const char *>(addr);
+            source.length = st.st_size;
+            source.mapped = true;
+            return source;
+        }
+    }
+    close(fd);
+#endif
+    // Fallback: read the whole file into memory in one go
+    std::ifstream fs(fileName, std::ios::in | std::ios::binary);
+    if (!fs.is_open()) {
+        panic("ParserError: can not open source file %s\n", fileName.c_str());
+    }
+    std::ostringstream ss;
+    ss << fs.rdbuf();
+    source.storage = ss.str();
+    source.buffer = source.storage.data();
+    source.length = source.storage.size();
+    return source;
+}
+
+SourceBuffer SourceBuffer::fromString(std::string source, std::string name) {
+    SourceBuffer buf;
+    buf.fileName = std::move(name);
+    buf.storage = std::move(source);
+    buf.buffer = buf.storage.data();
+    buf.length = buf.storage.size();
+    return buf;
+}
+
+SourceBuffer::SourceBuffer(SourceBuffer &&other) noexcept {
+    *this = std::move(other);
+}
+
+SourceBuffer &SourceBuffer::operator=(SourceBuffer &&other) noexcept {
+    if (this == &other) {
+        return *this;
+    }
+    release();
+    mapped = other.mapped;
+    length = other.length;
+    fileName = std::move(other.fileName);
+    storage = std::move(other.storage);
+    // A moved std::string may relocate small buffers, so re-point into our copy
+    buffer = mapped ? other.buffer : storage.data();
+    discarded = mapped ? other.discarded : nullptr;
+
+    other.buffer = nullptr;
+    other.length = 0;
+    other.mapped = false;
+    return *this;
+}
+
+SourceBuffer::~SourceBuffer() { release(); }
+
+void SourceBuffer::discardBefore(const char *p) {
+#if !defined(_WIN32)
+    // Only worth a syscall once a few megabytes have been consumed
+    constexpr size_t discardGranularity = 4 << 20;
+    if (!mapped || p < buffer || p > buffer + length) {
+        return;
+    }
+    const char *from = discarded != nullptr ? discarded : buffer;
+    if (p <= from || static_cast<size_t>(p - from) < discardGranularity) {
+        return;
+    }
+    static const auto pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto to = reinterpret_cast<const char *>(reinterpret_cast<uintptr_t>(p) & ~(pageSize - 1));
+    if (to <= from) {
+        return;
+    }
+    madvise(const_cast<char *>(from), to - from, MADV_DONTNEED);
+    discarded = to;
+#endif
+}
+
+void SourceBuffer::release() {
+#if !defined(_WIN32)
+    if (mapped && buffer != nullptr) {
+        munmap(const_cast<char *>(buffer), length);
+    }
+#endif
+    buffer = nullptr;
+    length = 0;
+    mapped = false;
+    discarded = nullptr;
+}
@@ -0,0 +1,100 @@
+//
+// Created by chineseblack23 on 2024/6/28.
+//
+
+#include <array>
+#include <deque>
+#include <mutex>
+#include <vector>
+#include "Symbol.hpp"
+
+namespace apollo {
+
+    namespace {
+        /**
+         * Open addressing over (hash, name) pairs. A probe compares the
+         * stored hash first, so a lookup touches one slot and, on a match,
+         * the interned string itself; the strings sit in a deque, which
+         * keeps their addresses stable as the table grows.
+         */
+        struct SymbolTable {
+            struct Entry {
+                size_t hash;
+                const std::string *name;
+            };
+
+            std::mutex lock;
+            std::deque<std::string> names;
+            std::vector<Entry> index = std::vector<Entry>(64);
+
+            const std::string *find(std::string_view text, size_t hash) {
+                size_t mask = index.size() - 1;
+                for (size_t i = hash & mask;; i = (i + 1) & mask) {
+                    auto &e = index[i];
+                    if (e.name == nullptr) {
+                        // Keep the load factor under one half
+                        if (names.size() * 2 >= index.size()) {
+                            grow();
+                            return find(text, hash);
+                        }
+                        e = {hash, &names.emplace_back(text)};
+                        return e.name;
+                    }
+                    if (e.hash == hash && *e.name == text) {
+                        return e.name;
+                    }
+                }
+            }
+
+            void grow() {
+                std::vector<Entry> bigger(index.size() * 2);
+                size_t mask = bigger.size() - 1;
+                for (auto &e: index) {
+                    if (e.name != nullptr) {
+                        size_t i = e.hash & mask;
+                        while (bigger[i].name != nullptr) {
+                            i = (i + 1) & mask;
+                        }
+                        bigger[i] = e;
+                    }
+                }
+                index.swap(bigger);
+            }
+        };
+
+        // The names are split over shards by the top bits of their hash,
+        // each with a lock of its own, so parallel parses rarely wait on
+        // one another
+        constexpr size_t shardBits = 6;
+
+        SymbolTable &symbolTable(size_t hash) {
+            static std::array<SymbolTable, size_t{1} << shardBits> shards;
+            return shards[hash >> (sizeof(size_t) * 8 - shardBits)];
+        }
+
+        // Names a thread interned lately, found again without any lock:
+        // the strings they point to never change or move
+        struct RecentSymbols {
+            static constexpr size_t size = 2048;
+            std::array<SymbolTable::Entry, size> entries{};
+        };
+
+        thread_local RecentSymbols recent;
+    }
+
+    Symbol Symbol::intern(std::string_view text) {
+        if (text.empty()) {
+            return {};
+        }
+        size_t hash = std::hash<std::string_view>{}(text);
+        auto &cached = recent.entries[hash & (RecentSymbols::size - 1)];
+        if (cached.name != nullptr && cached.hash == hash && *cached.name == text) {
+            return Symbol(cached.name);
+        }
+        auto &table = symbolTable(hash);
+        std::lock_guard<std::mutex> guard(table.lock);
+        cached = {hash, table.find(text, hash)};
+        return Symbol(cached.name);
+    }
+
+}
@@ -1,21 +1,37 @@
 //
 // Created by chineseblack23 on 2024/6/22.
 //
+#include <atomic>
+#include <charconv>
+#include <cmath>
 #include <cstdarg>
+#include <cstdio>
+#include <thread>
+#include <utility>
 #include "apollo.hpp"
 #include "Utils.hpp"
 
-std::string valueToStdString(apollo::ValueDeclaration v) {
+std::string valueToStdString(const apollo::ValueDeclaration &v) {
     switch (v.type) {
         case apollo::Boolean:
-            return v.castingType<bool>() ? "true" : "false";
-        case apollo::Number:
-            return std::to_string(v.castingType<int>());
+            return v.asBool() ? "true" : "false";
+        case apollo::Integer:
+            return std::to_string(v.asInteger());
+        case apollo::Number: {
+            // Integral values print without a fraction, others in the
+            // shortest form that reads back to the same value
+            auto d = v.asNumber();
+            char buf[32];
+            auto res = std::abs(d) < 1e15 && d == std::floor(d)
+                       ? std::to_chars(buf, buf + sizeof(buf), static_cast<long long>(d))
+                       : std::to_chars(buf, buf + sizeof(buf), d);
+            return std::string(buf, res.ptr);
+        }
         case apollo::Null:
             return "null";
         case apollo::Array: {
             std::string str = "[";
-            auto elements = v.castingType<std::vector<apollo::ValueDeclaration>>();
+            auto &elements = v.asArray();
             for (int i = 0; i < elements.size(); i++) {
                 str += valueToStdString(elements[i]);
 
@@ -27,12 +43,14 @@ std::string valueToStdString(apollo::ValueDeclaration v) {
             return str;
         }
         case apollo::String:
-            return v.castingType<std::string>();
+            return std::string(v.asString());
+        default:
+            break;
     }
     return "unknown";
 }
 
-std::string repeatString(int count, const std::string& str) {
+std::string repeatString(int count, std::string_view str) {
     std::string result;
     for (int i = 0; i < count; i++) {
         result += str;
@@ -48,10 +66,53 @@ std::vector<apollo::ValueDeclaration> repeatArray(int count, std::vector<apollo:
     return result;
 }
 
+namespace {
+    thread_local int panicCaptures = 0;
+}
+
+PanicCapture::PanicCapture() { panicCaptures++; }
+
+PanicCapture::~PanicCapture() { panicCaptures--; }
+
 [[noreturn]] void panic(char const* const format, ...) {
     va_list args;
     va_start(args, format);
+    if (panicCaptures > 0) {
+        va_list copy;
+        va_copy(copy, args);
+        int length = vsnprintf(nullptr, 0, format, copy);
+        va_end(copy);
+        std::string message(length > 0 ? static_cast<size_t>(length) : 0, '\0');
+        vsnprintf(message.data(), message.size() + 1, format, args);
+        va_end(args);
+        throw PanicError{std::move(message)};
+    }
     vfprintf(stdout, format, args);
     va_end(args);
     exit(EXIT_FAILURE);
 }
+
+
+void parallelFor(size_t count, const std::function<void(size_t)>& body) {
+    size_t workers = std::min<size_t>(count, std::max(1u, std::thread::hardware_concurrency()));
+    if (workers <= 1) {
+        for (size_t i = 0; i < count; i++) {
+            body(i);
+        }
+        return;
+    }
+    std::atomic<size_t> nextIndex{0};
+    auto work = [&]() {
+        for (size_t i; (i = nextIndex.fetch_add(1)) < count;) {
+            body(i);
+        }
+    };
+    std::vector<std::thread> pool;
+    for (size_t i = 1; i < workers; i++) {
+        pool.emplace_back(work);
+    }
+    work();
+    for (auto& t : pool) {
+        t.join();
+    }
+}
\ No newline at end of file
@@ -0,0 +1,551 @@
+//
+// Created by chineseblack23 on 2024/6/29.
+//
+#include <cmath>
+#include "VirtualMachine.hpp"
+#include "Compiler.hpp"
+#include "Interpreter.hpp"
+#include "Utils.hpp"
+
+// Threaded dispatch where labels as values are available: each handler
+// jumps straight to the next one instead of going back to a switch
+#if defined(__GNUC__) || defined(__clang__)
+#define APOLLO_THREADED
+#endif
+
+using apollo::Instruction;
+using apollo::ValueDeclaration;
+
+void VirtualMachine::undefinedVariable(AbstractSyntaxTreeNode *origin) {
+    const char *name = "";
+    if (origin->kind == AST_IDENT) {
+        name = static_cast<IdentExpression *>(origin)->identName.c_str();
+    } else if (origin->kind == AST_INDEX) {
+        name = static_cast<IndexExpression *>(origin)->identName.c_str();
+    } else if (origin->kind == AST_ASSIGN) {
+        auto *left = static_cast<AssignExpression *>(origin)->leftExpression;
+        name = left->kind == AST_IDENT ? static_cast<IdentExpression *>(left)->identName.c_str()
+                                       : static_cast<IndexExpression *>(left)->identName.c_str();
+    }
+    panic("RuntimeError: use of undefined variable \"%s\" at line %d, col %d\n",
+          name, origin->start, origin->end);
+}
+
+void VirtualMachine::notBool(AbstractSyntaxTreeNode *origin) {
+    panic("TypeError: expects bool type in while condition at line %d, col %d\n",
+          origin->start, origin->end);
+}
+
+ValueDeclaration VirtualMachine::getIndex(const ValueDeclaration &var, const ValueDeclaration &idx,
+                                          IndexExpression *origin) {
+    if (!idx.isNumber()) {
+        panic("TypeError: expects int type within indexing expression at line %d, col %d\n",
+              origin->start, origin->end);
+    }
+    if (!var.isType<apollo::Array>()) {
+        panic("TypeError: expects array type of variable %s at line %d, col %d\n",
+              origin->identName.c_str(), origin->start, origin->end);
+    }
+    auto &elements = var.asArray();
+    if (idx.toDouble() < 0 || idx.toDouble() >= static_cast<double>(elements.size())) {
+        panic("IndexError: index %d out of range at line %d, col %d\n",
+              static_cast<int>(idx.toDouble()), origin->start, origin->end);
+    }
+    return elements[static_cast<size_t>(idx.toDouble())];
+}
+
+void VirtualMachine::setIndex(ValueDeclaration &var, const ValueDeclaration &idx, ValueDeclaration rhs, Token opt,
+                              AssignExpression *origin) {
+    auto *indexExpr = static_cast<IndexExpression *>(origin->leftExpression);
+    if (!idx.isNumber()) {
+        panic("TypeError: expects int type when applying indexing to variable %s at line %d, col %d\n",
+              indexExpr->identName.c_str(), origin->start, origin->end);
+    }
+    if (var.isType<apollo::Undefined>()) {
+        var = std::move(rhs);
+        return;
+    }
+    if (!var.isType<apollo::Array>()) {
+        panic("TypeError: expects array type of variable %s at line %d, col %d\n",
+              indexExpr->identName.c_str(), origin->start, origin->end);
+    }
+    if (idx.toDouble() < 0 || idx.toDouble() >= static_cast<double>(var.asArray().size())) {
+        panic("IndexError: index %d out of range at line %d, col %d\n",
+              static_cast<int>(idx.toDouble()), origin->start, origin->end);
+    }
+    auto &elements = var.mutableArray();
+    auto i = static_cast<size_t>(idx.toDouble());
+    elements[i] = Interpreter::assignSwitch(opt, std::move(elements[i]), std::move(rhs));
+}
+
+void VirtualMachine::assignTo(ValueDeclaration &var, ValueDeclaration rhs, Token opt) {
+    if (var.isType<apollo::Undefined>()) {
+        var = std::move(rhs);
+    } else if (opt == TK_PLUS_AGN && var.isType<apollo::Array>() && !rhs.isType<apollo::String>()) {
+        var.mutableArray().push_back(std::move(rhs));
+    } else {
+        var = Interpreter::assignSwitch(opt, std::move(var), std::move(rhs));
+    }
+}
+
+VirtualMachine::VirtualMachine(apollo::Runtime *rt, apollo::ContextChain &ctxChain) : rt(rt), ctxChain(&ctxChain) {}
+
+VirtualMachine::~VirtualMachine() {
+    for (auto &code: functions) {
+        code->function->bytecode = nullptr;
+    }
+}
+
+const apollo::Bytecode *VirtualMachine::compiled(apollo::FunctionDeclaration *f) {
+    if (f->bytecode == nullptr && uncompiled.count(f) == 0) {
+        auto code = Compiler::compileFunction(rt, f);
+        if (code == nullptr) {
+            uncompiled.insert(f);
+            return nullptr;
+        }
+        functions.push_back(std::move(code));
+        f->bytecode = functions.back().get();
+    }
+    return f->bytecode;
+}
+
+void VirtualMachine::reserve(size_t size) {
+    if (registers.size() < size) {
+        registers.resize(std::max(size, registers.size() * 2));
+    }
+}
+
+void VirtualMachine::storeGlobals(apollo::Context *globals) {
+    globals->growSlots();
+    for (uint32_t i = 0; i < globalCount; i++) {
+        if (!registers[i].isType<apollo::Undefined>()) {
+            globals->createVariable(i, registers[i]);
+        }
+    }
+}
+
+void VirtualMachine::run(const apollo::Bytecode &program) {
+    reserve(program.frameSize);
+    // Globals new since the last run and the block variables start undefined
+    for (auto i = globalCount; i < program.variableCount; i++) {
+        registers[i] = ValueDeclaration(apollo::Undefined);
+    }
+    globalCount = program.globalCount;
+
+    const apollo::Bytecode *code = &program;
+    const Instruction *pc = code->code.data();
+    const ValueDeclaration *K = code->constants.data();
+    size_t base = 0;
+    ValueDeclaration *R = registers.data();
+
+#ifdef APOLLO_THREADED
+#define CASE(op) L_##op:
+#define DISPATCH() goto *labels[pc->op]
+#define NEXT() pc++; DISPATCH()
+#else
+#define CASE(op) case apollo::op:
+#define DISPATCH() continue
+#define NEXT() break
+#endif
+
+#define ORIGIN() (code->origins[pc - code->code.data()])
+#define JUMP() pc = code->code.data() + pc->bx(); DISPATCH()
+#define INDEX() static_cast<uint32_t>(pc - code->code.data())
+// Hands the frame to its machine code from instruction index on, and goes
+// on interpreting at the instruction that code stops at
+#define ENTER(index) pc = code->code.data() + code->native->run(R, K, index); DISPATCH()
+// A backward jump closes a loop iteration, which warms the code up
+#define BACK_EDGE() if (pc->bx() < INDEX() && warm(code, 1)) { ENTER(pc->bx()); }
+// After a call, compiled code takes over again
+#define RESUME() if (code->native != nullptr) { ENTER(INDEX() + 1); } NEXT()
+#define SLOW_BINARY(token, l, r) \
+    R[pc->a] = Interpreter::evalBinary(l, token, r, ORIGIN()->start, ORIGIN()->end)
+#define ARITH(checked, op, token, rhs) {                                                        \
+        auto &l = R[pc->b];                                                                     \
+        auto &r = rhs;                                                                          \
+        int64_t v;                                                                              \
+        if (l.type == apollo::Integer && r.type == apollo::Integer &&                           \
+            checked(l.asInteger(), r.asInteger(), v)) {                                         \
+            R[pc->a] = ValueDeclaration::fromInteger(v);                                        \
+        } else if (l.type == apollo::Number && r.type == apollo::Number) {                      \
+            R[pc->a] = ValueDeclaration::fromNumber(l.asNumber() op r.asNumber());              \
+        } else {                                                                                \
+            SLOW_BINARY(token, l, r);                                                           \
+        }                                                                                       \
+        NEXT();                                                                                 \
+    }
+#define DIVIDE(rhs) {                                                                           \
+        auto &l = R[pc->b];                                                                     \
+        auto &r = rhs;                                                                          \
+        if (l.type == apollo::Integer && r.type == apollo::Integer && r.asInteger() != 0 &&     \
+            !(r.asInteger() == -1 && l.asInteger() == INT64_MIN) &&                             \
+            l.asInteger() % r.asInteger() == 0) {                                               \
+            R[pc->a] = ValueDeclaration::fromInteger(l.asInteger() / r.asInteger());            \
+        } else if (l.type == apollo::Number && r.type == apollo::Number) {                      \
+            R[pc->a] = ValueDeclaration::fromNumber(l.asNumber() / r.asNumber());               \
+        } else {                                                                                \
+            SLOW_BINARY(TK_DIV, l, r);                                                          \
+        }                                                                                       \
+        NEXT();                                                                                 \
+    }
+#define MODULO(rhs) {                                                                           \
+        auto &l = R[pc->b];                                                                     \
+        auto &r = rhs;                                                                          \
+        if (l.type == apollo::Integer && r.type == apollo::Integer && r.asInteger() != 0) {     \
+            R[pc->a] = ValueDeclaration::fromInteger(                                           \
+                    r.asInteger() == -1 ? 0 : l.asInteger() % r.asInteger());                   \
+        } else {                                                                                \
+            SLOW_BINARY(TK_MOD, l, r);                                                          \
+        }                                                                                       \
+        NEXT();                                                                                 \
+    }
+#define COMPARE(op, token, rhs) {                                                               \
+        auto &l = R[pc->b];                                                                     \
+        auto &r = rhs;                                                                          \
+        if (l.type == apollo::Integer && r.type == apollo::Integer) {                           \
+            R[pc->a] = ValueDeclaration::fromBool(l.asInteger() op r.asInteger());              \
+        } else if (l.isNumber() && r.isNumber()) {                                              \
+            R[pc->a] = ValueDeclaration::fromBool(l.toDouble() op r.toDouble());                \
+        } else {                                                                                \
+            SLOW_BINARY(token, l, r);                                                           \
+        }                                                                                       \
+        NEXT();                                                                                 \
+    }
+#define BITWISE(op, token) {                                                                    \
+        auto &l = R[pc->b];                                                                     \
+        auto &r = R[pc->c];                                                                     \
+        if (l.type == apollo::Integer && r.type == apollo::Integer) {                           \
+            R[pc->a] = ValueDeclaration::fromInteger(l.asInteger() op r.asInteger());           \
+        } else {                                                                                \
+            SLOW_BINARY(token, l, r);                                                           \
+        }                                                                                       \
+        NEXT();                                                                                 \
+    }
+
+#ifdef APOLLO_THREADED
+    static void *const labels[] = {
+            &&L_OP_LOADK,
+            &&L_OP_LOADNULL,
+            &&L_OP_LOADBOOL,
+            &&L_OP_MOVE,
+            &&L_OP_TAKE,
+            &&L_OP_CHECKVAR,
+            &&L_OP_UNDEFINED,
+            &&L_OP_CLEAR,
+            &&L_OP_JMP,
+            &&L_OP_JDEF,
+            &&L_OP_JFALSE,
+            &&L_OP_JTRUE,
+            &&L_OP_ADD,
+            &&L_OP_SUB,
+            &&L_OP_MUL,
+            &&L_OP_DIV,
+            &&L_OP_MOD,
+            &&L_OP_AND,
+            &&L_OP_OR,
+            &&L_OP_EQ,
+            &&L_OP_NE,
+            &&L_OP_GT,
+            &&L_OP_GE,
+            &&L_OP_LT,
+            &&L_OP_LE,
+            &&L_OP_BITAND,
+            &&L_OP_BITOR,
+            &&L_OP_ADDK,
+            &&L_OP_SUBK,
+            &&L_OP_MULK,
+            &&L_OP_DIVK,
+            &&L_OP_MODK,
+            &&L_OP_EQK,
+            &&L_OP_NEK,
+            &&L_OP_GTK,
+            &&L_OP_GEK,
+            &&L_OP_LTK,
+            &&L_OP_LEK,
+            &&L_OP_NEG,
+            &&L_OP_NOT,
+            &&L_OP_BITNOT,
+            &&L_OP_ADDTO,
+            &&L_OP_ADDTOK,
+            &&L_OP_ASSIGNOP,
+            &&L_OP_GETINDEX,
+            &&L_OP_SETINDEX,
+            &&L_OP_NEWARRAY,
+            &&L_OP_BIND,
+            &&L_OP_CALL,
+            &&L_OP_RETURN
+    };
+    static_assert(sizeof(labels) / sizeof(labels[0]) == apollo::OP_RETURN + 1);
+    DISPATCH();
+#else
+    for (;;) {
+        switch (pc->op) {
+#endif
+            CASE(OP_LOADK)
+                R[pc->a] = K[pc->bx()];
+                NEXT();
+            CASE(OP_LOADNULL)
+                R[pc->a] = ValueDeclaration(apollo::Null);
+                NEXT();
+            CASE(OP_LOADBOOL)
+                R[pc->a] = ValueDeclaration::fromBool(pc->b != 0);
+                NEXT();
+            CASE(OP_MOVE)
+                R[pc->a] = R[pc->b];
+                NEXT();
+            CASE(OP_TAKE)
+                R[pc->a] = std::move(R[pc->b]);
+                NEXT();
+            CASE(OP_CHECKVAR)
+                if (R[pc->a].isType<apollo::Undefined>()) {
+                    undefinedVariable(ORIGIN());
+                }
+                NEXT();
+            CASE(OP_UNDEFINED)
+                undefinedVariable(ORIGIN());
+            CASE(OP_CLEAR)
+                for (uint32_t i = 0; i < pc->b; i++) {
+                    R[pc->a + i] = ValueDeclaration(apollo::Undefined);
+                }
+                NEXT();
+
+            CASE(OP_JMP)
+                BACK_EDGE();
+                JUMP();
+            CASE(OP_JDEF)
+                if (!R[pc->a].isType<apollo::Undefined>()) {
+                    JUMP();
+                }
+                NEXT();
+            CASE(OP_JFALSE)
+                if (!R[pc->a].isType<apollo::Boolean>()) {
+                    notBool(ORIGIN());
+                }
+                if (!R[pc->a].asBool()) {
+                    JUMP();
+                }
+                NEXT();
+            CASE(OP_JTRUE)
+                if (!R[pc->a].isType<apollo::Boolean>()) {
+                    notBool(ORIGIN());
+                }
+                if (R[pc->a].asBool()) {
+                    BACK_EDGE();
+                    JUMP();
+                }
+                NEXT();
+
+            CASE(OP_ADD) ARITH(checkedAdd, +, TK_PLUS, R[pc->c])
+            CASE(OP_SUB) ARITH(checkedSub, -, TK_MINUS, R[pc->c])
+            CASE(OP_MUL) ARITH(checkedMul, *, TK_TIMES, R[pc->c])
+            CASE(OP_DIV) DIVIDE(R[pc->c])
+            CASE(OP_MOD) MODULO(R[pc->c])
+            CASE(OP_AND)
+                SLOW_BINARY(TK_LOGAND, R[pc->b], R[pc->c]);
+                NEXT();
+            CASE(OP_OR)
+                SLOW_BINARY(TK_LOGOR, R[pc->b], R[pc->c]);
+                NEXT();
+            CASE(OP_EQ) COMPARE(==, TK_EQ, R[pc->c])
+            CASE(OP_NE) COMPARE(!=, TK_NE, R[pc->c])
+            CASE(OP_GT) COMPARE(>, TK_GT, R[pc->c])
+            CASE(OP_GE) COMPARE(>=, TK_GE, R[pc->c])
+            CASE(OP_LT) COMPARE(<, TK_LT, R[pc->c])
+            CASE(OP_LE) COMPARE(<=, TK_LE, R[pc->c])
+            CASE(OP_BITAND) BITWISE(&, TK_BITAND)
+            CASE(OP_BITOR) BITWISE(|, TK_BITOR)
+
+            CASE(OP_ADDK) ARITH(checkedAdd, +, TK_PLUS, K[pc->c])
+            CASE(OP_SUBK) ARITH(checkedSub, -, TK_MINUS, K[pc->c])
+            CASE(OP_MULK) ARITH(checkedMul, *, TK_TIMES, K[pc->c])
+            CASE(OP_DIVK) DIVIDE(K[pc->c])
+            CASE(OP_MODK) MODULO(K[pc->c])
+            CASE(OP_EQK) COMPARE(==, TK_EQ, K[pc->c])
+            CASE(OP_NEK) COMPARE(!=, TK_NE, K[pc->c])
+            CASE(OP_GTK) COMPARE(>, TK_GT, K[pc->c])
+            CASE(OP_GEK) COMPARE(>=, TK_GE, K[pc->c])
+            CASE(OP_LTK) COMPARE(<, TK_LT, K[pc->c])
+            CASE(OP_LEK) COMPARE(<=, TK_LE, K[pc->c])
+
+            CASE(OP_NEG) {
+                auto &x = R[pc->b];
+                if (x.type == apollo::Integer && x.asInteger() != INT64_MIN) {
+                    R[pc->a] = ValueDeclaration::fromInteger(-x.asInteger());
+                } else {
+                    SLOW_BINARY(TK_MINUS, x, ValueDeclaration(apollo::Null));
+                }
+                NEXT();
+            }
+            CASE(OP_NOT) {
+                auto &x = R[pc->b];
+                if (x.type == apollo::Boolean) {
+                    R[pc->a] = ValueDeclaration::fromBool(!x.asBool());
+                } else {
+                    SLOW_BINARY(TK_LOGNOT, x, ValueDeclaration(apollo::Null));
+                }
+                NEXT();
+            }
+            CASE(OP_BITNOT)
+                SLOW_BINARY(TK_BITNOT, R[pc->b], ValueDeclaration(apollo::Null));
+                NEXT();
+
+            CASE(OP_ADDTO) {
+                auto &var = R[pc->a];
+                auto &rhs = R[pc->b];
+                int64_t v;
+                if (var.type == apollo::Integer && rhs.type == apollo::Integer &&
+                    checkedAdd(var.asInteger(), rhs.asInteger(), v)) {
+                    var = ValueDeclaration::fromInteger(v);
+                } else {
+                    // Copied first, it may be the variable itself
+                    assignTo(var, rhs, TK_PLUS_AGN);
+                }
+                NEXT();
+            }
+            CASE(OP_ADDTOK) {
+                auto &var = R[pc->a];
+                int64_t v;
+                if (var.type == apollo::Integer && K[pc->b].type == apollo::Integer &&
+                    checkedAdd(var.asInteger(), K[pc->b].asInteger(), v)) {
+                    var = ValueDeclaration::fromInteger(v);
+                } else {
+                    assignTo(var, K[pc->b], TK_PLUS_AGN);
+                }
+                NEXT();
+            }
+            CASE(OP_ASSIGNOP)
+                assignTo(R[pc->a], R[pc->b], static_cast<Token>(pc->k));
+                NEXT();
+            CASE(OP_GETINDEX) {
+                auto &var = R[pc->b];
+                auto &idx = R[pc->c];
+                if (var.type == apollo::Array && idx.type == apollo::Integer &&
+                    static_cast<uint64_t>(idx.asInteger()) < var.asArray().size()) {
+                    // Copied out first, the array may live in the destination
+                    ValueDeclaration element = var.asArray()[idx.asInteger()];
+                    R[pc->a] = std::move(element);
+                } else {
+                    R[pc->a] = getIndex(var, idx, static_cast<IndexExpression *>(ORIGIN()));
+                }
+                NEXT();
+            }
+            CASE(OP_SETINDEX)
+                setIndex(R[pc->a], R[pc->b], R[pc->c], static_cast<Token>(pc->k),
+                         static_cast<AssignExpression *>(ORIGIN()));
+                NEXT();
+            CASE(OP_NEWARRAY) {
+                std::vector<ValueDeclaration> elements;
+                elements.reserve(pc->c);
+                for (uint32_t i = 0; i < pc->c; i++) {
+                    elements.push_back(std::move(R[pc->b + i]));
+                }
+                R[pc->a] = ValueDeclaration::fromArray(std::move(elements));
+                NEXT();
+            }
+
+            CASE(OP_BIND) {
+                auto *site = code->calls[pc->bx()];
+                if (site->cachedEpoch != rt->getFunctionEpoch()) {
+                    site->bindTarget(rt);
+                }
+                NEXT();
+            }
+            CASE(OP_CALL) {
+                auto *site = code->calls[pc->bx()];
+                if (site->cachedEpoch != rt->getFunctionEpoch()) {
+                    site->bindTarget(rt);
+                }
+                auto argc = site->args.size();
+                if (site->cachedBuiltin != nullptr) {
+                    auto *args = R + pc->a;
+                    auto result = site->cachedBuiltin(rt, *ctxChain, std::span(args, argc));
+                    for (size_t i = 1; i < argc; i++) {
+                        args[i] = ValueDeclaration(apollo::Null);
+                    }
+                    args[0] = std::move(result);
+                    RESUME();
+                }
+                auto *callee = compiled(site->cachedFunction);
+                if (callee == nullptr) {
+                    // Left to the tree walker, which takes the arguments as a builtin does
+                    auto *args = R + pc->a;
+                    auto result = Interpreter::callFunction(rt, site->cachedFunction, *ctxChain,
+                                                            std::span(args, argc));
+                    for (size_t i = 1; i < argc; i++) {
+                        args[i] = ValueDeclaration(apollo::Null);
+                    }
+                    args[0] = std::move(result);
+                    RESUME();
+                }
+                frames.push_back(Frame{code, pc, base});
+                base += pc->a;
+                reserve(base + callee->frameSize);
+                R = registers.data() + base;
+                if (argc != callee->paramCount) {
+                    // A repeated parameter name keeps the first argument
+                    auto &slots = callee->function->paramSlots;
+                    uint32_t next = 0;
+                    for (uint32_t i = 0; i < argc; i++) {
+                        if (slots[i] == next) {
+                            if (i != next) {
+                                R[next] = std::move(R[i]);
+                            }
+                            next++;
+                        }
+                    }
+                }
+                for (auto i = callee->paramCount; i < std::max<size_t>(argc, callee->variableCount); i++) {
+                    R[i] = ValueDeclaration(apollo::Undefined);
+                }
+                code = callee;
+                K = code->constants.data();
+                pc = code->code.data();
+                if (warm(code, Jit::callWeight)) {
+                    ENTER(0);
+                }
+                DISPATCH();
+            }
+            CASE(OP_RETURN) {
+                if (frames.empty()) {
+                    // Temporaries of top-level code are not kept alive
+                    for (auto i = code->variableCount; i < code->frameSize; i++) {
+                        R[i] = ValueDeclaration(apollo::Null);
+                    }
+                    return;
+                }
+                ValueDeclaration result = std::move(R[pc->a]);
+                for (uint32_t i = 0; i < code->frameSize; i++) {
+                    R[i] = ValueDeclaration(apollo::Null);
+                }
+                auto &frame = frames.back();
+                code = frame.code;
+                pc = frame.pc;
+                base = frame.base;
+                frames.pop_back();
+                K = code->constants.data();
+                R = registers.data() + base;
+                R[pc->a] = std::move(result);
+                RESUME();
+            }
+#ifndef APOLLO_THREADED
+        }
+        pc++;
+    }
+#endif
+
+#undef ORIGIN
+#undef CASE
+#undef DISPATCH
+#undef NEXT
+#undef JUMP
+#undef INDEX
+#undef ENTER
+#undef BACK_EDGE
+#undef RESUME
+#undef SLOW_BINARY
+#undef ARITH
+#undef DIVIDE
+#undef MODULO
+#undef COMPARE
+#undef BITWISE
+}
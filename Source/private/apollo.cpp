@@ -1,421 +1,558 @@
 //
 // Created by chineseblack23 on 2024/6/22.
 //
+#include <cmath>
 #include "apollo.hpp"
+#include "AstCache.hpp"
 #include "Utils.hpp"
 
 namespace apollo {
-    Context::~Context() {
-        for (auto v: vars) {
-            delete v.second;
+    Context::Context(const std::vector<Symbol> *locals) : locals(locals), slots(locals->size()) {}
+
+    Context::~Context() = default;
+
+    void Context::reset(const std::vector<Symbol> *locals) {
+        this->locals = locals;
+        slots.resize(locals->size());
+    }
+
+    void Context::clear() {
+        slots.clear();
+    }
+
+    ContextStack::~ContextStack() {
+        for (auto *ctx: live) {
+            delete ctx;
         }
+        for (auto *ctx: pool) {
+            delete ctx;
+        }
+    }
+
+    Context *ContextStack::acquire(const std::vector<Symbol> *locals) {
+        if (pool.empty()) {
+            return new Context(locals);
+        }
+        auto *ctx = pool.back();
+        pool.pop_back();
+        ctx->reset(locals);
+        return ctx;
+    }
+
+    void ContextStack::release(Context *ctx) {
+        ctx->clear();
+        pool.push_back(ctx);
     }
 
     Runtime::Runtime() {
+        arenas.push_back(std::make_unique<AstArena>());
+    }
+
+    Runtime::~Runtime() = default;
+
+    void Runtime::adoptImage(std::unique_ptr<AstImage> image) {
+        images.push_back(std::move(image));
+    }
+
+    FunctionDeclaration *Runtime::adoptFunction(std::unique_ptr<FunctionDeclaration> f) {
+        declarations.push_back(std::move(f));
+        return declarations.back().get();
+    }
 
+    void Runtime::releaseSyntaxTrees() {
+        for (auto &f: declarations) {
+            f->body = nullptr;
+            f->retExpr = nullptr;
+            f->image = nullptr;
+        }
+        stmts.clear();
+        stmts.shrink_to_fit();
+        for (auto &arena: arenas) {
+            arena->reset();
+        }
+        images.clear();
     }
 
-    bool Runtime::hasBuiltinFunctionDeclaration(const string &name) {
+    void Runtime::absorb(Runtime &unit) {
+        // Not the map's order, so the first conflict reported is the same
+        // on every run
+        for (auto &f: unit.declarations) {
+            if (hasFunction(f->id.name)) {
+                panic("SyntaxError: multiply function definitions of %s found\n", f->id.name.c_str());
+            }
+            addFunction(f->id.name, f.get());
+        }
+        stmts.insert(stmts.end(), unit.stmts.begin(), unit.stmts.end());
+        for (auto &arena: unit.arenas) {
+            arenas.push_back(std::move(arena));
+        }
+        for (auto &image: unit.images) {
+            images.push_back(std::move(image));
+        }
+        for (auto &f: unit.declarations) {
+            declarations.push_back(std::move(f));
+        }
+        unit.funcs.clear();
+        unit.stmts.clear();
+        unit.arenas.clear();
+        unit.images.clear();
+        unit.declarations.clear();
+        unit.arenas.push_back(std::make_unique<AstArena>());
+    }
+
+    struct BlockStatement *FunctionDeclaration::getBody() {
+        if (body == nullptr && image != nullptr) {
+            body = image->loadBody(imageBody);
+            image = nullptr;
+        }
+        return body;
+    }
+
+    bool Runtime::hasBuiltinFunctionDeclaration(Symbol name) {
         return builtin.count(name) == 1;
     }
 
-    Runtime::BuiltinFuncType Runtime::getBuiltinFunctionDeclaration(const string &name) {
+    Runtime::BuiltinFuncType Runtime::getBuiltinFunctionDeclaration(Symbol name) {
         if (auto res = builtin.find(name); res != builtin.end()) {
             return res->second;
         }
-        return builtin[name];
+        return nullptr;
     }
 
-    void Runtime::addStatement(Statement *stmt) { stmts.push_back(stmt); }
-
-    std::vector<Statement *> Runtime::getStatements() { return stmts; }
-
-    bool Context::hasVariable(const std::string &identName) {
-        return vars.count(identName) == 1;
+    void Runtime::registerBuiltin(const string &name, BuiltinFuncType f) {
+        builtin[Symbol::intern(name)] = f;
+        functionEpoch++;
     }
 
-    void Context::createVariable(const std::string &identName, ValueDeclaration value) {
-        auto *var = new VariableDeclaration;
-        var->id.name = identName;
-        var->value = value;
-        vars.emplace(identName, var);
+    void Runtime::addStatement(Statement *stmt) { stmts.push_back(stmt); }
+
+    bool Context::hasVariable(Symbol identName) {
+        return getVariable(identName) != nullptr;
     }
 
-    VariableDeclaration *Context::getVariable(const string &identName) {
-        if (auto res = vars.find(identName); res != vars.end()) {
-            return res->second;
+    ValueDeclaration *Context::getVariable(Symbol identName) {
+        // Only for lookups by name from outside the interpreter loop, resolved
+        // code goes through the slot directly
+        for (size_t i = 0; i < slots.size(); i++) {
+            if (slots[i].defined && (*locals)[i] == identName) {
+                return &slots[i].value;
+            }
         }
         return nullptr;
     }
 
-    void Context::addFunction(const std::string &name, FunctionDeclaration *f) {
+    void Context::addFunction(Symbol name, FunctionDeclaration *f) {
         funcs.insert(std::make_pair(name, f));
+        functionEpoch++;
     }
 
-    bool Context::hasFunction(const std::string &name) {
+    bool Context::hasFunction(Symbol name) {
         return funcs.count(name) == 1;
     }
 
-    FunctionDeclaration *Context::getFunctionDeclaration(const string &name) {
+    FunctionDeclaration *Context::getFunctionDeclaration(Symbol name) {
         if (auto f = funcs.find(name); f != funcs.end()) {
             return f->second;
         }
         return nullptr;
     }
 
-    ValueDeclaration ValueDeclaration::operator+(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        // Basic
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Number;
-            //左int 右int 直接相加
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() + rhs.castingType<int>();
+    namespace {
+        // A string of at least this many bytes is not copied when something
+        // is appended to a shared value; the result is a rope node over it
+        constexpr size_t ropeThreshold = 256;
+
+        // Deletes a string whose count reached zero, then drops its prefix
+        // chain one node at a time rather than recursively
+        void destroyString(StringObject *str) {
+            while (str != nullptr) {
+                auto *prefix = str->prefix;
+                delete str;
+                if (prefix == nullptr || --prefix->refs != 0) {
+                    break;
+                }
+                str = prefix;
+            }
+        }
+    }
+
+    void StringObject::flatten() {
+        std::vector<StringObject *> chain;
+        auto *base = this;
+        while (base->prefix != nullptr) {
+            chain.push_back(base);
+            base = base->prefix;
+        }
+        std::string flat;
+        flat.reserve(length);
+        flat += base->value;
+        for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+            flat += (*it)->value;
+        }
+        value = std::move(flat);
+        if (--prefix->refs == 0) {
+            destroyString(prefix);
+        }
+        prefix = nullptr;
+    }
+
+    ValueDeclaration ValueDeclaration::fromString(std::string_view str) {
+        if (str.size() <= smallCapacity) {
+            ValueDeclaration v(apollo::String);
+            v.small = static_cast<uint8_t>(str.size());
+            std::memcpy(v.smallData(), str.data(), str.size());
+            return v;
+        }
+        return fromString(std::string(str));
+    }
+
+    ValueDeclaration ValueDeclaration::fromString(std::string &&str) {
+        if (str.size() <= smallCapacity) {
+            return fromString(std::string_view(str));
+        }
+        ValueDeclaration v(apollo::String);
+        v.small = onHeap;
+        v.payload.string = new StringObject{{}, str.size(), nullptr, std::move(str)};
+        return v;
+    }
+
+    ValueDeclaration ValueDeclaration::fromArray(std::vector<ValueDeclaration> elements) {
+        ValueDeclaration v(apollo::Array);
+        v.small = onHeap;
+        v.payload.array = new ArrayObject{{}, std::move(elements)};
+        return v;
+    }
+
+    void ValueDeclaration::destroy() {
+        if (type == apollo::String) {
+            destroyString(payload.string);
+        } else {
+            delete payload.array;
+        }
+    }
+
+    void ValueDeclaration::appendString(std::string_view tail) {
+        size_t length = stringSize() + tail.size();
+        if (small != onHeap) {
+            if (length <= smallCapacity) {
+                std::memmove(smallData() + small, tail.data(), tail.size());
+                small = static_cast<uint8_t>(length);
+                return;
             }
-                //左double 右double, 两个Double 直接相加
-            else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() + rhs.castingType<double>();
+            std::string str;
+            str.reserve(length);
+            str.append(smallData(), small).append(tail);
+            *this = fromString(std::move(str));
+            return;
+        }
+        auto *str = payload.string;
+        if (str->refs == 1) {
+            if (str->prefix != nullptr) {
+                str->flatten();
             }
+            str->value.append(tail);
+            str->length = length;
+            return;
+        }
+        if (str->length >= ropeThreshold) {
+            auto *node = new StringObject{{}, length, str, std::string(tail)};
+            // The reference this value held now belongs to the node
+            payload.string = node;
+            return;
+        }
+        std::string flat;
+        flat.reserve(length);
+        flat.append(str->view()).append(tail);
+        *this = fromString(std::move(flat));
+    }
+
+    namespace {
+        // Operators switch once on the pair of operand types
+        constexpr int typePair(ValueType lhs, ValueType rhs) { return lhs * 8 + rhs; }
+
+        constexpr int IntInt = typePair(Integer, Integer);
+        constexpr int IntNum = typePair(Integer, Number);
+        constexpr int NumInt = typePair(Number, Integer);
+        constexpr int NumNum = typePair(Number, Number);
+        constexpr int StrStr = typePair(String, String);
+        constexpr int BoolBool = typePair(Boolean, Boolean);
+        constexpr int NullNull = typePair(Null, Null);
+    }
 
-                //左Double 右int 两个转为Double相加
-            else if (!isSameType(this->data, rhs.data) && isDouble(data) && isInt(rhs.data)) {
-                result.data = castingType<double>() + rhs.castingType<double>();
+    void ValueDeclaration::detachArray() {
+        auto *copy = new ArrayObject{{}, payload.array->elements};
+        payload.array->refs--;
+        payload.array = copy;
+    }
+
+    ValueDeclaration ValueDeclaration::operator+(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt: {
+                int64_t r;
+                if (checkedAdd(asInteger(), rhs.asInteger(), r)) {
+                    return fromInteger(r);
+                }
+                return fromNumber(toDouble() + rhs.toDouble());
             }
-                //左int 右Double,直接相加
-            else if (!isSameType(this->data, rhs.data) && isInt(data) && isDouble(rhs.data)) {
-                result.data = castingType<double>() + rhs.castingType<double>();
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromNumber(toDouble() + rhs.toDouble());
+            default:
+                break;
+        }
+        if (isType<apollo::String>()) {
+            ValueDeclaration result = *this;
+            if (rhs.isType<apollo::String>()) {
+                result.appendString(rhs.asString());
+            } else {
+                result.appendString(valueToStdString(rhs));
             }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::String;
-            result.data = static_cast<char>(castingType<char>() + rhs.castingType<int>());
-        } else if (isType<apollo::Number>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::String;
-            result.data = static_cast<char>(castingType<int>() + rhs.castingType<char>());
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::String;
-            result.data = valueToStdString(*this) + valueToStdString(rhs);
-        } else if (isType<apollo::String>() || rhs.isType<apollo::String>()) {
-            result.type = apollo::String;
-            result.data = valueToStdString(*this) + valueToStdString(rhs);
+            return result;
+        } else if (rhs.isType<apollo::String>()) {
+            auto str = valueToStdString(*this);
+            str.append(rhs.asString());
+            return fromString(std::move(str));
         }
             // Array
         else if (isType<apollo::Array>()) {
-            result.type = apollo::Array;
-            auto resultArr = this->castingType<std::vector<apollo::ValueDeclaration>>();
+            auto resultArr = asArray();
             resultArr.push_back(rhs);
-            result.data = resultArr;
+            return fromArray(std::move(resultArr));
         } else if (rhs.isType<apollo::Array>()) {
-            result.type = apollo::Array;
-            auto resultArr = rhs.castingType<std::vector<apollo::ValueDeclaration>>();
+            auto resultArr = rhs.asArray();
             resultArr.push_back(*this);
-            result.data = resultArr;
-        }
-            // Invalid
-        else {
-            panic("TypeError: unexpected arguments of operator +");
+            return fromArray(std::move(resultArr));
         }
-        return result;
+        panic("TypeError: unexpected arguments of operator +");
     }
 
 
-    ValueDeclaration ValueDeclaration::operator-(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Number;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() - rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() - rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() + rhs.castingType<double>();
+    ValueDeclaration ValueDeclaration::operator-(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt: {
+                int64_t r;
+                if (checkedSub(asInteger(), rhs.asInteger(), r)) {
+                    return fromInteger(r);
+                }
+                return fromNumber(toDouble() - rhs.toDouble());
             }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Null;
-            result.data = NULL;
-        } else if (isType<apollo::Number>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Null;
-            result.data = NULL;
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Null;
-            result.data = NULL;
-        } else {
-            panic("TypeError: unexpected arguments of operator -");
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromNumber(toDouble() - rhs.toDouble());
+            case typePair(String, Integer):
+            case typePair(String, Number):
+            case typePair(Integer, String):
+            case typePair(Number, String):
+            case StrStr:
+                return ValueDeclaration(apollo::Null);
+            default:
+                panic("TypeError: unexpected arguments of operator -");
         }
-
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator*(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        // Basic
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Number;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() * rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() * rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() * rhs.castingType<double>();
+    ValueDeclaration ValueDeclaration::operator*(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt: {
+                int64_t r;
+                if (checkedMul(asInteger(), rhs.asInteger(), r)) {
+                    return fromInteger(r);
+                }
+                return fromNumber(toDouble() * rhs.toDouble());
             }
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromNumber(toDouble() * rhs.toDouble());
+                // String
+            case typePair(String, Integer):
+            case typePair(String, Number):
+                return fromString(repeatString(static_cast<int>(rhs.toDouble()), asString()));
+            case typePair(Integer, String):
+            case typePair(Number, String):
+                return fromString(repeatString(static_cast<int>(toDouble()), rhs.asString()));
+                // Array
+            case typePair(Array, Integer):
+            case typePair(Array, Number):
+                return fromArray(repeatArray(static_cast<int>(rhs.toDouble()), std::vector(asArray())));
+            case typePair(Integer, Array):
+            case typePair(Number, Array):
+                return fromArray(repeatArray(static_cast<int>(toDouble()), std::vector(rhs.asArray())));
+            default:
+                panic("TypeError: unexpected arguments of operator *");
         }
-            // String
-        else if (isType<apollo::String>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::String;
-            result.data = NULL;
-        } else if (isType<apollo::Number>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::String;
-            result.data = NULL;
-        }
-            // Array
-        else if (isType<apollo::Number>() && rhs.isType<apollo::Array>()) {
-            result.type = apollo::Array;
-            result.data = NULL;
-        } else if (isType<apollo::Array>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Array;
-            result.data = NULL;
-        } else {
-            panic("TypeError: unexpected arguments of operator *");
-        }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator/(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Number;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() / rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() / rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() / rhs.castingType<double>();
+    ValueDeclaration ValueDeclaration::operator/(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt: {
+                // Stays an integer when it divides exactly; a zero divisor and
+                // INT64_MIN / -1 go through doubles
+                int64_t a = asInteger(), b = rhs.asInteger();
+                if (b != 0 && !(b == -1 && a == INT64_MIN) && a % b == 0) {
+                    return fromInteger(a / b);
+                }
+                return fromNumber(toDouble() / rhs.toDouble());
             }
-        } else {
-            panic("TypeError: unexpected arguments of operator /");
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromNumber(toDouble() / rhs.toDouble());
+            default:
+                panic("TypeError: unexpected arguments of operator /");
         }
-        return result;
     }
 
 
-    ValueDeclaration ValueDeclaration::operator%(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Number;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() % rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() % rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() % rhs.castingType<double>();
+    ValueDeclaration ValueDeclaration::operator%(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt: {
+                int64_t a = asInteger(), b = rhs.asInteger();
+                if (b == 0) {
+                    return fromNumber(std::fmod(toDouble(), rhs.toDouble()));
+                }
+                return fromInteger(b == -1 ? 0 : a % b);
             }
-        } else {
-            panic("TypeError: unexpected arguments of operator %");
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromNumber(std::fmod(toDouble(), rhs.toDouble()));
+            default:
+                panic("TypeError: unexpected arguments of operator %");
         }
-        return result;
     }
 
 
-    ValueDeclaration ValueDeclaration::operator&&(ValueDeclaration rhs) {
-        ValueDeclaration result;
+    ValueDeclaration ValueDeclaration::operator&&(const ValueDeclaration &rhs) const {
         if (isType<apollo::Boolean>() && rhs.isType<apollo::Boolean>()) {
-            result.type = apollo::Boolean;
-            result.data = (castingType<bool>() && rhs.castingType<bool>());
+            return fromBool(asBool() && rhs.asBool());
         } else {
             panic("TypeError: unexpected arguments of operator &&");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator||(ValueDeclaration rhs) {
-        ValueDeclaration result;
+    ValueDeclaration ValueDeclaration::operator||(const ValueDeclaration &rhs) const {
         if (isType<apollo::Boolean>() && rhs.isType<apollo::Boolean>()) {
-            result.type = apollo::Boolean;
-            result.data = (castingType<bool>() || rhs.castingType<bool>());
+            return fromBool(asBool() || rhs.asBool());
         } else {
             panic("TypeError: unexpected arguments of operator ||");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator==(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Boolean;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() == rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() == rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = false;
-            }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Boolean;
-            std::string lhsStr, rhsStr;
-            lhsStr = valueToStdString(*this);
-            rhsStr = valueToStdString(rhs);
-            result.data = (lhsStr == rhsStr);
-        } else if (isType<apollo::Boolean>() && rhs.isType<apollo::Boolean>()) {
-            result.type = apollo::Boolean;
-            result.data = (castingType<bool>() == rhs.castingType<bool>());
-        } else if (this->type == apollo::Null && rhs.type == apollo::Null) {
-            result.type = apollo::Boolean;
-            result.data = std::make_any<bool>(true);
-        } else {
-            panic("TypeError: unexpected arguments of operator ==");
+    ValueDeclaration ValueDeclaration::operator==(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt:
+                return fromBool(asInteger() == rhs.asInteger());
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromBool(toDouble() == rhs.toDouble());
+            case StrStr:
+                return fromBool(asString() == rhs.asString());
+            case BoolBool:
+                return fromBool(asBool() == rhs.asBool());
+            case NullNull:
+                return fromBool(true);
+            default:
+                panic("TypeError: unexpected arguments of operator ==");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator!=(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Boolean;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() != rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() != rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = true;
-            }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Boolean;
-            std::string lhsStr, rhsStr;
-            lhsStr = valueToStdString(*this);
-            rhsStr = valueToStdString(rhs);
-            result.data = (lhsStr != rhsStr);
-        } else if (isType<apollo::Boolean>() && rhs.isType<apollo::Boolean>()) {
-            result.type = apollo::Boolean;
-            result.data = (castingType<bool>() != rhs.castingType<bool>());
-        } else if (this->type == apollo::Null && rhs.type == apollo::Null) {
-            result.type = apollo::Boolean;
-            result.data = std::make_any<bool>(false);
-        } else {
-            panic("TypeError: unexpected arguments of operator !=");
+    ValueDeclaration ValueDeclaration::operator!=(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt:
+                return fromBool(asInteger() != rhs.asInteger());
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromBool(toDouble() != rhs.toDouble());
+            case StrStr:
+                return fromBool(asString() != rhs.asString());
+            case BoolBool:
+                return fromBool(asBool() != rhs.asBool());
+            case NullNull:
+                return fromBool(false);
+            default:
+                panic("TypeError: unexpected arguments of operator !=");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator>(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Boolean;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() > rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() > rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() > rhs.castingType<double>();
-            }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Boolean;
-            std::string lhsStr, rhsStr;
-            lhsStr = valueToStdString(*this);
-            rhsStr = valueToStdString(rhs);
-            result.data = (lhsStr > rhsStr);
-        } else {
-            panic("TypeError: unexpected arguments of operator >");
+    ValueDeclaration ValueDeclaration::operator>(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt:
+                return fromBool(asInteger() > rhs.asInteger());
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromBool(toDouble() > rhs.toDouble());
+            case StrStr:
+                return fromBool(asString() > rhs.asString());
+            default:
+                panic("TypeError: unexpected arguments of operator >");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator>=(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Boolean;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() >= rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() >= rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() >= rhs.castingType<double>();
-            }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Boolean;
-            std::string lhsStr, rhsStr;
-            lhsStr = valueToStdString(*this);
-            rhsStr = valueToStdString(rhs);
-            result.data = (lhsStr >= rhsStr);
-        } else {
-            panic("TypeError: unexpected arguments of operator >=");
+    ValueDeclaration ValueDeclaration::operator>=(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt:
+                return fromBool(asInteger() >= rhs.asInteger());
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromBool(toDouble() >= rhs.toDouble());
+            case StrStr:
+                return fromBool(asString() >= rhs.asString());
+            default:
+                panic("TypeError: unexpected arguments of operator >=");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator<(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Boolean;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() < rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() < rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() < rhs.castingType<double>();
-            }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Boolean;
-            std::string lhsStr, rhsStr;
-            lhsStr = valueToStdString(*this);
-            rhsStr = valueToStdString(rhs);
-            result.data = (lhsStr < rhsStr);
-        } else {
-            panic("TypeError: unexpected arguments of operator <");
+    ValueDeclaration ValueDeclaration::operator<(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt:
+                return fromBool(asInteger() < rhs.asInteger());
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromBool(toDouble() < rhs.toDouble());
+            case StrStr:
+                return fromBool(asString() < rhs.asString());
+            default:
+                panic("TypeError: unexpected arguments of operator <");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator<=(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Boolean;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() <= rhs.castingType<int>();
-            } else if (isSameType(this->data, rhs.data) && isDouble(data)) {
-                result.data = castingType<double>() <= rhs.castingType<double>();
-            } else if (!isSameType(this->data, rhs.data)) {
-                result.data = castingType<double>() <= rhs.castingType<double>();
-            }
-        } else if (isType<apollo::String>() && rhs.isType<apollo::String>()) {
-            result.type = apollo::Boolean;
-            std::string lhsStr, rhsStr;
-            lhsStr = valueToStdString(*this);
-            rhsStr = valueToStdString(rhs);
-            result.data = (lhsStr <= rhsStr);
-        } else {
-            panic("TypeError: unexpected arguments of operator <=");
+    ValueDeclaration ValueDeclaration::operator<=(const ValueDeclaration &rhs) const {
+        switch (typePair(type, rhs.type)) {
+            case IntInt:
+                return fromBool(asInteger() <= rhs.asInteger());
+            case IntNum:
+            case NumInt:
+            case NumNum:
+                return fromBool(toDouble() <= rhs.toDouble());
+            case StrStr:
+                return fromBool(asString() <= rhs.asString());
+            default:
+                panic("TypeError: unexpected arguments of operator <=");
         }
-        return result;
     }
 
 
-    ValueDeclaration ValueDeclaration::operator&(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Number;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() & rhs.castingType<int>();
-            } else {
-                panic("TypeError: unexpected arguments of operator |");
-            }
+    ValueDeclaration ValueDeclaration::operator&(const ValueDeclaration &rhs) const {
+        if (typePair(type, rhs.type) == IntInt) {
+            return fromInteger(asInteger() & rhs.asInteger());
         } else {
             panic("TypeError: unexpected arguments of operator &");
         }
-        return result;
     }
 
-    ValueDeclaration ValueDeclaration::operator|(ValueDeclaration rhs) {
-        ValueDeclaration result;
-        if (isType<apollo::Number>() && rhs.isType<apollo::Number>()) {
-            result.type = apollo::Number;
-            if (isSameType(this->data, rhs.data) && isInt(data)) {
-                result.data = castingType<int>() | rhs.castingType<int>();
-            } else {
-                panic("TypeError: unexpected arguments of operator |");
-            }
+    ValueDeclaration ValueDeclaration::operator|(const ValueDeclaration &rhs) const {
+        if (typePair(type, rhs.type) == IntInt) {
+            return fromInteger(asInteger() | rhs.asInteger());
         } else {
             panic("TypeError: unexpected arguments of operator |");
         }
-        return result;
     }
 
 }
\ No newline at end of file
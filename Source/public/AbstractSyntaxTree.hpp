@@ -5,7 +5,6 @@
 #ifndef APOLLO_ABSTRACTSYNTAXTREE_HPP
 #define APOLLO_ABSTRACTSYNTAXTREE_HPP
 
-#include <deque>
 #include <map>
 #include "apollo.hpp"
 
@@ -69,6 +68,7 @@ enum Token {
 
 using apollo::BlockStatement;
 using apollo::Context;
+using apollo::ContextChain;
 using apollo::ExecResult;
 using apollo::Runtime;
 using apollo::ValueDeclaration;
@@ -77,12 +77,39 @@ struct Statement;
 struct Expression;
 
 
+/**
+ * Concrete node type, so passes that walk the tree (serialization, analysis)
+ * can switch on it instead of probing with typeid/dynamic_cast.
+ */
+enum AstKind : unsigned char {
+    AST_INVALID = 0,
+
+    AST_BOOLEAN,    // BooleanExpression
+    AST_NULL,       // NullExpression
+    AST_NUMBER,     // NumberExpression
+    AST_STRING,     // StringExpression
+    AST_ARRAY,      // ArrayExpression
+    AST_IDENT,      // IdentExpression
+    AST_INDEX,      // IndexExpression
+    AST_BINARY,     // BinaryExpression
+    AST_FUNCALL,    // FunCallExpression
+    AST_ASSIGN,     // AssignExpression
+
+    AST_BREAK,      // BreakStmt
+    AST_CONTINUE,   // ContinueStmt
+    AST_EXPR_STMT,  // ExpressionStmt
+    AST_RETURN,     // ReturnStmt
+    AST_IF,         // IfStmt
+    AST_WHILE,      // WhileStmt
+};
+
 struct AbstractSyntaxTreeNode {
-    explicit AbstractSyntaxTreeNode(int start, int end) : start(start), end(end) {};
+    explicit AbstractSyntaxTreeNode(AstKind kind, int start, int end) : kind(kind), start(start), end(end) {};
 
     virtual ~AbstractSyntaxTreeNode() = default;
 
     virtual string astString() { return "ASTNode()"; };
+    AstKind kind;
     int start;
     int end;
 };
@@ -98,111 +125,145 @@ struct Expression : public AbstractSyntaxTreeNode {
 
     virtual ~Expression() = default;
 
-    virtual ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain);
+    virtual ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain);
 
     string astString() override;
 };
 
 struct BooleanExpression : public Expression {
-    explicit BooleanExpression(int start, int end) : Expression(start, end) {};
+    explicit BooleanExpression(int start, int end) : Expression(AST_BOOLEAN, start, end) {};
 
     bool literal;
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 };
 
 struct NullExpression : public Expression {
-    explicit NullExpression(int start, int end) : Expression(start, end) {};
+    explicit NullExpression(int start, int end) : Expression(AST_NULL, start, end) {};
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 
 };
 
 struct NumberExpression : public Expression {
-    explicit NumberExpression(int start, int end) : Expression(start, end) {};
+    explicit NumberExpression(int start, int end) : Expression(AST_NUMBER, start, end) {};
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
 
-    double literal;
+    // An Integer, or a Number for literals with a fraction or exponent and
+    // for integers too large for 64 bits
+    ValueDeclaration literal;
 
     string astString() override;
 };
 
 struct StringExpression : public Expression {
-    explicit StringExpression(int start, int end) : Expression(start, end) {};
+    explicit StringExpression(int start, int end) : Expression(AST_STRING, start, end) {};
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
 
-    string literal;
+    // Owned by the arena the node was made in, see AstArena::internString
+    std::string_view literal;
+    // The literal as a value, made on first evaluation and shared after
+    ValueDeclaration value{apollo::Null};
 
     string astString() override;
 };
 struct ArrayExpression : public Expression {
-    explicit ArrayExpression(int start, int end) : Expression(start, end) {}
+    explicit ArrayExpression(int start, int end) : Expression(AST_ARRAY, start, end) {}
 
     std::vector<Expression*> literal;
 
-    ValueDeclaration eval(Runtime* rt, std::deque<Context*> ctxChain) override;
+    ValueDeclaration eval(Runtime* rt, ContextChain &ctxChain) override;
     std::string astString();
 };
 struct IdentExpression : public Expression {
-    explicit IdentExpression(string identName, int start, int end)
-            : Expression(start, end), identName(std::move(identName)) {}
+    explicit IdentExpression(apollo::Symbol identName, int start, int end)
+            : Expression(AST_IDENT, start, end), identName(identName) {}
 
-    string identName;
+    apollo::Symbol identName;
+    // Every context that may hold the variable, innermost first
+    std::vector<apollo::SlotRef> bindings;
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 };
 
 struct IndexExpression : public Expression {
-    explicit IndexExpression(int start, int end) : Expression(start, end) {}
+    explicit IndexExpression(int start, int end) : Expression(AST_INDEX, start, end) {}
 
-    string identName;
+    apollo::Symbol identName;
     Expression *index;
+    std::vector<apollo::SlotRef> bindings;
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 };
 
 struct BinaryExpression : public Expression {
-    explicit BinaryExpression(int start, int end) : Expression(start, end) {}
+    explicit BinaryExpression(int start, int end) : Expression(AST_BINARY, start, end) {}
 
     Expression *leftExpression{};
     Token opt{};
     Expression *rightExpression{};
 
-    ValueDeclaration eval(Runtime *rt, std::deque<Context *> ctxChain) override;
+    // The operator and operand types the node has specialized to. The first
+    // execution picks one from the values it sees; a later value of another
+    // type makes the node generic for good.
+    enum Specialization : uint8_t {
+        Unspecialized, Generic,
+        IntAdd, IntSub, IntMul, IntDiv, IntMod, IntEq, IntNe, IntLt, IntLe, IntGt, IntGe, IntBitAnd, IntBitOr,
+        NumAdd, NumSub, NumMul, NumDiv, NumEq, NumNe, NumLt, NumLe, NumGt, NumGe,
+        StrAdd, StrEq, StrNe, StrLt, StrLe, StrGt, StrGe,
+        BoolAnd, BoolOr, BoolEq, BoolNe
+    };
+    Specialization specialization = Unspecialized;
+
+    ValueDeclaration eval(Runtime *rt, ContextChain &ctxChain) override;
+
+    static Specialization specialize(Token opt, const ValueDeclaration &lhs, const ValueDeclaration &rhs);
 
     std::string astString() override;
 
 };
 
 struct FunCallExpression : public Expression {
-    explicit FunCallExpression(int start, int end) : Expression(start, end) {};
+    explicit FunCallExpression(int start, int end) : Expression(AST_FUNCALL, start, end) {};
 
-    string funName;
+    apollo::Symbol funName;
     vector<Expression *> args;
+    // Call-site cache: the function this call resolved to, valid while
+    // cachedEpoch matches the runtime's function epoch
+    Runtime::BuiltinFuncType cachedBuiltin{};
+    apollo::FunctionDeclaration *cachedFunction{};
+    uint32_t cachedEpoch = 0;
+
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
+
+    void bindTarget(Runtime *runtime);
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    // What a call of name with argc arguments runs, for this and the other
+    // engines' call sites: the user defined function, else the builtin
+    static void lookup(Runtime *runtime, apollo::Symbol name, size_t argc, Runtime::BuiltinFuncType &builtin,
+                       apollo::FunctionDeclaration *&function);
 
     string astString() override;
 };
 
 struct AssignExpression : public Expression {
-    explicit AssignExpression(int start, int end) : Expression(start, end) {};
+    explicit AssignExpression(int start, int end) : Expression(AST_ASSIGN, start, end) {};
 
     Expression *leftExpression{};
     Expression *rightExperssion{};
     Token opt;
 
-    ValueDeclaration eval(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ValueDeclaration eval(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 };
@@ -212,69 +273,69 @@ struct Statement : public AbstractSyntaxTreeNode {
 
     virtual ~Statement() = default;
 
-    virtual ExecResult interpret(Runtime *runtime, std::deque<Context *> ctxChain);
+    virtual ExecResult interpret(Runtime *runtime, ContextChain &ctxChain);
 
     string astString() override;
 };
 
 struct BreakStmt : public Statement {
-    explicit BreakStmt(int start, int end) : Statement(start, end) {};
+    explicit BreakStmt(int start, int end) : Statement(AST_BREAK, start, end) {};
 
-    ExecResult interpret(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ExecResult interpret(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 };
 
 struct ContinueStmt : public Statement {
-    explicit ContinueStmt(int start, int end) : Statement(start, end) {};
+    explicit ContinueStmt(int start, int end) : Statement(AST_CONTINUE, start, end) {};
 
-    ExecResult interpret(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ExecResult interpret(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 };
 
 struct ExpressionStmt : public Statement {
 
-    explicit ExpressionStmt(Expression *expression, int start, int end) : Statement(start, end),
+    explicit ExpressionStmt(Expression *expression, int start, int end) : Statement(AST_EXPR_STMT, start, end),
                                                                           expression(expression) {};
     Expression *expression;
 
-    ExecResult interpret(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ExecResult interpret(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 
 };
 
 struct ReturnStmt : public Statement {
-    explicit ReturnStmt(int start, int end) : Statement(start, end) {};
+    explicit ReturnStmt(int start, int end) : Statement(AST_RETURN, start, end) {};
 
     Expression *expression;
 
-    ExecResult interpret(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ExecResult interpret(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 };
 
 struct IfStmt : public Statement {
 
-    explicit IfStmt(int start, int end) : Statement(start, end) {};
+    explicit IfStmt(int start, int end) : Statement(AST_IF, start, end) {};
 
     Expression *cond{};
     struct BlockStatement *blockStatement{};
     struct BlockStatement *elseBlock{};
 
-    ExecResult interpret(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ExecResult interpret(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString();
 };
 
 struct WhileStmt : public Statement {
-    explicit WhileStmt(int start, int end) : Statement(start, end) {};
+    explicit WhileStmt(int start, int end) : Statement(AST_WHILE, start, end) {};
 
     Expression *cond{};
     struct BlockStatement *blockStatement;
 
-    ExecResult interpret(Runtime *runtime, std::deque<Context *> ctxChain) override;
+    ExecResult interpret(Runtime *runtime, ContextChain &ctxChain) override;
 
     string astString() override;
 
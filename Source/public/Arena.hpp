@@ -0,0 +1,106 @@
+//
+// Created by chineseblack23 on 2024/6/24.
+//AST内存池
+//
+
+#ifndef APOLLO_ARENA_HPP
+#define APOLLO_ARENA_HPP
+
+#include <cstddef>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <unordered_set>
+#include <utility>
+
+namespace apollo {
+
+    /**
+     * Bump allocator that owns every AST node of one program. Nodes are
+     * carved out of large blocks in allocation order, so a parent and the
+     * children parsed right after it share cache lines. Destructors of
+     * non-trivial objects are recorded and run in reverse order when the
+     * arena is destroyed or reset; the blocks themselves are freed in bulk.
+     *
+     * String literals are kept here too rather than in the process wide
+     * Symbol table, so a reset or the end of the runtime gives them back.
+     */
+    class AstArena {
+    public:
+        explicit AstArena(size_t blockSize = 64 * 1024);
+
+        ~AstArena();
+
+        AstArena(const AstArena &) = delete;
+
+        AstArena &operator=(const AstArena &) = delete;
+
+    public:
+        void *allocate(size_t size, size_t align);
+
+        template<typename T, typename... Args>
+        T *make(Args &&... args);
+
+        void reset();
+
+        // Copies text into the arena once per distinct spelling; the view is
+        // valid until the arena is reset or destroyed
+        std::string_view internString(std::string_view text);
+
+        inline size_t bytesAllocated() const { return bytesUsed; }
+
+        inline size_t objectCount() const { return objects; }
+
+    private:
+        struct Block {
+            Block *next;
+            size_t size;
+        };
+
+        struct Finalizer {
+            Finalizer *next;
+
+            void (*destroy)(void *);
+
+            void *object;
+        };
+
+        void grow(size_t minSize);
+
+        void runFinalizers();
+
+    private:
+        size_t blockSize;
+
+        Block *blocks = nullptr;
+
+        char *cursor = nullptr;
+
+        char *limit = nullptr;
+
+        Finalizer *finalizers = nullptr;
+
+        std::unordered_set<std::string_view> strings;
+
+        size_t bytesUsed = 0;
+
+        size_t objects = 0;
+    };
+
+    template<typename T, typename... Args>
+    T *AstArena::make(Args &&... args) {
+        void *mem = allocate(sizeof(T), alignof(T));
+        T *object = new(mem) T(std::forward<Args>(args)...);
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            auto *fin = static_cast<Finalizer *>(allocate(sizeof(Finalizer), alignof(Finalizer)));
+            fin->destroy = [](void *p) { static_cast<T *>(p)->~T(); };
+            fin->object = object;
+            fin->next = finalizers;
+            finalizers = fin;
+        }
+        objects++;
+        return object;
+    }
+}
+
+#endif //APOLLO_ARENA_HPP
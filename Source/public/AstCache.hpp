@@ -0,0 +1,88 @@
+//
+// Created by chineseblack23 on 2024/6/25.
+//语法树缓存
+//
+
+#ifndef APOLLO_ASTCACHE_HPP
+#define APOLLO_ASTCACHE_HPP
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "SourceBuffer.hpp"
+#include "apollo.hpp"
+
+/**
+ * A cache file mapped into memory. Top-level statements are decoded eagerly,
+ * function bodies stay encoded here until FunctionDeclaration::getBody asks
+ * for them. Each body is checked against its own checksum when it is
+ * decoded, so loading costs the top level and the function table, and a
+ * body is only paid for once it is called.
+ */
+class AstImage {
+public:
+    // Where a function body is encoded, relative to bodyData
+    struct Body {
+        uint64_t offset;
+        uint64_t size;
+        uint64_t hash;
+    };
+
+    explicit AstImage(SourceBuffer buffer, apollo::AstArena &arena);
+
+    ~AstImage();
+
+    struct apollo::BlockStatement *loadBody(uint32_t index);
+
+private:
+    friend class AstCache;
+
+    SourceBuffer buffer;
+    apollo::AstArena &arena;
+    // The image's string table, pointing into the mapping, and the names in
+    // it as they are interned on first use
+    std::vector<std::string_view> strings;
+    std::vector<apollo::Symbol> symbols;
+    std::vector<Body> bodies;
+    const char *bodyData = nullptr;
+};
+
+/**
+ * Compact binary image of a parsed program: the top-level statements, every
+ * FunctionDeclaration and the source locations of all nodes. An image is
+ * only accepted when it was written from source with the same SHA-256
+ * digest and length, so unchanged scripts can skip Parser::parse entirely.
+ */
+class AstCache {
+public:
+    // What identifies the source an image was written from
+    struct SourceKey {
+        std::array<uint8_t, 32> digest{};
+        uint64_t size = 0;
+
+        bool operator==(const SourceKey &) const = default;
+    };
+
+    static SourceKey keySource(std::string_view source);
+
+    // Directory for cache files: $APOLLO_CACHE_DIR, $XDG_CACHE_HOME/apollo or
+    // ~/.cache/apollo; empty, and caching off, when there is no home
+    static std::string cacheDirectory();
+
+    static std::string cachePath(const SourceKey &key);
+
+    // Rebuilds the program into rt's arena. Returns false, leaving rt
+    // untouched, if the file is missing, stale or malformed, or if it or its
+    // directory is not owned by and writable only by the current user.
+    static bool load(const std::string &path, const SourceKey &key, apollo::Runtime *rt);
+
+    // Writes the image, then trims the directory: images unused for 30 days
+    // are removed, then the least recently used ones until the rest fit in
+    // 64 MiB. Loading an image counts as using it.
+    static bool store(const std::string &path, const SourceKey &key, apollo::Runtime *rt);
+};
+
+
+#endif //APOLLO_ASTCACHE_HPP
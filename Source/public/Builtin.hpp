@@ -0,0 +1,35 @@
+//
+// Created by chineseblack23 on 2024/6/28.
+//内置函数库
+//
+
+#ifndef APOLLO_BUILTIN_HPP
+#define APOLLO_BUILTIN_HPP
+
+#include "apollo.hpp"
+
+/**
+ * Registers the core native library in a runtime:
+ *
+ *   print(values...)            writes the values separated by spaces and a newline
+ *   str(value)                  the printed form of a value
+ *   len(string | array)         number of characters or elements
+ *   push(array, value)          a copy of the array with value appended
+ *   pop(array)                  a copy of the array without its last element
+ *   last(array)                 the last element of the array
+ *   substr(string, start[, n])  n characters from start (to the end by default)
+ *   abs floor ceil round sqrt   math on one number
+ *   pow(x, y) min(a, b) max(a, b)
+ *   typeOf(value)               "number", "string", "bool", "null" or "array"
+ *   isNumber isString isBool isArray isNull
+ *   clock()                     seconds since an arbitrary fixed point, for timing
+ *
+ * Arrays are values, so push and pop return the changed array instead of
+ * changing their argument: a = push(a, x), a = pop(a).
+ *
+ * A function the script defines under one of these names is called in place
+ * of the builtin.
+ */
+void registerCoreLibrary(apollo::Runtime *rt);
+
+#endif //APOLLO_BUILTIN_HPP
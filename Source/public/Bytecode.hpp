@@ -0,0 +1,102 @@
+//
+// Created by chineseblack23 on 2024/6/29.
+//字节码
+//
+
+#ifndef APOLLO_BYTECODE_HPP
+#define APOLLO_BYTECODE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "AbstractSyntaxTree.hpp"
+#include "Jit.hpp"
+#include "apollo.hpp"
+
+namespace apollo {
+
+    /**
+     * Register machine instructions. R[x] is register x of the running
+     * frame, K[x] constant x of its Bytecode; "bx" is the 32-bit operand
+     * made of b and c. Variables have fixed registers and are read in
+     * place; an unassigned one holds an Undefined value.
+     */
+    enum OpCode : uint8_t {
+        OP_LOADK,       // R[a] = K[bx]
+        OP_LOADNULL,    // R[a] = null
+        OP_LOADBOOL,    // R[a] = b != 0
+        OP_MOVE,        // R[a] = R[b]
+        OP_TAKE,        // R[a] = R[b], leaving R[b] null
+        OP_CHECKVAR,    // error if R[a] is undefined
+        OP_UNDEFINED,   // error: the variable read here is never defined
+        OP_CLEAR,       // R[a] .. R[a + b - 1] = undefined
+
+        OP_JMP,         // jump to bx
+        OP_JDEF,        // jump to bx if R[a] is defined
+        OP_JFALSE,      // jump to bx if R[a] is false, error unless a bool
+        OP_JTRUE,       // jump to bx if R[a] is true, error unless a bool
+
+        // R[a] = R[b] <op> R[c], with the BinaryExpression semantics
+        OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD,
+        OP_AND, OP_OR, OP_EQ, OP_NE, OP_GT, OP_GE, OP_LT, OP_LE,
+        OP_BITAND, OP_BITOR,
+        // R[a] = R[b] <op> K[c]
+        OP_ADDK, OP_SUBK, OP_MULK, OP_DIVK, OP_MODK,
+        OP_EQK, OP_NEK, OP_GTK, OP_GEK, OP_LTK, OP_LEK,
+        // R[a] = <op> R[b]
+        OP_NEG, OP_NOT, OP_BITNOT,
+
+        OP_ADDTO,       // R[a] += R[b]; an undefined R[a] is defined as R[b]
+        OP_ADDTOK,      // R[a] += K[b]
+        OP_ASSIGNOP,    // R[a] <k>= R[b] for the other compound operators
+        OP_GETINDEX,    // R[a] = R[b][R[c]]
+        OP_SETINDEX,    // R[a][R[b]] <k>= R[c]; an undefined R[a] is defined as R[c]
+        OP_NEWARRAY,    // R[a] = [R[b] .. R[b + c - 1]]
+
+        OP_BIND,        // look up the function of calls[bx], before its arguments
+        OP_CALL,        // R[a] = calls[bx](R[a] .. R[a + argc - 1])
+        OP_RETURN,      // return R[a]
+    };
+
+    struct Instruction {
+        OpCode op;
+        // The operator token of OP_ASSIGNOP and OP_SETINDEX
+        uint8_t k;
+        uint16_t a;
+        uint16_t b;
+        uint16_t c;
+
+        inline uint32_t bx() const { return static_cast<uint32_t>(b) | static_cast<uint32_t>(c) << 16; }
+    };
+
+    static_assert(sizeof(Instruction) == 8);
+
+    /**
+     * A function body, or top-level code, compiled for the VirtualMachine.
+     * A frame is laid out as the variables of every scope in the code,
+     * sibling blocks sharing their registers, followed by the temporaries;
+     * for top-level code the global variables come first.
+     */
+    struct Bytecode {
+        std::vector<Instruction> code;
+        std::vector<ValueDeclaration> constants;
+        // Call sites, which keep their resolved target between runs
+        std::vector<FunCallExpression *> calls;
+        // The node each instruction was compiled from, for error messages
+        std::vector<AbstractSyntaxTreeNode *> origins;
+        // Registers holding variables; the first paramCount are parameters
+        uint32_t variableCount = 0;
+        uint32_t paramCount = 0;
+        uint32_t frameSize = 0;
+        // Top-level code only: the globals defined when it was compiled
+        uint32_t globalCount = 0;
+        FunctionDeclaration *function{};
+        // Run time state of the code: what is left of its warmup, and its
+        // machine code once the Jit has compiled it
+        mutable int32_t warmup = Jit::warmup;
+        mutable std::unique_ptr<NativeCode> native;
+    };
+
+}
+
+#endif //APOLLO_BYTECODE_HPP
@@ -0,0 +1,158 @@
+//
+// Created by chineseblack23 on 2024/6/29.
+//字节码编译
+//
+
+#ifndef APOLLO_COMPILER_HPP
+#define APOLLO_COMPILER_HPP
+
+#include <cstdint>
+#include <memory>
+#include <unordered_set>
+#include <vector>
+#include "AbstractSyntaxTree.hpp"
+#include "Bytecode.hpp"
+#include "apollo.hpp"
+
+/**
+ * Compiles resolved statements and function bodies to Bytecode.
+ *
+ * Every context slot the Resolver assigned becomes a register, and the
+ * compiler tracks for each one whether its variable is certainly assigned,
+ * certainly not, or maybe, at every point of the code. A reference whose
+ * binding that settles reads the register in place with no check, which
+ * covers nearly all of them; the rest test registers in binding order at
+ * run time like Interpreter::findVariable does.
+ */
+class Compiler {
+public:
+    // Top-level code, whose variables are the runtime's globals. What is
+    // known about the globals carries over from one compile call to the next.
+    // Every compile call returns null for code that needs more registers
+    // than an instruction can address; the caller runs it another way.
+    explicit Compiler(std::vector<apollo::Symbol> &globals);
+
+    std::unique_ptr<apollo::Bytecode> compileProgram(const std::vector<Statement *> &stmts);
+
+    // Compiles one top-level statement, run before the next is compiled
+    std::unique_ptr<apollo::Bytecode> compileStatement(Statement *stmt);
+
+    // A function body; resolves it first if needed
+    static std::unique_ptr<apollo::Bytecode> compileFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f);
+
+private:
+    Compiler() = default;
+
+    enum VarState : uint8_t {
+        Unassigned, Assigned, MaybeAssigned
+    };
+
+    struct Scope {
+        const std::vector<apollo::Symbol> *locals;
+        uint16_t base;
+    };
+
+    // Where break and continue jump: a loop, or the end of the statement
+    // of the function body or program they are in
+    struct Target {
+        bool loop = false;
+        size_t scopeCount = 0;
+        std::vector<size_t> breaks{};
+        std::vector<size_t> continues{};
+        std::vector<std::vector<VarState>> breakStates{};
+        std::vector<std::vector<VarState>> continueStates{};
+    };
+
+    // False when the variables alone do not fit in the registers
+    bool begin(uint32_t frameVariables, const std::vector<Statement *> &stmts);
+
+    std::unique_ptr<apollo::Bytecode> finish();
+
+    void topLevelStatement(Statement *stmt);
+
+    void statement(Statement *stmt);
+
+    void ifStatement(IfStmt *stmt);
+
+    void whileStatement(WhileStmt *stmt);
+
+    void jumpOut(Target &target, bool isContinue, AbstractSyntaxTreeNode *origin);
+
+    void enterBlock(struct apollo::BlockStatement *block);
+
+    void leaveBlock(struct apollo::BlockStatement *block, AbstractSyntaxTreeNode *origin);
+
+    void clearScopes(size_t keep, AbstractSyntaxTreeNode *origin);
+
+    // The value of expr in some register: a variable's own register or a
+    // temporary. With dst set, the value is put in dst.
+    uint16_t expr(Expression *expr, int dst = -1);
+
+    // A value that must survive the evaluation of `later`
+    uint16_t stable(uint16_t reg, Expression *later, AbstractSyntaxTreeNode *origin);
+
+    // Reads the variable a reference is bound to, checking it is defined
+    uint16_t read(const std::vector<apollo::SlotRef> &bindings, int dst, Expression *origin);
+
+    uint16_t identifier(IdentExpression *ident, int dst);
+
+    uint16_t index(IndexExpression *index, int dst);
+
+    uint16_t binary(BinaryExpression *binary, int dst);
+
+    uint16_t call(FunCallExpression *call, int dst);
+
+    uint16_t assign(AssignExpression *assign, int dst);
+
+    uint16_t array(ArrayExpression *array, int dst);
+
+    // Registers that may hold a reference's variable, in binding order,
+    // up to the first certainly assigned one
+    std::vector<uint16_t> candidates(const std::vector<apollo::SlotRef> &bindings) const;
+
+    uint16_t variable(const apollo::SlotRef &ref) const;
+
+    void assigned(const std::vector<uint16_t> &regs, uint16_t created);
+
+    // Sets the state at the top of a loop body
+    void loopHead(WhileStmt *loop);
+
+    // The conservative loopHead for loops nested too deep to iterate
+    void markLoopAssignments(WhileStmt *loop);
+
+    void join(std::vector<VarState> &into, const std::vector<VarState> &other);
+
+    uint16_t temp();
+
+    uint32_t constant(const apollo::ValueDeclaration &value);
+
+    size_t emit(apollo::OpCode op, uint16_t a, uint16_t b, uint16_t c, AbstractSyntaxTreeNode *origin,
+                uint8_t k = 0);
+
+    size_t emitJump(apollo::OpCode op, uint16_t a, AbstractSyntaxTreeNode *origin);
+
+    void patch(size_t jump);
+
+    void patch(size_t jump, size_t target);
+
+private:
+    std::unique_ptr<apollo::Bytecode> out;
+    std::vector<apollo::Symbol> *globals{};
+    std::vector<Scope> scopes;
+    std::vector<VarState> state;
+    std::vector<Target> targets;
+    // Registers below are variables; temporaries are allocated above
+    uint32_t variableTop = 0;
+    uint32_t nextVariable = 0;
+    uint32_t nextTemp = 0;
+    // Set when temp() ran out of registers
+    bool tooLarge = false;
+    bool inFunction = false;
+    // Loop bodies being compiled only to find their loop head state; each
+    // level of nesting multiplies the work, so deep ones are approximated
+    static constexpr int maxDryRuns = 4;
+    int dryRuns = 0;
+};
+
+
+#endif //APOLLO_COMPILER_HPP
@@ -0,0 +1,92 @@
+//
+// Created by chineseblack23 on 2024/6/30.
+//扁平语法树解释器
+//
+
+#ifndef APOLLO_FLATINTERPRETER_HPP
+#define APOLLO_FLATINTERPRETER_HPP
+
+#include <vector>
+#include "FlatTree.hpp"
+#include "apollo.hpp"
+
+/**
+ * Runs FlatTrees with one switch per node instead of a virtual call, with
+ * the same contexts, lookups and results as the tree-walking interpreter.
+ * Function bodies are flattened before they run into one tree they share,
+ * after which the runtime's syntax trees are no longer read and may be
+ * released.
+ * It runs as fast as the tree walker, not faster, and while flattening both
+ * trees are alive, so its peak memory is higher; only --engine=flat uses it.
+ */
+class FlatInterpreter {
+public:
+    explicit FlatInterpreter(apollo::Runtime *rt);
+
+    ~FlatInterpreter();
+
+    // Resolves and flattens every function of the runtime, for statements
+    // that are loaded once the syntax trees are gone
+    void flattenFunctions();
+
+    // Flattens resolved top-level statements in place of the previous ones,
+    // and every function they may call that is not flattened yet; run does
+    // not flatten anything itself
+    void load(const std::vector<Statement *> &stmts);
+
+    // Runs the loaded statements in the global chain
+    void run(apollo::ContextChain &ctxChain);
+
+private:
+    // How a statement finished, in place of ExecResult
+    enum Flow : uint8_t {
+        FlowNormal, FlowBreak, FlowContinue, FlowReturn
+    };
+
+    Flow exec(const apollo::FlatTree &tree, uint32_t index, apollo::ContextChain &ctxChain,
+              apollo::ValueDeclaration &result);
+
+    Flow block(const apollo::FlatTree &tree, uint32_t index, apollo::ContextChain &ctxChain,
+               apollo::ValueDeclaration &result);
+
+    apollo::ValueDeclaration eval(const apollo::FlatTree &tree, uint32_t index, apollo::ContextChain &ctxChain);
+
+    apollo::ValueDeclaration operand(const apollo::FlatTree &tree, uint32_t index, apollo::ContextChain &ctxChain);
+
+    apollo::ValueDeclaration binary(const apollo::FlatTree &tree, apollo::FlatNode node, uint32_t index,
+                                    apollo::ContextChain &ctxChain);
+
+    // Array literals and element reads, kept out of eval's frame
+    apollo::ValueDeclaration aggregate(const apollo::FlatTree &tree, apollo::FlatNode node, uint32_t index,
+                                       apollo::ContextChain &ctxChain);
+
+    apollo::ValueDeclaration call(const apollo::FlatTree &tree, apollo::FlatNode node, apollo::ContextChain &ctxChain);
+
+    void bind(apollo::FlatTree::CallSite &site, uint32_t argc);
+
+    void flatten(apollo::Symbol name);
+
+    apollo::ValueDeclaration assign(const apollo::FlatTree &tree, apollo::FlatNode node, uint32_t index,
+                                    apollo::ContextChain &ctxChain);
+
+    static apollo::ValueDeclaration *find(const apollo::FlatTree &tree, const apollo::FlatTree::Reference &ref,
+                                          const apollo::ContextChain &ctxChain);
+
+    static const apollo::ValueDeclaration *leaf(const apollo::FlatTree &tree, uint32_t index,
+                                                const apollo::ContextChain &ctxChain);
+
+    static bool condition(const apollo::FlatTree &tree, uint32_t node, const apollo::ValueDeclaration &value);
+
+private:
+    apollo::Runtime *rt;
+    apollo::FlatTree program;
+    // The bodies of the functions flattened so far, which are unlinked from
+    // them when we are destroyed
+    apollo::FlatTree library;
+    std::vector<apollo::FunctionDeclaration *> functions;
+    // Call sites of the library whose callee load has flattened
+    size_t linked = 0;
+};
+
+
+#endif //APOLLO_FLATINTERPRETER_HPP
@@ -0,0 +1,123 @@
+//
+// Created by chineseblack23 on 2024/6/30.
+//扁平语法树
+//
+
+#ifndef APOLLO_FLATTREE_HPP
+#define APOLLO_FLATTREE_HPP
+
+#include <cstdint>
+#include <vector>
+#include "AbstractSyntaxTree.hpp"
+#include "apollo.hpp"
+
+namespace apollo {
+
+    enum FlatKind : uint8_t {
+        FLAT_NULL,
+        FLAT_BOOL,          // a: the value
+        FLAT_CONST,         // a: constant (number or string literal)
+        FLAT_ARRAY,         // a, b: element list and count
+        FLAT_IDENT,         // a: reference
+        FLAT_INDEX,         // a: reference, b: index
+        FLAT_BINARY,        // a: left, b: right, c: specialization, opt; a missing right makes it unary
+        FLAT_CALL,          // a: call site, b, c: argument list and count
+        FLAT_ASSIGN,        // a: reference, b: right hand side, opt
+        FLAT_SETINDEX,      // a: reference, b: right hand side, c: index, opt
+
+        FLAT_EXPR,          // a: expression
+        FLAT_RETURN,        // a: expression or none
+        FLAT_BREAK,
+        FLAT_CONTINUE,
+        FLAT_IF,            // a: condition, b: block, c: else block or none
+        FLAT_WHILE,         // a: condition, b: block
+        FLAT_BLOCK,         // a, b: statement list and count, c: locals (a function's frame) or none
+    };
+
+    // Every node has the same size; children are indices into the same array
+    struct FlatNode {
+        FlatKind kind;
+        // Operator token of binary nodes and assignments
+        uint8_t opt;
+        uint32_t a;
+        uint32_t b;
+        uint32_t c;
+    };
+
+    static_assert(sizeof(FlatNode) == 16);
+
+    /**
+     * A statement list, or any number of function bodies, laid out in one
+     * array of fixed size nodes in pre-order, so walking it reads memory
+     * mostly forward.
+     * What does not fit in a node (literals, resolved bindings, child lists,
+     * call sites, source positions) lives in side tables indexed from it.
+     * Built from resolved statements, but nothing in it points back into
+     * them, so they can be freed once they are flattened.
+     */
+    class FlatTree {
+    public:
+        static constexpr uint32_t none = UINT32_MAX;
+
+        // A variable reference: its bindings, innermost first, and its name
+        struct Reference {
+            uint32_t bindings;
+            uint32_t count;
+            Symbol name;
+        };
+
+        struct Position {
+            int start;
+            int end;
+        };
+
+        // A call and the function it resolved to, with the block of its
+        // flattened body; valid while epoch matches the runtime's function
+        // epoch
+        struct CallSite {
+            Symbol name;
+            Runtime::BuiltinFuncType builtin;
+            FunctionDeclaration *function;
+            uint32_t body;
+            uint32_t epoch;
+        };
+
+        // Appends a block of statements and returns its node
+        uint32_t addBlock(const std::vector<Statement *> &stmts, const std::vector<Symbol> *locals);
+
+        // Appends a function body, whose locals are those of the frame the
+        // call pushes rather than of a context the block enters
+        uint32_t addFunction(const std::vector<Statement *> &stmts, const std::vector<Symbol> &frame);
+
+        void clear();
+
+        // Bytes taken by the nodes and every side table
+        size_t memoryUsage() const;
+
+    public:
+        std::vector<FlatNode> nodes;
+        std::vector<Position> positions;
+        std::vector<ValueDeclaration> constants;
+        std::vector<Reference> references;
+        std::vector<SlotRef> bindings;
+        std::vector<uint32_t> lists;
+        std::vector<std::vector<Symbol>> locals;
+        // Bound and specialized while the tree runs
+        mutable std::vector<CallSite> calls;
+        mutable std::vector<::BinaryExpression::Specialization> specializations;
+
+    private:
+        uint32_t node(FlatKind kind, AbstractSyntaxTreeNode *origin);
+
+        uint32_t statement(Statement *stmt);
+
+        uint32_t expression(Expression *expr);
+
+        uint32_t reference(Symbol name, const std::vector<SlotRef> &refs);
+
+        uint32_t list(const std::vector<uint32_t> &children);
+    };
+
+}
+
+#endif //APOLLO_FLATTREE_HPP
@@ -5,48 +5,241 @@
 #ifndef APOLLO_INTERPRETER_HPP
 #define APOLLO_INTERPRETER_HPP
 
-#include <deque>
 #include <string>
+#include <vector>
 #include "apollo.hpp"
 #include "Parser.hpp"
+#include "Utils.hpp"
 
 using namespace std;
 
 class Interpreter {
 public:
+    // How the program is run. The tree-walking engine is the reference
+    // implementation; the bytecode engine compiles to register code and the
+    // flat engine walks a flattened copy of the tree with a switch; it is not a
+    // faster path and only runs when asked for.
+    enum Engine {
+        AstEngine, BytecodeEngine, FlatEngine
+    };
+
     explicit Interpreter(const string &fileName);
 
+    explicit Interpreter(SourceBuffer source);
+
+    // A program split over several files; they are lexed and parsed in
+    // parallel and merged into one runtime in the order given
+    explicit Interpreter(const std::vector<std::string> &fileNames);
+
     ~Interpreter();
 
 public:
     void execute();
 
+    // Reuse a cached binary AST when the source is unchanged (on by default)
+    inline void setAstCache(bool enabled) { useAstCache = enabled; }
+
+    // Parse, run and drop one top-level statement at a time, so memory does
+    // not grow with the size of the script. Functions are hoisted first.
+    inline void setStreaming(bool enabled) { streaming = enabled; }
+
+    inline void setEngine(Engine e) { engine = e; }
+
+    // Fold constants and drop dead code before running (on by default);
+    // off, the program runs exactly as parsed, which helps debugging
+    inline void setOptimize(bool enabled) { rt->setOptimize(enabled); }
+
+    // Let the bytecode engine compile warm code to machine code (on by
+    // default where the Jit has a backend)
+    inline void setJit(bool enabled) { useJit = enabled; }
+
+    void parseCommandOption(int argc, char *argv[]);
+
 public:
-    static void enterContext(std::deque<apollo::Context *> &ctxChain);
+    // A block that declares no variables gets no context of its own, the
+    // Resolver does not count it as a level of the chain
+    static inline void enterContext(apollo::ContextChain &ctxChain, struct apollo::BlockStatement *block) {
+        if (!block->locals.empty()) {
+            ctxChain.enter(&block->locals);
+        }
+    }
+
+    static inline void leaveContext(apollo::ContextChain &ctxChain, struct apollo::BlockStatement *block) {
+        if (!block->locals.empty()) {
+            ctxChain.leave();
+        }
+    }
+
+    // The innermost defined variable among a reference's resolved bindings
+    static inline apollo::ValueDeclaration *findVariable(const apollo::ContextChain &ctxChain,
+                                                         const std::vector<apollo::SlotRef> &bindings) {
+        for (auto &ref: bindings) {
+            if (auto *var = ctxChain[ref.depth]->getVariable(ref.slot); var != nullptr) {
+                return var;
+            }
+        }
+        return nullptr;
+    }
 
-    static void leaveContext(std::deque<apollo::Context *> &ctxChain);
+    static apollo::ValueDeclaration callFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f,
+                                                 apollo::ContextChain &previousCtxChain,
+                                                 const std::vector<Expression *> &args);
 
+    // The same with the arguments evaluated already, for the bytecode
+    // engine's functions too large for its registers
     static apollo::ValueDeclaration callFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f,
-                                                 std::deque<apollo::Context *> previousCtxChain,
-                                                 std::vector<Expression *> args);
+                                                 apollo::ContextChain &previousCtxChain,
+                                                 std::span<apollo::ValueDeclaration> args);
 
     static apollo::ValueDeclaration
-    calcBinaryExpr(ValueDeclaration lhs, Token opt, ValueDeclaration rhs,
-                   int line, int column);
+    calcBinaryExpr(ValueDeclaration lhs, Token opt, ValueDeclaration rhs);
 
     static apollo::ValueDeclaration calcUnaryExpr(ValueDeclaration &lhs, Token opt, int line,
                                                   int column);
 
+    // A BinaryExpression applied to its operand values. A missing or null
+    // right operand makes it unary, as for -x.
+    static inline apollo::ValueDeclaration evalBinary(const ValueDeclaration &lhs, Token opt,
+                                                      const ValueDeclaration &rhs, int line, int column) {
+        if (!lhs.isType<apollo::Null>() && rhs.isType<apollo::Null>()) {
+            apollo::ValueDeclaration operand = lhs;
+            return Interpreter::calcUnaryExpr(operand, opt, line, column);
+        }
+        return Interpreter::calcBinaryExpr(lhs, opt, rhs);
+    }
+
+    // A BinaryExpression applied through its specialization, which the
+    // first call picks and a type it does not cover turns generic; the flat
+    // engine keeps one per node and comes through here as well
+    static inline apollo::ValueDeclaration evalSpecialized(BinaryExpression::Specialization &specialization,
+                                                           Token opt, const ValueDeclaration &lhs,
+                                                           const ValueDeclaration &rhs, int start, int end);
+
     static apollo::ValueDeclaration assignSwitch(Token opt, ValueDeclaration lhs, ValueDeclaration rhs);
 
 private:
-    void parseCommandOption(int argc, char *argv) {}
+    static void loadUnit(Parser &parser, apollo::Runtime *unit, bool useAstCache);
+
+    void load();
+
+    void loadParallel();
+
+    void executeStreaming();
+
+    // False, with nothing run, when the program does not fit the bytecode
+    // engine's registers
+    bool executeBytecode(apollo::ContextChain &ctxChain);
+
+    // Runs the body of f in the frame funcCtx, its arguments set already
+    static apollo::ValueDeclaration runFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f,
+                                                apollo::ContextChain &previousCtxChain, apollo::Context *funcCtx);
 
 private:
-    std::deque<apollo::Context *> ctxChain;
+    // Backing store of every ContextChain; the global context is at the bottom
+    apollo::ContextStack ctxStack;
     apollo::Runtime *rt;
     Parser *p;
+    std::vector<std::string> fileNames;
+    bool useAstCache = true;
+    bool streaming = false;
+    bool useJit = true;
+    Engine engine = BytecodeEngine;
 };
 
+inline apollo::ValueDeclaration Interpreter::evalSpecialized(BinaryExpression::Specialization &specialization,
+                                                            Token opt, const apollo::ValueDeclaration &lhs,
+                                                            const apollo::ValueDeclaration &rhs, int start, int end) {
+    using enum BinaryExpression::Specialization;
+    // Each specialized case checks its operand types and computes the result
+    // directly; what it does not cover (an overflow, an inexact division)
+    // takes the generic path without despecializing
+#define INTS if (lhs.type != apollo::Integer || rhs.type != apollo::Integer) break
+#define NUMS if (!lhs.isNumber() || !rhs.isNumber() || \
+                  (lhs.type == apollo::Integer && rhs.type == apollo::Integer)) break
+#define STRS if (lhs.type != apollo::String || rhs.type != apollo::String) break
+#define BOOLS if (lhs.type != apollo::Boolean || rhs.type != apollo::Boolean) break
+#define CHECKED(checked) {                                                                      \
+        INTS;                                                                                   \
+        int64_t v;                                                                              \
+        if (checked(lhs.asInteger(), rhs.asInteger(), v)) {                                     \
+            return apollo::ValueDeclaration::fromInteger(v);                                    \
+        }                                                                                       \
+        return Interpreter::evalBinary(lhs, opt, rhs, start, end);                              \
+    }
+    switch (specialization) {
+        case Unspecialized:
+            specialization = BinaryExpression::specialize(opt, lhs, rhs);
+            return Interpreter::evalBinary(lhs, opt, rhs, start, end);
+        case Generic:
+            return Interpreter::evalBinary(lhs, opt, rhs, start, end);
+
+        case IntAdd: CHECKED(checkedAdd)
+        case IntSub: CHECKED(checkedSub)
+        case IntMul: CHECKED(checkedMul)
+        case IntDiv: {
+            INTS;
+            int64_t a = lhs.asInteger(), b = rhs.asInteger();
+            if (b != 0 && !(b == -1 && a == INT64_MIN) && a % b == 0) {
+                return apollo::ValueDeclaration::fromInteger(a / b);
+            }
+            return Interpreter::evalBinary(lhs, opt, rhs, start, end);
+        }
+        case IntMod: {
+            INTS;
+            int64_t b = rhs.asInteger();
+            if (b != 0) {
+                return apollo::ValueDeclaration::fromInteger(b == -1 ? 0 : lhs.asInteger() % b);
+            }
+            return Interpreter::evalBinary(lhs, opt, rhs, start, end);
+        }
+        case IntEq: INTS; return apollo::ValueDeclaration::fromBool(lhs.asInteger() == rhs.asInteger());
+        case IntNe: INTS; return apollo::ValueDeclaration::fromBool(lhs.asInteger() != rhs.asInteger());
+        case IntLt: INTS; return apollo::ValueDeclaration::fromBool(lhs.asInteger() < rhs.asInteger());
+        case IntLe: INTS; return apollo::ValueDeclaration::fromBool(lhs.asInteger() <= rhs.asInteger());
+        case IntGt: INTS; return apollo::ValueDeclaration::fromBool(lhs.asInteger() > rhs.asInteger());
+        case IntGe: INTS; return apollo::ValueDeclaration::fromBool(lhs.asInteger() >= rhs.asInteger());
+        case IntBitAnd: INTS; return apollo::ValueDeclaration::fromInteger(lhs.asInteger() & rhs.asInteger());
+        case IntBitOr: INTS; return apollo::ValueDeclaration::fromInteger(lhs.asInteger() | rhs.asInteger());
+
+        case NumAdd: NUMS; return apollo::ValueDeclaration::fromNumber(lhs.toDouble() + rhs.toDouble());
+        case NumSub: NUMS; return apollo::ValueDeclaration::fromNumber(lhs.toDouble() - rhs.toDouble());
+        case NumMul: NUMS; return apollo::ValueDeclaration::fromNumber(lhs.toDouble() * rhs.toDouble());
+        case NumDiv: NUMS; return apollo::ValueDeclaration::fromNumber(lhs.toDouble() / rhs.toDouble());
+        case NumEq: NUMS; return apollo::ValueDeclaration::fromBool(lhs.toDouble() == rhs.toDouble());
+        case NumNe: NUMS; return apollo::ValueDeclaration::fromBool(lhs.toDouble() != rhs.toDouble());
+        case NumLt: NUMS; return apollo::ValueDeclaration::fromBool(lhs.toDouble() < rhs.toDouble());
+        case NumLe: NUMS; return apollo::ValueDeclaration::fromBool(lhs.toDouble() <= rhs.toDouble());
+        case NumGt: NUMS; return apollo::ValueDeclaration::fromBool(lhs.toDouble() > rhs.toDouble());
+        case NumGe: NUMS; return apollo::ValueDeclaration::fromBool(lhs.toDouble() >= rhs.toDouble());
+
+        case StrAdd: {
+            STRS;
+            // What operator+ does to its own copy of the left operand
+            apollo::ValueDeclaration result = lhs;
+            result.appendString(rhs.asString());
+            return result;
+        }
+        case StrEq: STRS; return apollo::ValueDeclaration::fromBool(lhs.asString() == rhs.asString());
+        case StrNe: STRS; return apollo::ValueDeclaration::fromBool(lhs.asString() != rhs.asString());
+        case StrLt: STRS; return apollo::ValueDeclaration::fromBool(lhs.asString() < rhs.asString());
+        case StrLe: STRS; return apollo::ValueDeclaration::fromBool(lhs.asString() <= rhs.asString());
+        case StrGt: STRS; return apollo::ValueDeclaration::fromBool(lhs.asString() > rhs.asString());
+        case StrGe: STRS; return apollo::ValueDeclaration::fromBool(lhs.asString() >= rhs.asString());
+
+        case BoolAnd: BOOLS; return apollo::ValueDeclaration::fromBool(lhs.asBool() && rhs.asBool());
+        case BoolOr: BOOLS; return apollo::ValueDeclaration::fromBool(lhs.asBool() || rhs.asBool());
+        case BoolEq: BOOLS; return apollo::ValueDeclaration::fromBool(lhs.asBool() == rhs.asBool());
+        case BoolNe: BOOLS; return apollo::ValueDeclaration::fromBool(lhs.asBool() != rhs.asBool());
+    }
+#undef CHECKED
+#undef BOOLS
+#undef STRS
+#undef NUMS
+#undef INTS
+    // A guard failed: the operands are not what the node specialized to
+    specialization = Generic;
+    return Interpreter::evalBinary(lhs, opt, rhs, start, end);
+}
+
 
 #endif //APOLLO_INTERPRETER_HPP
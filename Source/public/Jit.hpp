@@ -0,0 +1,80 @@
+//
+// Created by chineseblack23 on 2024/7/2.
+//x86-64基线即时编译
+//
+
+#ifndef APOLLO_JIT_HPP
+#define APOLLO_JIT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "apollo.hpp"
+
+namespace apollo {
+    struct Bytecode;
+
+    /**
+     * Machine code the Jit made for one Bytecode, in pages of its own that
+     * go away with it. Every instruction of the Bytecode has an entry point,
+     * so the interpreter can hand over at any of them.
+     */
+    struct NativeCode {
+        using Entry = uint32_t (*)(ValueDeclaration *R, const ValueDeclaration *K, const uint8_t *target);
+
+        NativeCode(uint8_t *memory, size_t size, std::vector<uint32_t> offsets)
+                : memory(memory), size(size), offsets(std::move(offsets)) {}
+
+        NativeCode(const NativeCode &) = delete;
+
+        NativeCode &operator=(const NativeCode &) = delete;
+
+        ~NativeCode();
+
+        // Runs frame R from instruction index on, until an instruction the
+        // code leaves to the interpreter; returns that instruction's index
+        inline uint32_t run(ValueDeclaration *R, const ValueDeclaration *K, uint32_t index) const {
+            return reinterpret_cast<Entry>(memory)(R, K, memory + offsets[index]);
+        }
+
+        uint8_t *memory;
+        size_t size;
+        std::vector<uint32_t> offsets;
+    };
+}
+
+/**
+ * A baseline compiler from Bytecode to x86-64 machine code, one template
+ * per instruction. The templates work on the VirtualMachine's registers
+ * in place: integer and double arithmetic and comparisons, moves and
+ * jumps run inline, and anything else calls the same slow paths as the
+ * interpreter. Calls and returns are left to the interpreter, the code
+ * returns to it at those instructions and is entered again afterwards.
+ *
+ * The VirtualMachine counts backward jumps and calls for each Bytecode and
+ * compiles it once it is warm. Only x86-64 Linux has a backend; elsewhere
+ * nothing is compiled and the code stays interpreted.
+ */
+class Jit {
+public:
+#if defined(__x86_64__) && defined(__linux__)
+    static constexpr bool available = true;
+#else
+    static constexpr bool available = false;
+#endif
+
+    // Counted down by one for every backward jump and by callWeight for
+    // every call of a Bytecode before it is compiled
+    static constexpr int32_t warmup = 1000;
+    static constexpr int32_t callWeight = 10;
+
+    // Null when there is no backend or no executable memory
+    static std::unique_ptr<apollo::NativeCode> compile(const apollo::Bytecode &code, apollo::Runtime *rt);
+
+private:
+    class Emitter;
+};
+
+
+#endif //APOLLO_JIT_HPP
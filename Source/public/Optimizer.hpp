@@ -0,0 +1,70 @@
+//
+// Created by chineseblack23 on 2024/7/1.
+//常量折叠与死代码消除
+//
+
+#ifndef APOLLO_OPTIMIZER_HPP
+#define APOLLO_OPTIMIZER_HPP
+
+#include <vector>
+#include "AbstractSyntaxTree.hpp"
+#include "apollo.hpp"
+
+/**
+ * Rewrites parsed statements before they are resolved:
+ *
+ *  - operators whose operands are all literals are replaced by the literal
+ *    they evaluate to, with the semantics of Interpreter::evalBinary. An
+ *    operation that would raise an error is left for run time, so the
+ *    error still comes when (and if) it is reached.
+ *  - an if whose condition folds to a bool keeps only the branch taken,
+ *    a while whose condition folds to false is dropped. A kept branch that
+ *    assigns no variable has no scope of its own and, within a block, is
+ *    spliced into the enclosing statements.
+ *  - statements after a break, continue or return that ends a block, or
+ *    after a return that ends a function body, are dropped.
+ *
+ * New literal nodes are made in the arena that owns the statements.
+ */
+class Optimizer {
+public:
+    explicit Optimizer(apollo::AstArena &arena) : arena(&arena) {}
+
+    // Top-level statements, where a jump only ends its own statement
+    void optimizeProgram(std::vector<Statement *> &stmts);
+
+    // A function body that has not been resolved yet
+    void optimizeFunction(apollo::FunctionDeclaration *f);
+
+private:
+    // What a break, continue or return ends in a statement list
+    enum Scope {
+        ProgramScope, FunctionScope, BlockScope
+    };
+
+    void optimizeStatements(std::vector<Statement *> &stmts, Scope scope);
+
+    // Appends the optimized statement to out, or what it is reduced to;
+    // scope is that of the list stmt is in
+    void optimize(Statement *stmt, Scope scope, std::vector<Statement *> &out);
+
+    Expression *fold(Expression *expr);
+
+    Expression *literal(const apollo::ValueDeclaration &value, int start, int end);
+
+    static bool constant(Expression *expr, apollo::ValueDeclaration &value);
+
+    static bool foldable(const apollo::ValueDeclaration &lhs, Token opt, const apollo::ValueDeclaration &rhs);
+
+    static bool assigns(Statement *stmt);
+
+    static bool assigns(Expression *expr);
+
+    static bool ends(Statement *stmt, Scope scope);
+
+private:
+    apollo::AstArena *arena;
+};
+
+
+#endif //APOLLO_OPTIMIZER_HPP
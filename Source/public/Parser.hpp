@@ -7,28 +7,55 @@
 #define APOLLO_PARSER_HPP
 
 #include <cassert>
-#include <fstream>
 #include <iostream>
-#include <map>
 #include <memory>
 #include <string>
-#include <tuple>
+#include <string_view>
 #include "AbstractSyntaxTree.hpp"
+#include "SourceBuffer.hpp"
 #include "apollo.hpp"
 
+/**
+ * A lexed token. The lexeme is a view into the parser's SourceBuffer, so it
+ * is only valid as long as the parser is alive; copy it into an owned string
+ * when an AST node has to keep it.
+ */
+struct SourceToken {
+    Token kind = INVALID;
+    std::string_view lexeme;
+    int line = 0;
+    int column = 0;
+};
+
 class Parser {
 public:
     explicit Parser(const std::string &fileName);
 
+    explicit Parser(SourceBuffer source);
+
     ~Parser();
 
 public:
     void parse(apollo::Runtime *rt);
 
+    // Streaming mode: register every top-level function first, then hand out
+    // one top-level statement at a time, allocated in a caller-owned arena
+    void hoistFunctions(apollo::Runtime *rt);
+
+    Statement *parseNextStatement(apollo::AstArena &scratch);
+
     static void printLex(const std::string &fileName);
 
+    static void printLex(SourceBuffer source);
+
+    // Runs the lexer over the whole source without building an AST and
+    // returns the number of tokens, EOF included (used by the benchmarks)
+    static size_t countTokens(SourceBuffer source);
+
     short precedence(Token op);
 
+    inline const SourceBuffer &getSource() const { return source; }
+
 private:
     Expression *parsePrimaryExpr();
 
@@ -51,38 +78,68 @@ private:
 
     struct BlockStatement *parseBlock();
 
-    std::vector<std::string> parseParameterList();
+    std::vector<apollo::Symbol> parseParameterList();
+
+    apollo::FunctionDeclaration *parseFuncDef(apollo::Runtime *rt);
+
+    void skipFuncDef();
+
+    void rewind();
 
-    apollo::FunctionDeclaration *parseFuncDef(apollo::Context *context);
+    [[noreturn]] void unexpectedToken();
 
 private:
-    std::tuple<Token, std::string> next();
+    SourceToken next();
+
+    inline SourceToken makeToken(Token kind, const char *first, const char *last) {
+        end = static_cast<int>(cursor - lineStart);
+        return SourceToken{kind, std::string_view(first, last - first), tokenLine, tokenColumn};
+    }
+
+    inline SourceToken makeToken(Token kind, const char *first) {
+        return makeToken(kind, first, cursor);
+    }
 
     inline char getNextChar() {
-        end++;
-        return static_cast<char>(fs.get());
+        return cursor != limit ? *cursor++ : static_cast<char>(EOF);
     }
 
-    inline char peekNextChar() { return static_cast<char>(fs.peek()); }
+    inline char peekNextChar() const { return cursor != limit ? *cursor : static_cast<char>(EOF); }
+
+    template<typename T, typename... Args>
+    inline T *make(Args &&... args) {
+        return arena->make<T>(std::forward<Args>(args)...);
+    }
 
     inline Token getCurrentToken() const {
-        return std::get<Token>(currentToken);
+        return currentToken.kind;
     }
 
-    inline std::string getCurrentLexeme() const {
-        return std::get<std::string>(currentToken);
+    inline std::string_view getCurrentLexeme() const {
+        return currentToken.lexeme;
     }
 
 private:
-    const std::map<std::string, Token> keywords;
+    SourceToken currentToken;
 
-    std::tuple<Token, std::string> currentToken;
+    SourceBuffer source;
 
-    std::fstream fs;
+    apollo::AstArena *arena = nullptr;
+
+    const char *cursor;
+
+    const char *limit;
+
+    // First character of the current line, columns are measured from here
+    const char *lineStart;
 
     int start = 1;
 
     int end = 0;
+
+    int tokenLine = 1;
+
+    int tokenColumn = 0;
 };
 
 
@@ -0,0 +1,71 @@
+//
+// Created by chineseblack23 on 2024/6/27.
+//作用域解析
+//
+
+#ifndef APOLLO_RESOLVER_HPP
+#define APOLLO_RESOLVER_HPP
+
+#include <unordered_map>
+#include <vector>
+#include "AbstractSyntaxTree.hpp"
+#include "apollo.hpp"
+
+/**
+ * Binds every variable reference to the context slots it can live in, so
+ * the interpreter indexes ctxChain[depth]->slots[slot] instead of hashing
+ * the name at each level of the chain.
+ *
+ * Variables are created by their first assignment, in the innermost context
+ * at that point, unless an enclosing context already holds the name. So the
+ * contexts that can hold a name are exactly the scopes that assign it
+ * directly (or, for a function frame, take it as a parameter). A reference
+ * gets all of them, innermost first, and at run time the first one that is
+ * defined wins; almost always there is only one.
+ */
+class Resolver {
+public:
+    // Top-level code, whose scope is the runtime's global context
+    explicit Resolver(std::vector<apollo::Symbol> &globals);
+
+    // Binds one top-level statement; the global scope grows by the names
+    // it assigns, so the global context must call growSlots() afterwards
+    void resolveStatement(Statement *stmt);
+
+    // Binds a function body, optimized first if the runtime asks for it;
+    // its frame takes the parameters first
+    static void resolveFunction(apollo::Runtime *rt, apollo::FunctionDeclaration *f);
+
+private:
+    Resolver() = default;
+
+    struct Scope {
+        std::vector<apollo::Symbol> *locals;
+        std::unordered_map<apollo::Symbol, uint32_t> slots;
+        // Index of this scope's context in the chain. Blocks without locals
+        // get no context at run time, so they do not count.
+        uint32_t depth;
+    };
+
+    void pushScope(std::vector<apollo::Symbol> &locals);
+
+    uint32_t declare(apollo::Symbol name);
+
+    void declare(Statement *stmt);
+
+    void declare(Expression *expr);
+
+    void resolve(Statement *stmt);
+
+    void resolve(Expression *expr);
+
+    void resolveBlock(struct apollo::BlockStatement *block);
+
+    std::vector<apollo::SlotRef> bind(apollo::Symbol name) const;
+
+private:
+    std::vector<Scope> scopes;
+};
+
+
+#endif //APOLLO_RESOLVER_HPP
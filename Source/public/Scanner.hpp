@@ -0,0 +1,205 @@
+//
+// Created by chineseblack23 on 2024/6/26.
+//词法扫描加速
+//
+
+#ifndef APOLLO_SCANNER_HPP
+#define APOLLO_SCANNER_HPP
+
+#include <bit>
+#include <cstdint>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define APOLLO_SCANNER_AVX2 1
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define APOLLO_SCANNER_SSE2 1
+#endif
+
+/**
+ * Bulk character-class scanners used by Parser::next(). Each one returns the
+ * first position in [p, end) that does not belong to the run it skips. They
+ * test a whole vector of bytes per step (AVX2 or SSE2, whichever the build
+ * targets) and finish the last partial vector with the scalar loop, which is
+ * also the only path on other architectures.
+ */
+namespace scanner {
+
+    inline bool isWhitespace(char c) { return c == ' ' || c == '\n' || c == '\r' || c == '\t'; }
+
+    inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+
+    inline bool isIdentChar(char c) {
+        return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || isDigit(c) || c == '_';
+    }
+
+#if defined(APOLLO_SCANNER_AVX2)
+    using Vec = __m256i;
+    constexpr int vecWidth = 32;
+    constexpr uint32_t fullMask = 0xffffffffu;
+
+    inline Vec load(const char *p) { return _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)); }
+
+    inline Vec splat(char c) { return _mm256_set1_epi8(c); }
+
+    inline Vec eq(Vec a, Vec b) { return _mm256_cmpeq_epi8(a, b); }
+
+    inline Vec any(Vec a, Vec b) { return _mm256_or_si256(a, b); }
+
+    inline Vec sub(Vec a, Vec b) { return _mm256_sub_epi8(a, b); }
+
+    inline Vec maxu(Vec a, Vec b) { return _mm256_max_epu8(a, b); }
+
+    inline uint32_t bits(Vec v) { return static_cast<uint32_t>(_mm256_movemask_epi8(v)); }
+
+#elif defined(APOLLO_SCANNER_SSE2)
+    using Vec = __m128i;
+    constexpr int vecWidth = 16;
+    constexpr uint32_t fullMask = 0xffffu;
+
+    inline Vec load(const char *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)); }
+
+    inline Vec splat(char c) { return _mm_set1_epi8(c); }
+
+    inline Vec eq(Vec a, Vec b) { return _mm_cmpeq_epi8(a, b); }
+
+    inline Vec any(Vec a, Vec b) { return _mm_or_si128(a, b); }
+
+    inline Vec sub(Vec a, Vec b) { return _mm_sub_epi8(a, b); }
+
+    inline Vec maxu(Vec a, Vec b) { return _mm_max_epu8(a, b); }
+
+    inline uint32_t bits(Vec v) { return static_cast<uint32_t>(_mm_movemask_epi8(v)); }
+
+#endif
+
+#if defined(APOLLO_SCANNER_AVX2) || defined(APOLLO_SCANNER_SSE2)
+#define APOLLO_SCANNER_SIMD 1
+
+    // Byte-wise lo <= v <= hi as unsigned: (v - lo) <= (hi - lo)
+    inline Vec inRange(Vec v, char lo, char hi) {
+        Vec span = splat(static_cast<char>(hi - lo));
+        return eq(maxu(sub(v, splat(lo)), span), span);
+    }
+
+    inline uint32_t whitespaceBits(Vec v) {
+        return bits(any(any(eq(v, splat(' ')), eq(v, splat('\n'))),
+                        any(eq(v, splat('\r')), eq(v, splat('\t')))));
+    }
+
+    inline uint32_t identBits(Vec v) {
+        Vec letter = inRange(any(v, splat(0x20)), 'a', 'z');
+        return bits(any(any(letter, inRange(v, '0', '9')), eq(v, splat('_'))));
+    }
+
+    // Accounts for the newlines among the first n bytes of a block
+    inline void countNewlines(uint32_t newlines, int n, const char *block, int &line, const char *&lineStart) {
+        if (n < 32) {
+            newlines &= (1u << n) - 1;
+        }
+        if (newlines != 0) {
+            line += std::popcount(newlines);
+            lineStart = block + (31 - std::countl_zero(newlines)) + 1;
+        }
+    }
+
+#endif
+
+    // Skips spaces, tabs and line breaks, keeping the line count and the
+    // start of the current line up to date
+    inline const char *skipWhitespace(const char *p, const char *end, int &line, const char *&lineStart) {
+        if (p == end || !isWhitespace(*p)) {
+            return p;
+        }
+#if defined(APOLLO_SCANNER_SIMD)
+        for (; end - p >= vecWidth; p += vecWidth) {
+            Vec v = load(p);
+            uint32_t ws = whitespaceBits(v);
+            uint32_t nl = bits(eq(v, splat('\n')));
+            if (ws != fullMask) {
+                int n = std::countr_zero(~ws);
+                countNewlines(nl, n, p, line, lineStart);
+                return p + n;
+            }
+            countNewlines(nl, vecWidth, p, line, lineStart);
+        }
+#endif
+        for (; p != end && isWhitespace(*p); p++) {
+            if (*p == '\n') {
+                line++;
+                lineStart = p + 1;
+            }
+        }
+        return p;
+    }
+
+    // Finds the line break that ends a comment (or end)
+    inline const char *findLineEnd(const char *p, const char *end) {
+#if defined(APOLLO_SCANNER_SIMD)
+        for (; end - p >= vecWidth; p += vecWidth) {
+            if (uint32_t nl = bits(eq(load(p), splat('\n'))); nl != 0) {
+                return p + std::countr_zero(nl);
+            }
+        }
+#endif
+        for (; p != end && *p != '\n'; p++) {
+        }
+        return p;
+    }
+
+    // Finds the closing quote of a string literal (or end), counting the
+    // line breaks inside the literal
+    inline const char *findQuote(const char *p, const char *end, char quote, int &line, const char *&lineStart) {
+#if defined(APOLLO_SCANNER_SIMD)
+        for (; end - p >= vecWidth; p += vecWidth) {
+            Vec v = load(p);
+            uint32_t q = bits(eq(v, splat(quote)));
+            uint32_t nl = bits(eq(v, splat('\n')));
+            if (q != 0) {
+                int n = std::countr_zero(q);
+                countNewlines(nl, n, p, line, lineStart);
+                return p + n;
+            }
+            countNewlines(nl, vecWidth, p, line, lineStart);
+        }
+#endif
+        for (; p != end && *p != quote; p++) {
+            if (*p == '\n') {
+                line++;
+                lineStart = p + 1;
+            }
+        }
+        return p;
+    }
+
+    // Skips the remaining [A-Za-z0-9_] characters of an identifier
+    inline const char *scanIdentifier(const char *p, const char *end) {
+#if defined(APOLLO_SCANNER_SIMD)
+        for (; end - p >= vecWidth; p += vecWidth) {
+            if (uint32_t id = identBits(load(p)); id != fullMask) {
+                return p + std::countr_zero(~id);
+            }
+        }
+#endif
+        for (; p != end && isIdentChar(*p); p++) {
+        }
+        return p;
+    }
+
+    // Skips a run of decimal digits
+    inline const char *scanDigits(const char *p, const char *end) {
+#if defined(APOLLO_SCANNER_SIMD)
+        for (; end - p >= vecWidth; p += vecWidth) {
+            if (uint32_t d = bits(inRange(load(p), '0', '9')); d != fullMask) {
+                return p + std::countr_zero(~d);
+            }
+        }
+#endif
+        for (; p != end && isDigit(*p); p++) {
+        }
+        return p;
+    }
+}
+
+#endif //APOLLO_SCANNER_HPP
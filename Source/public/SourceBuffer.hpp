@@ -0,0 +1,72 @@
+//
+// Created by chineseblack23 on 2024/6/23.
+//源代码缓冲区
+//
+
+#ifndef APOLLO_SOURCEBUFFER_HPP
+#define APOLLO_SOURCEBUFFER_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+/**
+ * A contiguous, read-only view of a whole source file. Files are memory
+ * mapped where the platform supports it, otherwise they are read into an
+ * owned string once. The lexer scans the [begin(), end()) range directly.
+ */
+class SourceBuffer {
+public:
+    static SourceBuffer fromFile(const std::string &fileName);
+
+    static SourceBuffer fromString(std::string source, std::string name = "<string>");
+
+    SourceBuffer(SourceBuffer &&other) noexcept;
+
+    SourceBuffer &operator=(SourceBuffer &&other) noexcept;
+
+    SourceBuffer(const SourceBuffer &) = delete;
+
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+
+    ~SourceBuffer();
+
+public:
+    inline const char *begin() const { return buffer; }
+
+    inline const char *end() const { return buffer + length; }
+
+    inline size_t size() const { return length; }
+
+    inline std::string_view view() const { return {buffer, length}; }
+
+    inline const std::string &name() const { return fileName; }
+
+    // Lets the OS drop the mapped pages before p; they are re-read from the
+    // file if touched again. Keeps resident memory flat while streaming.
+    void discardBefore(const char *p);
+
+    // Starts discarding from the beginning again, for a reader that rewinds
+    inline void resetDiscard() { discarded = nullptr; }
+
+private:
+    SourceBuffer() = default;
+
+    void release();
+
+private:
+    const char *buffer = nullptr;
+
+    size_t length = 0;
+
+    bool mapped = false;
+
+    const char *discarded = nullptr;
+
+    std::string storage;
+
+    std::string fileName;
+};
+
+
+#endif //APOLLO_SOURCEBUFFER_HPP
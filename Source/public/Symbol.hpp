@@ -0,0 +1,61 @@
+//
+// Created by chineseblack23 on 2024/6/28.
+//符号表
+//
+
+#ifndef APOLLO_SYMBOL_HPP
+#define APOLLO_SYMBOL_HPP
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace apollo {
+
+    /**
+     * An interned name. Every distinct spelling is stored once in a process
+     * wide table and a Symbol is just a pointer to that copy, so comparing
+     * and hashing names never looks at their characters. Interned strings
+     * live until the process exits; the table is shared by all runtimes and
+     * safe to fill from parallel parses, which take a lock only for names
+     * they have not looked up lately, and then one of many. Only names
+     * belong here: string literals are kept by the AstArena of their
+     * program instead.
+     */
+    class Symbol {
+    public:
+        Symbol() : name(&emptyName) {}
+
+        static Symbol intern(std::string_view text);
+
+        inline const std::string &str() const { return *name; }
+
+        inline const char *c_str() const { return name->c_str(); }
+
+        inline size_t size() const { return name->size(); }
+
+        inline bool empty() const { return name->empty(); }
+
+        inline bool operator==(Symbol rhs) const { return name == rhs.name; }
+
+        inline bool operator!=(Symbol rhs) const { return name != rhs.name; }
+
+        inline size_t hash() const { return std::hash<const void *>{}(name); }
+
+    private:
+        explicit Symbol(const std::string *name) : name(name) {}
+
+        const std::string *name;
+
+        inline static const std::string emptyName;
+    };
+
+}
+
+template<>
+struct std::hash<apollo::Symbol> {
+    inline size_t operator()(apollo::Symbol s) const noexcept { return s.hash(); }
+};
+
+#endif //APOLLO_SYMBOL_HPP
@@ -5,17 +5,57 @@
 #ifndef APOLLO_UTILS_HPP
 #define APOLLO_UTILS_HPP
 #pragma once
-#include <any>
+#include <cstdint>
 #include <deque>
+#include <functional>
 #include <string>
+#include <string_view>
 #include "apollo.hpp"
 
-std::string valueToStdString(apollo::ValueDeclaration v);
+std::string valueToStdString(const apollo::ValueDeclaration &v);
 
-std::string repeatString(int count, const std::string& str);
+std::string repeatString(int count, std::string_view str);
 
 std::vector<apollo::ValueDeclaration> repeatArray(int count, std::vector<apollo::ValueDeclaration>&& arr);
 
+// Integer arithmetic that reports overflow instead of wrapping
+inline bool checkedAdd(int64_t a, int64_t b, int64_t &out) {
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_add_overflow(a, b, &out);
+#else
+    if ((b > 0 && a > INT64_MAX - b) || (b < 0 && a < INT64_MIN - b)) {
+        return false;
+    }
+    out = a + b;
+    return true;
+#endif
+}
+
+inline bool checkedSub(int64_t a, int64_t b, int64_t &out) {
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_sub_overflow(a, b, &out);
+#else
+    if ((b < 0 && a > INT64_MAX + b) || (b > 0 && a < INT64_MIN + b)) {
+        return false;
+    }
+    out = a - b;
+    return true;
+#endif
+}
+
+inline bool checkedMul(int64_t a, int64_t b, int64_t &out) {
+#if defined(__GNUC__) || defined(__clang__)
+    return !__builtin_mul_overflow(a, b, &out);
+#else
+    if (a > 0 ? (b > 0 ? a > INT64_MAX / b : b < INT64_MIN / a)
+              : (b > 0 ? a < INT64_MIN / b : a != 0 && b < INT64_MAX / a)) {
+        return false;
+    }
+    out = a * b;
+    return true;
+#endif
+}
+
 template <typename _DesireType, typename... _ArgumentType>
 inline bool anyone(_DesireType k, _ArgumentType... args) {
     return ((args == k) || ...);
@@ -23,5 +63,28 @@ inline bool anyone(_DesireType k, _ArgumentType... args) {
 
 [[noreturn]] void panic(char const* const format, ...);
 
+// Thrown by panic, in place of printing the message and exiting, while a
+// PanicCapture is alive on the calling thread
+struct PanicError {
+    std::string message;
+};
+
+// Makes panic on this thread throw a PanicError for as long as it lives, so
+// worker threads can hand their error to the thread that joins them
+class PanicCapture {
+public:
+    PanicCapture();
+
+    ~PanicCapture();
+
+    PanicCapture(const PanicCapture &) = delete;
+
+    PanicCapture &operator=(const PanicCapture &) = delete;
+};
+
+// Runs body(0) .. body(count - 1) on up to hardware_concurrency() worker
+// threads, handing out indices in order, and waits for all of them
+void parallelFor(size_t count, const std::function<void(size_t)>& body);
+
 
 #endif //APOLLO_UTILS_HPP
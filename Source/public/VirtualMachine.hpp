@@ -0,0 +1,93 @@
+//
+// Created by chineseblack23 on 2024/6/29.
+//字节码虚拟机
+//
+
+#ifndef APOLLO_VIRTUALMACHINE_HPP
+#define APOLLO_VIRTUALMACHINE_HPP
+
+#include <memory>
+#include <unordered_set>
+#include <vector>
+#include "Bytecode.hpp"
+#include "Jit.hpp"
+#include "apollo.hpp"
+
+/**
+ * Runs Bytecode on one growing register stack. A call's frame starts at
+ * the register holding its first argument, so arguments are passed in
+ * place. User functions are compiled the first time they are called and
+ * stay compiled for the life of the machine; code that runs often is
+ * compiled further to machine code by the Jit. A function too large for
+ * the registers is run by the tree walker instead.
+ */
+class VirtualMachine {
+public:
+    VirtualMachine(apollo::Runtime *rt, apollo::ContextChain &ctxChain);
+
+    ~VirtualMachine();
+
+    // Runs top-level code. The globals stay in their registers from one
+    // run to the next, as the program is compiled statement by statement
+    // when streaming.
+    void run(const apollo::Bytecode &program);
+
+    // Copies the defined globals into the global context
+    void storeGlobals(apollo::Context *globals);
+
+    // Compile warm code to machine code (on by default where the Jit has
+    // a backend); off, every instruction is interpreted
+    inline void setJit(bool enabled) { useJit = enabled && Jit::available; }
+
+public:
+    // Slow paths of the instructions, shared with the code the Jit emits
+    [[noreturn]] static void undefinedVariable(AbstractSyntaxTreeNode *origin);
+
+    [[noreturn]] static void notBool(AbstractSyntaxTreeNode *origin);
+
+    static apollo::ValueDeclaration getIndex(const apollo::ValueDeclaration &var, const apollo::ValueDeclaration &idx,
+                                             IndexExpression *origin);
+
+    static void setIndex(apollo::ValueDeclaration &var, const apollo::ValueDeclaration &idx,
+                         apollo::ValueDeclaration rhs, Token opt, AssignExpression *origin);
+
+    // var op= rhs, where an undefined var is defined as rhs
+    static void assignTo(apollo::ValueDeclaration &var, apollo::ValueDeclaration rhs, Token opt);
+
+private:
+    struct Frame {
+        const apollo::Bytecode *code;
+        const apollo::Instruction *pc;
+        size_t base;
+    };
+
+    // Null for a function the Compiler can not fit in the registers
+    const apollo::Bytecode *compiled(apollo::FunctionDeclaration *f);
+
+    // Counts a backward jump or a call of code towards its warmup; true
+    // once it has machine code
+    inline bool warm(const apollo::Bytecode *code, int32_t weight) {
+        if (useJit && code->native == nullptr && (code->warmup -= weight) <= 0) {
+            code->native = Jit::compile(*code, rt);
+            // Compiled once, or never if that failed
+            code->warmup = INT32_MAX;
+        }
+        return code->native != nullptr;
+    }
+
+    void reserve(size_t size);
+
+private:
+    apollo::Runtime *rt;
+    // Handed to builtins
+    apollo::ContextChain *ctxChain;
+    std::vector<apollo::ValueDeclaration> registers;
+    std::vector<Frame> frames;
+    std::vector<std::unique_ptr<apollo::Bytecode>> functions;
+    std::unordered_set<apollo::FunctionDeclaration *> uncompiled;
+    uint32_t globalCount = 0;
+    bool useJit = Jit::available;
+};
+
+
+#endif //APOLLO_VIRTUALMACHINE_HPP
@@ -5,19 +5,30 @@
 #ifndef APOLLO_APOLLO_HPP
 #define APOLLO_APOLLO_HPP
 
+#include <cstdint>
+#include <cstring>
 #include <vector>
 #include <string>
-#include <any>
+#include <string_view>
 #include <unordered_map>
-#include <deque>
+#include <memory>
+#include <span>
+#include "Arena.hpp"
+#include "Symbol.hpp"
 
 using namespace std;
 struct Statement;
 struct Expression;
+class AstImage;
+class Jit;
 
 namespace apollo {
-    enum ValueType {
-        Number, String, Boolean, Null, Array, Object
+    // Number is a double; Integer, a 64-bit integer, is a number to scripts
+    // as well and only promotes to a double when a result does not fit.
+    // Undefined is never a script value: it marks a virtual machine register
+    // whose variable has not been assigned yet.
+    enum ValueType : uint8_t {
+        Number, String, Boolean, Null, Array, Object, Integer, Undefined
     };
     enum ExecutionResultType {
         ExecNormal, ExecReturn, ExecBreak, ExecContinue
@@ -50,112 +61,295 @@ namespace apollo {
     struct Identifier {
         explicit Identifier() = default;
 
-        string name;
+        Symbol name;
     };
 
 
+    // Where a variable lives at run time: slot `slot` of ctxChain[depth].
+    // Depth counts from the outermost context of the chain (the global
+    // context, or the frame of the function being run).
+    struct SlotRef {
+        uint32_t depth;
+        uint32_t slot;
+    };
+
     struct BlockStatement {
         explicit BlockStatement() = default;
 
         std::vector<Statement *> stmts;
+        // Names of the variables this block's context can hold, in slot
+        // order; filled in by the Resolver
+        std::vector<Symbol> locals;
     };
 
 
     struct FunctionDeclaration {
         explicit FunctionDeclaration() = default;
 
-        ~FunctionDeclaration() { delete body; };
-
         struct Identifier id;
         bool expression;
         bool generator;
         bool async;
-        vector<string> params;
+        vector<Symbol> params;
+        // Slot of every parameter in the body's context, set by the Resolver
+        vector<uint32_t> paramSlots;
+        bool resolved = false;
         struct BlockStatement *body{};
         Expression *retExpr{};
+        // Set while the body is still encoded in a cached AST image
+        AstImage *image{};
+        uint32_t imageBody{};
+        // Compiled form, owned by the VirtualMachine that first called it
+        const struct Bytecode *bytecode{};
+        // Block of the flattened body in the function tree of the
+        // FlatInterpreter running it, UINT32_MAX when there is none
+        uint32_t flatBody = UINT32_MAX;
+
+        struct BlockStatement *getBody();
+    };
+
+    struct HeapObject {
+        // Number of values sharing this object; the last one deletes it
+        uint32_t refs = 1;
     };
 
+    struct StringObject;
+    struct ArrayObject;
+
+    /**
+     * A script value in 16 bytes: a type tag and a payload. Integers,
+     * doubles, booleans and null live in the payload itself; strings and arrays
+     * point to a reference counted heap object that copies share. Copying
+     * a value is a bit copy plus, for strings and arrays, one increment,
+     * and the numeric operators never allocate. Arrays are copy-on-write:
+     * mutableArray() copies the elements only while they are shared, so an
+     * array held by one variable is updated in place.
+     *
+     * Strings of up to smallCapacity bytes are kept in the value itself,
+     * right after the tag, and never allocate. Longer ones live in an
+     * immutable, shared StringObject; see appendString for how repeated
+     * concatenation avoids copying the prefix each time.
+     */
     struct ValueDeclaration {
-        explicit ValueDeclaration() {};
+        static constexpr size_t smallCapacity = 14;
 
-        explicit ValueDeclaration(apollo::ValueType type) : type(type) {};
+        explicit ValueDeclaration() = default;
 
-        explicit ValueDeclaration(apollo::ValueType type, std::any data) : type(type), data(std::move(data)) {};
+        explicit ValueDeclaration(apollo::ValueType type) : type(type) {};
 
+        ValueDeclaration(const ValueDeclaration &other) {
+            copyBits(other);
+            retain();
+        }
+
+        ValueDeclaration(ValueDeclaration &&other) noexcept {
+            copyBits(other);
+            other.type = apollo::Null;
+            other.small = 0;
+        }
+
+        ValueDeclaration &operator=(const ValueDeclaration &other) {
+            other.retain();
+            release();
+            copyBits(other);
+            return *this;
+        }
+
+        ValueDeclaration &operator=(ValueDeclaration &&other) noexcept {
+            if (this != &other) {
+                release();
+                copyBits(other);
+                other.type = apollo::Null;
+                other.small = 0;
+            }
+            return *this;
+        }
+
+        ~ValueDeclaration() { release(); }
+
+        static inline ValueDeclaration fromNumber(double number) {
+            ValueDeclaration v(apollo::Number);
+            v.payload.number = number;
+            return v;
+        }
+
+        static inline ValueDeclaration fromInteger(int64_t integer) {
+            ValueDeclaration v(apollo::Integer);
+            v.payload.integer = integer;
+            return v;
+        }
+
+        static inline ValueDeclaration fromBool(bool boolean) {
+            ValueDeclaration v(apollo::Boolean);
+            v.payload.boolean = boolean;
+            return v;
+        }
+
+        static ValueDeclaration fromString(std::string_view str);
+
+        static ValueDeclaration fromString(std::string &&str);
+
+        static ValueDeclaration fromArray(std::vector<ValueDeclaration> elements);
 
         template<int _apollo>
-        inline bool isType();
+        inline bool isType() const;
+
+        inline bool isNumber() const { return type == apollo::Number || type == apollo::Integer; }
+
+        // Unchecked accessors, the caller tests the type first
+        inline double asNumber() const { return payload.number; }
+
+        inline int64_t asInteger() const { return payload.integer; }
 
-        template<typename T>
-        inline T getTypeName();
+        // Either kind of number, as a double
+        inline double toDouble() const {
+            return type == apollo::Integer ? static_cast<double>(payload.integer) : payload.number;
+        }
 
-        template<typename T>
-        inline bool isSameType(T val);
+        inline bool asBool() const { return payload.boolean; }
 
-        template<typename T1, typename T2>
-        inline bool isSameType(T1 val1, T2 val2);
+        // Valid until the value is modified or destroyed
+        inline std::string_view asString() const;
 
-        template<typename _CastingType>
-        inline _CastingType castingType();
+        inline size_t stringSize() const;
 
-        template<typename _DataType>
-        inline void set(_DataType data);
+        // this += tail for a string. Stays inline while it fits; a string
+        // only this value holds grows in place, amortized O(1); a shared
+        // one becomes a rope node that points at the old string and is
+        // flattened the first time it is read.
+        void appendString(std::string_view tail);
 
+        inline const std::vector<ValueDeclaration> &asArray() const;
 
-        template<typename T>
-        inline bool isInt(T value);
+        // The elements, for writing; shared elements are copied first so
+        // the other values keep seeing the old ones
+        inline std::vector<ValueDeclaration> &mutableArray();
 
-        template<>
-        inline bool isInt<int>(int value);
+        ValueDeclaration operator+(const ValueDeclaration &rhs) const;
 
-        template<>
-        inline bool isInt<double>(double value);
+        ValueDeclaration operator-(const ValueDeclaration &rhs) const;
 
-        template<typename T>
-        inline bool isDouble(T value);
+        ValueDeclaration operator*(const ValueDeclaration &rhs) const;
 
-        template<>
-        inline bool isDouble<int>(int value);
+        ValueDeclaration operator/(const ValueDeclaration &rhs) const;
 
-        template<>
-        inline bool isDouble<double>(double value);
+        ValueDeclaration operator%(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator+(ValueDeclaration rhs);
+        ValueDeclaration operator&&(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator-(ValueDeclaration rhs);
+        ValueDeclaration operator||(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator*(ValueDeclaration rhs);
+        ValueDeclaration operator==(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator/(ValueDeclaration rhs);
+        ValueDeclaration operator!=(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator%(ValueDeclaration rhs);
+        ValueDeclaration operator>(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator&&(ValueDeclaration rhs);
+        ValueDeclaration operator>=(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator||(ValueDeclaration rhs);
+        ValueDeclaration operator<(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator==(ValueDeclaration rhs);
+        ValueDeclaration operator<=(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator!=(ValueDeclaration rhs);
+        ValueDeclaration operator&(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator>(ValueDeclaration rhs);
+        ValueDeclaration operator|(const ValueDeclaration &rhs) const;
 
-        ValueDeclaration operator>=(ValueDeclaration rhs);
+        apollo::ValueType type = apollo::Null;
 
-        ValueDeclaration operator<(ValueDeclaration rhs);
+    private:
+        // Its machine code reads and writes values in place
+        friend class ::Jit;
+
+        // `small` of a value whose payload is a HeapObject: an array, or a
+        // string too long to keep inline
+        static constexpr uint8_t onHeap = 0xff;
+
+        inline bool isHeap() const { return small == onHeap; }
+
+        inline void retain() const {
+            if (isHeap()) {
+                payload.object->refs++;
+            }
+        }
+
+        inline void release() {
+            if (isHeap() && --payload.object->refs == 0) {
+                destroy();
+            }
+        }
+
+        // Tag, inline string and payload in one 16 byte copy
+        inline void copyBits(const ValueDeclaration &other) {
+            std::memcpy(static_cast<void *>(this), &other, sizeof(ValueDeclaration));
+        }
+
+        // An inline string runs from smallBytes on into the payload
+        inline char *smallData() { return reinterpret_cast<char *>(this) + 2; }
+
+        inline const char *smallData() const { return reinterpret_cast<const char *>(this) + 2; }
+
+        void destroy();
+
+        void detachArray();
+
+        // Length of an inline string, or onHeap
+        uint8_t small = 0;
+        char smallBytes[6]{};
+        union {
+            double number;
+            int64_t integer;
+            bool boolean;
+            HeapObject *object;
+            StringObject *string;
+            ArrayObject *array;
+        } payload{};
+    };
 
-        ValueDeclaration operator<=(ValueDeclaration rhs);
+    static_assert(sizeof(ValueDeclaration) == 16);
 
-        ValueDeclaration operator&(ValueDeclaration rhs);
+    struct StringObject : HeapObject {
+        // Length of the whole string, including a rope's prefix
+        size_t length = 0;
+        // Set on a rope node: the string is prefix's bytes followed by
+        // value. It is cleared when the node is flattened.
+        StringObject *prefix = nullptr;
+        std::string value;
 
-        ValueDeclaration operator|(ValueDeclaration rhs);
+        inline std::string_view view() {
+            if (prefix != nullptr) {
+                flatten();
+            }
+            return value;
+        }
 
-        ValueDeclaration operator~();
+        void flatten();
+    };
 
-        apollo::ValueType type{};
-        std::any data;
+    struct ArrayObject : HeapObject {
+        std::vector<ValueDeclaration> elements;
     };
 
+    inline std::string_view ValueDeclaration::asString() const {
+        if (small != onHeap) {
+            return {smallData(), small};
+        }
+        return payload.string->view();
+    }
+
+    inline size_t ValueDeclaration::stringSize() const {
+        return small != onHeap ? small : payload.string->length;
+    }
+
+    inline const std::vector<ValueDeclaration> &ValueDeclaration::asArray() const { return payload.array->elements; }
+
+    inline std::vector<ValueDeclaration> &ValueDeclaration::mutableArray() {
+        if (payload.array->refs > 1) {
+            detachArray();
+        }
+        return payload.array->elements;
+    }
+
     struct VariableDeclaration {
         explicit VariableDeclaration() = default;
 
@@ -188,105 +382,208 @@ namespace apollo {
     public:
         explicit Context() = default;
 
+        // A context for a resolved scope, with one slot per name in locals
+        explicit Context(const std::vector<Symbol> *locals);
+
         virtual ~Context();
 
-        bool hasVariable(const string &identName);
+        bool hasVariable(Symbol identName);
 
+        ValueDeclaration *getVariable(Symbol identName);
 
-        void createVariable(const string &identName, ValueDeclaration value);
+        // The value in a slot, or nullptr while the variable is not defined
+        inline ValueDeclaration *getVariable(uint32_t slot) {
+            auto &s = slots[slot];
+            return s.defined ? &s.value : nullptr;
+        }
 
-        VariableDeclaration *getVariable(const string &identName);
+        // Rebinds a pooled context to another scope; the slot array keeps
+        // its capacity
+        void reset(const std::vector<Symbol> *locals);
 
-        void addFunction(const string &name, FunctionDeclaration *f);
+        // Drops every variable, done when the context goes back to the pool
+        void clear();
 
-        bool hasFunction(const string &name);
+        inline void createVariable(uint32_t slot, ValueDeclaration value) {
+            slots[slot].value = std::move(value);
+            slots[slot].defined = true;
+        }
 
-        FunctionDeclaration *getFunctionDeclaration(const string &name);
+        // The global scope gains names as top-level statements are resolved
+        inline void growSlots() { slots.resize(locals->size()); }
 
-    private:
-        std::unordered_map<std::string, VariableDeclaration *> vars;
-        std::unordered_map<std::string, FunctionDeclaration *> funcs;
+        void addFunction(Symbol name, FunctionDeclaration *f);
+
+        bool hasFunction(Symbol name);
+
+        FunctionDeclaration *getFunctionDeclaration(Symbol name);
+
+        // Bumped whenever a name may resolve to a different function, call
+        // sites cache their target for as long as it does not change
+        inline uint32_t getFunctionEpoch() const { return functionEpoch; }
+
+        inline const std::unordered_map<Symbol, FunctionDeclaration *> &getFunctions() const { return funcs; }
+
+    protected:
+        const std::vector<Symbol> *locals = nullptr;
+        // Values live inline, one per resolved name, so defining and reading
+        // a variable never allocates
+        struct Slot {
+            ValueDeclaration value;
+            bool defined = false;
+        };
+        std::vector<Slot> slots;
+        std::unordered_map<Symbol, FunctionDeclaration *> funcs;
+        uint32_t functionEpoch = 1;
     };
 
 
-    class Runtime : public Context {
-        using BuiltinFuncType = ValueDeclaration (*)(Runtime *, deque<Context *>,
-                                                     std::vector<ValueDeclaration>);
+    /**
+     * Backing store of every ContextChain: the live contexts, outermost
+     * first, and a pool of contexts left by exited blocks and calls. Scopes
+     * are recycled from the pool, so entering a block or calling a function
+     * does not allocate once the pool has warmed up.
+     */
+    class ContextStack {
+    public:
+        explicit ContextStack() = default;
+
+        ~ContextStack();
+
+        ContextStack(const ContextStack &) = delete;
+
+        ContextStack &operator=(const ContextStack &) = delete;
+
+        // A context for a scope with the given locals, pooled if possible
+        Context *acquire(const std::vector<Symbol> *locals);
+
+        void release(Context *ctx);
+
+        inline size_t size() const { return live.size(); }
+
+        inline Context *operator[](size_t i) const { return live[i]; }
+
+        inline void push(Context *ctx) { live.push_back(ctx); }
+
+        inline Context *pop() {
+            auto *ctx = live.back();
+            live.pop_back();
+            return ctx;
+        }
+
+    private:
+        std::vector<Context *> live;
+        std::vector<Context *> pool;
+    };
 
+    /**
+     * The contexts visible to the code being run, outermost first. Every
+     * chain is a window onto the Interpreter's ContextStack: a block pushes
+     * its context on top, a function call opens a new window at the current
+     * top. Evaluation borrows the chain by reference, so no container is
+     * copied per node or per call.
+     */
+    class ContextChain {
     public:
-        explicit Runtime();
+        explicit ContextChain(ContextStack &stack) : stack(&stack), base(stack.size()) {}
 
-        bool hasBuiltinFunctionDeclaration(const string &name);
+        // An empty chain on top of this one's stack, for a function frame
+        inline ContextChain openFrame() const { return ContextChain(*stack); }
 
-        BuiltinFuncType getBuiltinFunctionDeclaration(const string &name);
+        inline Context *operator[](size_t depth) const { return (*stack)[base + depth]; }
 
-        void addStatement(Statement *stmt);
+        inline Context *front() const { return (*stack)[base]; }
+
+        inline size_t size() const { return stack->size() - base; }
+
+        inline bool empty() const { return stack->size() == base; }
 
-        vector<Statement *> getStatements();
+        inline void push(Context *ctx) { stack->push(ctx); }
+
+        inline void enter(const std::vector<Symbol> *locals) { stack->push(stack->acquire(locals)); }
+
+        inline void leave() { stack->release(stack->pop()); }
+
+        inline ContextStack &getStack() const { return *stack; }
 
     private:
-        unordered_map<string, BuiltinFuncType> builtin;
-        vector<Statement *> stmts;
+        ContextStack *stack;
+        size_t base;
     };
 
-    template<int _apolloType>
-    inline bool ValueDeclaration::isType() {
-        return this->type == _apolloType;
-    }
+    class Runtime : public Context {
+    public:
+        // Builtins get their arguments already evaluated, as a view into the
+        // runtime's argument stack; they may consume (move from) them
+        using BuiltinFuncType = ValueDeclaration (*)(Runtime *, ContextChain &,
+                                                     std::span<ValueDeclaration>);
 
-    template<typename _CastingType>
-    inline _CastingType ValueDeclaration::castingType() {
-        return std::any_cast<_CastingType>(data);
-    }
+        explicit Runtime();
 
-    template<typename _DataType>
-    inline void ValueDeclaration::set(_DataType data) {
-        this->data = std::make_any<_DataType>(std::move(data));
-    }
+        ~Runtime() override;
 
-    template<typename T>
-    T ValueDeclaration::getTypeName() {
-        return typeid(T).name();
-    }
+        bool hasBuiltinFunctionDeclaration(Symbol name);
 
-    template<typename T>
-    bool ValueDeclaration::isSameType(T val) {
-        return typeid(val) == typeid(T);
-    }
+        BuiltinFuncType getBuiltinFunctionDeclaration(Symbol name);
 
-    template<typename T1, typename T2>
-    bool ValueDeclaration::isSameType(T1 val1, T2 val2) {
-        return typeid(val1) == typeid(val2);
-    }
+        // Adds or replaces a native function; call sites rebind on their next run
+        void registerBuiltin(const string &name, BuiltinFuncType f);
 
-    template<>
-    bool ValueDeclaration::isInt<int>(int value) {
-        return false;
-    }
+        inline vector<ValueDeclaration> &getArgumentStack() { return argStack; }
 
-    template<typename T>
-    bool ValueDeclaration::isInt(T value) {
-        return false;
-    }
+        void addStatement(Statement *stmt);
 
-    template<>
-    bool ValueDeclaration::isInt<double>(double value) {
-        return false;
-    }
+        inline const vector<Statement *> &getStatements() const { return stmts; }
 
-    template<typename T>
-    bool ValueDeclaration::isDouble(T value) {
-        return false;
-    }
+        inline vector<Statement *> &getStatements() { return stmts; }
 
-    template<>
-    bool ValueDeclaration::isDouble<int>(int value) {
-        return false;
-    }
+        // Fold constants and drop dead code before resolving (on by default)
+        inline void setOptimize(bool enabled) { optimize = enabled; }
+
+        inline bool shouldOptimize() const { return optimize; }
+
+        inline AstArena &getArena() { return *arenas.front(); }
+
+        // Names of the top-level variables, in slot order
+        inline std::vector<Symbol> &getGlobals() { return globals; }
+
+        void adoptImage(std::unique_ptr<AstImage> image);
 
-    template<>
-    bool ValueDeclaration::isDouble<double>(double value) {
-        return true;
+        // Declarations are owned apart from the arenas, so they outlive
+        // releaseSyntaxTrees
+        FunctionDeclaration *adoptFunction(std::unique_ptr<FunctionDeclaration> f);
+
+        // The functions adopted so far, in declaration order
+        inline const vector<std::unique_ptr<FunctionDeclaration>> &getDeclarations() const { return declarations; }
+
+        // Frees every statement and function body, for an engine that has
+        // copied what it runs; functions keep their names and parameters
+        void releaseSyntaxTrees();
+
+        // Moves a separately parsed compilation unit into this runtime: its
+        // statements are appended, its functions are added in declaration
+        // order (a name defined twice is a SyntaxError) and its arenas and
+        // images change owner
+        void absorb(Runtime &unit);
+
+    private:
+        unordered_map<Symbol, BuiltinFuncType> builtin;
+        // Arguments of the builtin calls in progress, nested calls stack up
+        vector<ValueDeclaration> argStack;
+        vector<Statement *> stmts;
+        vector<Symbol> globals;
+        bool optimize = true;
+        // Own every AST node parsed into this runtime; the first one is ours,
+        // the rest were absorbed from other units
+        vector<std::unique_ptr<AstArena>> arenas;
+        vector<std::unique_ptr<FunctionDeclaration>> declarations;
+        // Cached AST images that lazily loaded function bodies still point into
+        vector<std::unique_ptr<AstImage>> images;
+    };
+
+    template<int _apolloType>
+    inline bool ValueDeclaration::isType() const {
+        return this->type == _apolloType;
     }
 
 }
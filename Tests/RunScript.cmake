@@ -0,0 +1,47 @@
+# 运行一个测试脚本并比较输出
+#
+# cmake -DAPOLLO=<Apollo> -DSCRIPT=<file.apollo> -DENGINE=<ast|vm|flat> -DCACHE_DIR=<dir> -P RunScript.cmake
+#
+# Runs the script on ENGINE optimized, with --no-optimize and with
+# --no-jit, then twice through an empty AST cache in CACHE_DIR: the first
+# run misses and writes the image, the second loads it. Every run must
+# exit normally and print exactly the contents of the script's .expected
+# file. Options for all runs, such as --stream, may be given in the
+# script's .options file.
+
+cmake_minimum_required(VERSION 3.22)
+
+get_filename_component(dir "${SCRIPT}" DIRECTORY)
+get_filename_component(name "${SCRIPT}" NAME_WE)
+file(READ "${dir}/${name}.expected" expected)
+set(options "")
+if (EXISTS "${dir}/${name}.options")
+    file(STRINGS "${dir}/${name}.options" options)
+endif ()
+
+file(REMOVE_RECURSE "${CACHE_DIR}")
+set(ENV{APOLLO_CACHE_DIR} "${CACHE_DIR}")
+
+function(run label)
+    execute_process(COMMAND "${APOLLO}" --engine=${ENGINE} ${options} ${ARGN} "${SCRIPT}"
+            OUTPUT_VARIABLE actual
+            ERROR_VARIABLE errors
+            RESULT_VARIABLE rc)
+    if (NOT rc EQUAL 0)
+        message(FATAL_ERROR "${name} (${ENGINE}, ${label}) exited with ${rc}\n${actual}${errors}")
+    endif ()
+    if (NOT actual STREQUAL expected)
+        message(FATAL_ERROR "${name} (${ENGINE}, ${label}) printed\n${actual}\nexpected\n${expected}")
+    endif ()
+endfunction()
+
+run("optimized" --no-cache)
+run("--no-optimize" --no-cache --no-optimize)
+run("--no-jit" --no-cache --no-jit)
+run("cache miss")
+file(GLOB images "${CACHE_DIR}/*.apc")
+if (NOT "--stream" IN_LIST options AND images STREQUAL "")
+    message(FATAL_ERROR "${name} (${ENGINE}) wrote no AST cache image to ${CACHE_DIR}")
+endif ()
+run("cache hit")
+file(REMOVE_RECURSE "${CACHE_DIR}")
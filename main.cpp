@@ -1,5 +1,21 @@
-
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "Interpreter.hpp"
 
 int main(int arg, char *argv[]) {
+    std::vector<std::string> files;
+    for (int i = 1; i < arg; i++) {
+        if (std::string(argv[i]).rfind("--", 0) != 0) {
+            files.emplace_back(argv[i]);
+        }
+    }
+    if (files.empty()) {
+        std::fprintf(stderr, "usage: %s [--stream] [--no-cache] [--no-optimize] [--no-jit] [--engine=ast|vm|flat] <file>...\n", argv[0]);
+        return 1;
+    }
+    Interpreter interpreter(files);
+    interpreter.parseCommandOption(arg, argv);
+    interpreter.execute();
     return 0;
-}
\ No newline at end of file
+}